@@ -14,6 +14,10 @@ typedef struct CPU_State CPU_State;
 #include "modules.h"
 #include "syscall.h"
 
+// bytes allocated for a stack of size usable bytes: the headroom, and the slack of the first value starting at
+// stack_base - sizeof(vm_type_signed_t) + sizeof(vm_value_t)
+#define VM_STACK_ALLOC_SIZE(size) ((size) + (VM_STACK_HEADROOM + 1) * sizeof(vm_value_t))
+
 typedef struct Stacktrace_Frame {
     const char* name;
     const char* filename;
@@ -36,6 +40,10 @@ typedef struct CPU_State {
     vm_type_t pc, sp, mp, ap;
     vm_value_t rr, r0, r1, r2, r3, r4, r5, r6, r7;
     vm_type_t stack_base;
+    vm_type_t stack_size;     // usable bytes of the stack, see cpu_set_stack_size()
+    vm_type_t max_stack_size; // bytes the stack may grow to, equal to stack_size if it may not grow
+    vm_type_t stack_limit;    // highest sp that still leaves VM_STACK_HEADROOM values of room
+    vm_pointer_t retired_stacks; // blocks the stack grew out of, see cpu_grow_stack()
 
     // state
     int running;
@@ -48,12 +56,66 @@ typedef struct CPU_State {
     char** module_paths;
     vm_type_t num_module_paths;
 
+    // where module_find_filename() found modules, or did not, by name, see modules.c
+    vm_module_cache_entry_t* module_cache;
+    vm_type_t num_module_cache_entries;
+    vm_type_t module_cache_size;
+    int module_paths_scanned;      // every module in the search paths is in the cache, see module_scan_paths()
+    unsigned long module_probes;   // access() calls and directory scans
+    unsigned long module_cache_hits;
+
+    // decoded code of the module that is currently executing, see cpu_fetch()
+    vm_pointer_t code_base;
+    vm_type_t code_size;
+    vm_instruction_t* code;
+    vm_type_t* code_index;
+    vm_instruction_t code_scratch;
+
+    vm_map_cache_t* map_caches;
+
+    vm_instruction_t* instr;
+    vm_operand_t* operands;
+
+    // hidden classes of maps, see instr_map_cache.c
+    vm_map_shape_t* map_shapes;
+    vm_type_t num_map_shapes;
+    vm_type_t* map_shape_index;
+    vm_type_t map_shape_index_size;
+
+    // interned strings, see atoms.c
+    vm_atom_slot_t* atoms;
+    vm_type_t num_atoms;
+    vm_type_t atoms_size;
+
+    // candidate roots of garbage cycles, see cycles.c
+    vm_cycle_slot_t* cycle_roots;
+    vm_type_t num_cycle_roots;
+    vm_type_t cycle_roots_size;
+    vm_type_t cycle_threshold; // 0 turns the cycle collector off
+    vm_cycle_stats_t cycle_stats;
+
+    // maps and arrays whose refcount went to zero and that still have to be freed, see release_deferred()
+    vm_pointer_t released_maps;
+    vm_pointer_t released_arrays;
+    vm_type_t release_slice; // objects freed per safe point, 0 frees them before release() returns
+    int releasing;
+
+    int safepoint_pending; // there is work for cpu_safepoint()
+
     vm_syscall_table_t* syscall_table;
     vm_type_t num_syscalls;
+    vm_type_t syscall_table_size;
+    vm_type_t* syscall_index; // open addressing by hash into syscall_table, VM_UNSIGNED_MAX for a free slot
+    vm_type_t syscall_index_size;
 
-    #ifdef FUNKY_VM_OS_EMSCRIPTEN
-    int emscripten_yield;
-    #endif
+    int yield_pending; // cpu_yield() was called, the current slice ends at the next safe point
+
+    // fibers, see fibers.c; NULL until the first fiber.spawn. The running fiber uses the registers above.
+    vm_fiber_t* fibers;
+    vm_type_t num_fibers;     // slots in use, including free slots below the last one in use
+    vm_type_t fibers_size;
+    vm_type_t current_fiber;
+    vm_type_t fiber_quantum;  // backward branches and calls per turn, 0 switches fibers only when they yield or wait
 
     struct boxing {
         vm_pointer_t proto_int;
@@ -68,14 +130,35 @@ typedef struct CPU_State {
 
 } CPU_State;
 
+/*
+ * How a slice of execution ended, see cpu_run_slice().
+ */
+typedef enum vm_run_status_t {
+    VM_RUN_HALTED,   // the program ended
+    VM_RUN_BUDGET,   // the budget ran out, the next slice continues where this one stopped
+    VM_RUN_YIELDED,  // cpu_yield() was called, the next slice continues where this one stopped
+    VM_RUN_ERROR     // the program ended in an error
+} vm_run_status_t;
+
 CPU_State cpu_init(Memory* memory);
 void cpu_reset(CPU_State *state);
 void cpu_destroy(CPU_State *state);
 void cpu_set_entry_to_module(CPU_State *state, Module *mod);
 vm_type_t cpu_run(CPU_State *state);
-
-#ifdef FUNKY_VM_OS_EMSCRIPTEN
-void cpu_emscripten_yield(CPU_State *state);
-#endif
+vm_run_status_t cpu_run_slice(CPU_State *state, vm_type_t budget);
+void cpu_yield(CPU_State *state);
+void cpu_invalidate_code(CPU_State *state);
+vm_instruction_t *cpu_decode(CPU_State *state, vm_pointer_t pc);
+void cpu_set_stack_size(CPU_State *state, vm_type_t size, vm_type_t max_size);
+int cpu_grow_stack(CPU_State *state, vm_type_t num_values);
+void cpu_free_retired_stacks(CPU_State *state, vm_pointer_t *blocks);
+void cpu_set_release_slice(CPU_State *state, vm_type_t max_objects);
+void cpu_safepoint(CPU_State *state);
+void cpu_set_cycle_threshold(CPU_State *state, vm_type_t threshold);
+void cpu_collect_cycles(CPU_State *state);
+void cpu_print_cycle_stats(CPU_State *state);
+void cpu_set_fiber_quantum(CPU_State *state, vm_type_t quantum);
+int cpu_save_snapshot(CPU_State *state, const char *filename);
+int cpu_restore_snapshot(CPU_State *state, const char *filename);
 
 #endif //PROCESSOR_CPU_H
@@ -52,7 +52,14 @@
 #endif
 
 #define VM_MEMORY_LIMIT (1024 * 1024) // one whole meg!
+#define VM_MEMORY_MAX_LIMIT (256 * 1024 * 1024) // address space a heap made by memory_create() may grow into
 #define VM_STACK_SIZE (sizeof(vm_value_t) * 1024)
+#define VM_STACK_MAX_SIZE VM_STACK_SIZE // the stack does not grow unless cpu_set_stack_size() allows it
+// values an instruction sequence may push between two stack checks, allocated beyond the usable stack size
+#define VM_STACK_HEADROOM 512
+#define VM_CYCLE_THRESHOLD 4096 // candidate roots that trigger a cycle collection, see cycles.c
+#define VM_FIBER_STACK_SIZE (sizeof(vm_value_t) * 64) // initial stack of a fiber, it grows like the main stack
+#define VM_FIBER_QUANTUM 1024 // backward branches and calls before the next fiber gets its turn, see fibers.c
 
 enum vm_value_type_t {
     VM_TYPE_INT = 0,
@@ -63,7 +70,8 @@ enum vm_value_type_t {
     VM_TYPE_MAP,      // address of a custom type (vm_obj_t)
     VM_TYPE_ARRAY,
     VM_TYPE_EMPTY,
-    VM_TYPE_UNKNOWN
+    VM_TYPE_UNKNOWN,
+    VM_TYPE_RETIRED   // a slot of a block the stack grew out of, see cpu_grow_stack()
 };
 
 typedef struct {
@@ -79,14 +87,87 @@ typedef struct {
     };
 } vm_value_t;
 
+/*
+ * A string is a refcount followed by its characters, NUL-terminated; a string pointer points at the refcount. Strings
+ * the VM creates are preceded by a vm_string_header_t. Static strings in the code of a module have no header and a
+ * refcount of VM_STRING_RAW; the ones ld.str loads are replaced by atoms when the module is registered (see atoms.c),
+ * which do have one.
+ */
 typedef struct {
-    vm_pointer_t name;
-    vm_value_t value;
+    vm_type_t length; // in bytes, not counting the NUL
+    vm_type_t hash;   // map_hash() of the characters, 0 until it is first needed
+} vm_string_header_t;
+
+#define VM_STRING_RAW VM_UNSIGNED_MAX
 
-    vm_pointer_t next;
-    vm_pointer_t prev;
+/*
+ * A map is a header of three words: refcount, pointer to its vm_map_table_t (0 while empty) and prototype.
+ * The table is followed in memory by `capacity` entries, kept in insertion order, and `index_size` index slots. Each
+ * index slot holds the position of an entry plus one, 0 marks a free slot. Small maps have no index and are scanned.
+ */
+typedef struct {
+    vm_pointer_t name; // atom, 0 once the entry has been deleted
+    vm_type_t hash;
+    vm_value_t value;
 } vm_map_elem_t;
 
+typedef struct {
+    vm_type_t count;      // live entries
+    vm_type_t used;       // entries taken, including deleted ones
+    vm_type_t capacity;
+    vm_type_t index_size; // power of two, or 0 for small maps
+    vm_type_t shape;      // see map_shape_transition()
+} vm_map_table_t;
+
+#define VM_MAP_SHAPE_NONE  0 // the map had items deleted or renamed, or too many items, and is not tracked
+#define VM_MAP_SHAPE_EMPTY 1
+
+typedef struct {
+    vm_type_t parent;
+    vm_type_t hash;
+    vm_pointer_t name;  // atom of the item the parent shape was extended with
+    vm_type_t num_keys;
+} vm_map_shape_t;
+
+typedef struct {
+    vm_pointer_t atom;  // 0 for a free slot
+    vm_type_t hash;
+} vm_atom_slot_t;
+
+typedef struct {
+    vm_pointer_t ptr;     // map or array, 0 for a free slot
+    unsigned char type;   // VM_TYPE_MAP or VM_TYPE_ARRAY
+    unsigned char colour; // only used while collecting
+} vm_cycle_slot_t;
+
+typedef struct {
+    unsigned long collections;
+    unsigned long roots;  // candidates looked at
+    unsigned long maps;   // maps freed as part of a garbage cycle
+    unsigned long arrays; // arrays freed as part of a garbage cycle
+} vm_cycle_stats_t;
+
+enum vm_fiber_status_t {
+    VM_FIBER_FREE = 0,  // the slot can be reused
+    VM_FIBER_RUNNABLE,
+    VM_FIBER_WAITING,   // in fiber.join, for the fiber in joining
+    VM_FIBER_DONE       // returned, its result is in rr until it is joined
+};
+
+/*
+ * The registers and stack of a fiber while another fiber runs, see fibers.c.
+ */
+typedef struct {
+    vm_type_t pc, sp, mp, ap;
+    vm_value_t rr, r0, r1, r2, r3, r4, r5, r6, r7;
+    vm_type_t stack_base;
+    vm_type_t stack_size;
+    vm_type_t stack_limit;
+    vm_pointer_t retired_stacks;
+    vm_type_t joining;
+    unsigned char status;
+} vm_fiber_t;
+
 #ifndef FUNKY_BYTECODE_TYPES_DEFINED
 #define FUNKY_BYTECODE_TYPES_DEFINED
 typedef unsigned char byte_t;
@@ -100,5 +181,6 @@ typedef struct funky_bytecode_t {
 #include "modules.h"
 #include "memory.h"
 #include "syscall.h"
+#include "host.h"
 
 #endif //VM_H
@@ -0,0 +1,49 @@
+#ifndef FUNKY_VM_HOST_H
+#define FUNKY_VM_HOST_H
+
+#include <stddef.h>
+
+#include "funkyvm.h"
+
+/*
+ * Runs a batch of kernels on a pool of OS threads, see host.c. Every worker creates a fresh heap and VM for each job it
+ * runs, so jobs never share any state. Jobs are dealt out to the workers up front; a worker that runs out of jobs
+ * steals them from the others.
+ */
+
+/*
+ * Called for every VM the pool creates, before the kernel of the job is loaded. This is where the host registers its
+ * module search paths and syscalls. Runs on the worker thread, so it must not touch anything that is not thread safe.
+ */
+typedef void (*vm_host_setup_t)(CPU_State *state, void *userdata);
+
+typedef struct vm_host_job_t {
+    const char *kernel;  // module name, resolved with the search paths the setup callback registers
+    vm_type_t result;    // what cpu_run() returned
+    int failed;          // the kernel could not be loaded or ended in an error
+    int worker;          // index of the worker that ran the job
+} vm_host_job_t;
+
+typedef struct vm_host_worker_stats_t {
+    unsigned long jobs;    // jobs run, including the stolen ones
+    unsigned long stolen;  // jobs taken from the queue of another worker
+    double busy_time;      // seconds spent running jobs
+    double wall_time;      // seconds from the start of the batch until the worker ran out of jobs
+} vm_host_worker_stats_t;
+
+typedef struct vm_host_options_t {
+    int num_workers;         // 0 for one per online processor
+    size_t heap_size;        // initial heap of every VM, see memory_create()
+    size_t max_heap_size;
+    vm_type_t stack_size;    // in values, 0 keeps the defaults, see cpu_set_stack_size()
+    vm_type_t max_stack_size;
+    vm_type_t cycle_threshold; // see cpu_set_cycle_threshold()
+    vm_type_t release_slice;   // see cpu_set_release_slice()
+    vm_host_setup_t setup;
+    void *userdata;
+} vm_host_options_t;
+
+int vm_host_default_workers();
+int vm_host_run(vm_host_job_t *jobs, size_t num_jobs, const vm_host_options_t *options, vm_host_worker_stats_t *stats);
+
+#endif //FUNKY_VM_HOST_H
@@ -5,16 +5,75 @@
 
 #define VM_PAGE_SIZE 4096
 
+typedef unsigned long vm_bitmap_word_t;
+#define VM_BITMAP_WORD_BITS ((vm_type_t) (sizeof(vm_bitmap_word_t) * 8))
+
+/*
+ * Bookkeeping of the liballoc allocator (liballoc_1_1.c). It lives in the Memory it allocates from rather than in
+ * liballoc itself, so every Memory is a heap of its own and VMs in the same process do not share any state.
+ */
+typedef struct vm_allocator_t {
+    struct liballoc_major *mem_root;  // the root memory block acquired from the page allocator
+    struct liballoc_major *best_bet;  // the major block with the most free memory
+    unsigned long long allocated;     // running total of allocated memory
+    unsigned long long inuse;         // running total of used memory
+    long long warning_count;
+    long long error_count;
+    long long possible_overruns;
+} vm_allocator_t;
+
+#define VM_SLAB_NUM_CLASSES 8
+#define VM_SLAB_MAX_SIZE 256
+#define VM_SLAB_NONE ((vm_type_t) VM_UNSIGNED_MAX)
+
+/*
+ * A page of the heap that is used as a slab: it is cut into blocks of a single size class, see slab.c. The pages of a
+ * class that still have free blocks are linked together by page number.
+ */
+typedef struct vm_slab_page_t {
+    unsigned char size_class; // 0 if the page is not a slab, otherwise its size class + 1
+    vm_type_t used;           // blocks handed out
+    vm_type_t bump;           // offset in the page of the first block that was never handed out
+    vm_pointer_t free;        // first freed block, every free block holds the address of the next one
+    vm_type_t prev, next;     // page numbers in the list of pages with free blocks
+} vm_slab_page_t;
+
+typedef struct vm_slab_class_t {
+    vm_type_t partial;        // first page of the class with free blocks
+    vm_type_t num_pages;
+    unsigned long long allocs, frees;
+} vm_slab_class_t;
+
+/*
+ * The size-class allocator in front of liballoc. Requests up to VM_SLAB_MAX_SIZE bytes are served from slabs, larger
+ * ones from liballoc; large_allocs and large_frees count the latter.
+ */
+typedef struct vm_slab_t {
+    vm_slab_class_t classes[VM_SLAB_NUM_CLASSES];
+    vm_slab_page_t *pages;    // one per page of the heap
+    unsigned long long large_allocs, large_frees;
+} vm_slab_t;
+
 typedef struct {
     unsigned char* main_memory;
-    unsigned char* bitmap;
-    vm_type_t bitmap_size;
+    vm_type_t size;             // bytes of the heap in use by the page allocator
+    vm_type_t max_size;         // bytes reserved for the heap, it grows up to this size
+    int reserved;               // main_memory was reserved by memory_create() and is released by memory_destroy()
+    vm_bitmap_word_t* bitmap;   // one bit per page, set if the page is free
+    vm_type_t bitmap_words;
+    vm_type_t first_free;       // no page below this one is free
+    vm_allocator_t allocator;
+    vm_slab_t slab;
     int lock;
 } Memory;
 
 void memory_init(Memory *mem, unsigned char *main_memory);
+int memory_create(Memory *mem, size_t size, size_t max_size);
 void memory_destroy(Memory *mem);
 void memory_print_bitmap_debug(Memory *mem);
+void memory_print_allocations(Memory *mem);
+vm_type_t memory_alloc(Memory* mem, vm_type_t num_pages);
+void memory_free(Memory *mem, vm_type_t addr, vm_type_t num_pages);
 
 #if defined(VM_NATIVE_MALLOC) && VM_NATIVE_MALLOC
 
@@ -49,6 +108,7 @@ void memory_print_bitmap_debug(Memory *mem);
 void retain(CPU_State *state, vm_value_t *ptr);
 void release(CPU_State *state, vm_value_t *ptr);
 void release_pointer(CPU_State *state, enum vm_value_type_t type, vm_pointer_t ptr);
+int release_deferred(CPU_State *state, vm_type_t max_objects);
 void retain_pointer(CPU_State *state, enum vm_value_type_t type, vm_pointer_t ptr);
 char *cstr_pointer_from_vm_pointer_t(CPU_State* state, vm_pointer_t ptr);
 char *cstr_pointer_from_vm_value(CPU_State* state, vm_value_t* val);
@@ -11,25 +11,111 @@ typedef struct Module Module;
 #include "memory.h"
 #include "cpu.h"
 
+#define VM_MAX_OPERANDS 3
+#define VM_MAX_INSTRUCTION_LENGTH (1 + VM_MAX_OPERANDS * sizeof(vm_type_t))
+
+typedef union vm_operand_t {
+    vm_type_t uint_value;
+    vm_type_signed_t int_value;
+    vm_type_float_t float_value;
+} vm_operand_t;
+
+/*
+ * A decoded instruction. Every loaded module keeps one of these per byte of its code, indexed by the offset of the
+ * instruction in the module, so the dispatcher never has to decode the same bytes twice. A length of 0 means the
+ * record has not been decoded yet; its opcode is then VM_OPCODE_UNDECODED.
+ */
+typedef struct vm_instruction_t {
+    void (*impl)(CPU_State *state);
+    vm_operand_t operands[VM_MAX_OPERANDS];
+    unsigned short opcode;
+    unsigned char length;
+} vm_instruction_t;
+
+#define VM_MAP_CACHE_WAYS 4
+
+typedef struct vm_map_cache_entry_t {
+    vm_type_t shape;        // of the map the item was looked up in, VM_MAP_SHAPE_NONE for an unused entry
+    vm_type_t holder_shape; // of the prototype the item was found in, VM_MAP_SHAPE_NONE if it is in the map itself
+    vm_pointer_t prototype;
+    vm_type_t position;
+    vm_type_t new_shape;    // st.mapitem adding the item: shape of the map afterwards
+} vm_map_cache_entry_t;
+
+/*
+ * Inline cache of an ld.mapitem or st.mapitem site, see instr_map_cache.c.
+ */
+typedef struct vm_map_cache_t {
+    vm_map_cache_entry_t entries[VM_MAP_CACHE_WAYS];
+    vm_type_t next_entry;
+    vm_type_t offset;
+    vm_pointer_t name;
+    vm_type_t hash;
+    uint64_t hits, misses;
+} vm_map_cache_t;
+
+/*
+ * What module_find_filename() found for a module name, see modules.c. A NULL filename records that there is no such
+ * module.
+ */
+typedef struct vm_module_cache_entry_t {
+    char* name;     // NULL for a free slot
+    char* filename;
+    vm_type_t hash;
+} vm_module_cache_entry_t;
+
+/*
+ * An entry of the export table of a module, with the name hashed and the reference resolved, see
+ * module_index_exports().
+ */
+typedef struct vm_module_export_t {
+    vm_pointer_t name;
+    vm_type_t hash;
+    vm_pointer_t addr;
+} vm_module_export_t;
+
 typedef struct Module {
     char* name;
     vm_pointer_t addr;
     vm_type_t num_exports;
+    vm_module_export_t* exports;   // in the order of the export table
+    vm_type_t* export_index;       // open addressing by hash into exports, VM_UNSIGNED_MAX for a free slot
+    vm_type_t export_index_size;
     vm_type_t start_of_code;
     vm_type_t size;
+    vm_type_t mapped_pages; // pages the file is mapped into, see module_map(), or 0 if the code was copied
     vm_pointer_t ref_map;
     vm_type_t num_links;
+    vm_instruction_t* code;        // one record per decoded instruction, code[0] stands in for the rest, see module_decode()
+    vm_type_t* code_index;         // the record of every byte offset of the module, 0 if it was not decoded
+    vm_type_t num_instructions;
+    vm_type_t instructions_size;
+    vm_type_t* fusions;
+    vm_map_cache_t* map_caches;
+    vm_type_t num_map_caches;
 } Module;
 
 Module module_load_name(CPU_State* state, const char* name);
 Module module_load(Memory *mem, const char* name, funky_bytecode_t bc);
+void module_decode(Module *module, const byte_t *native_module_addr);
+vm_instruction_t *module_decode_instruction(Module *module, const byte_t *native_module_addr, vm_type_t offset);
+void module_index_exports(Memory *mem, Module *module);
+vm_module_export_t *module_find_export(Memory *mem, Module *module, const char *name);
+void module_restore(CPU_State *state, Module *module, const char *name);
+void module_print_fusions(Module *module);
+void module_print_map_caches(CPU_State *state, Module *module);
 void module_unload(Memory *mem, Module module);
 int module_register(CPU_State *state, Module module);
 int module_release(CPU_State *state, const char* name);
 Module *module_get(CPU_State *state, const char* name);
 int module_register_path(CPU_State *state, const char* path);
+char* module_find_filename(CPU_State *state, const char* name);
 int module_exists(CPU_State *state, const char* name);
+int module_scan_paths(CPU_State *state);
+void module_clear_cache(CPU_State *state);
+void module_print_cache(CPU_State *state);
 
+Module* module_at_address(CPU_State *state, vm_pointer_t addr);
 Module* get_current_module(CPU_State *state);
 
 #endif //VM_MODULES_H
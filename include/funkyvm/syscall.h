@@ -36,18 +36,59 @@
 
 typedef void (*vm_syscall_t)(CPU_State *state);
 
+/*
+ * Typed syscalls declare their arguments, see register_syscall_typed(). The VM checks the arguments against the
+ * declaration and passes them unboxed, so the syscall neither looks at the stack nor checks any types itself.
+ */
+#define VM_SYSCALL_MAX_ARGS 8
+
+typedef enum vm_syscall_type_t {
+    VM_SYSCALL_EMPTY,   // result only: the syscall returns nothing and rr is left as it was
+    VM_SYSCALL_INT,     // an int, or a uint taken as one
+    VM_SYSCALL_UINT,    // a uint, or an int taken as one
+    VM_SYSCALL_FLOAT,
+    VM_SYSCALL_STRING,  // argument only: the characters and length, valid until the syscall returns
+    VM_SYSCALL_VALUE    // any value, as it is on the stack
+} vm_syscall_type_t;
+
+typedef union vm_syscall_value_t {
+    vm_type_signed_t int_value;
+    vm_type_t uint_value;
+    vm_type_float_t float_value;
+    struct {
+        const char *chars;
+        vm_type_t length;
+    } string;
+    vm_value_t value;
+} vm_syscall_value_t;
+
+/*
+ * args[0] is the argument that was pushed first. The result is stored in rr with the declared result type.
+ */
+typedef vm_syscall_value_t (*vm_syscall_typed_t)(CPU_State *state, const vm_syscall_value_t *args);
+
 typedef struct vm_syscall_table_t {
     const char* name;
     vm_syscall_t fn;
+    vm_syscall_typed_t typed_fn; // NULL for a regular syscall
+    vm_type_t hash;
+    unsigned char num_args;
+    unsigned char arg_types[VM_SYSCALL_MAX_ARGS];
+    unsigned char result_type;
 } vm_syscall_table_t;
 
 int register_syscall(CPU_State* state, const char* name, vm_syscall_t fn);
+int register_syscall_typed(CPU_State* state, const char* name, vm_syscall_typed_t fn, vm_syscall_type_t result_type,
+                           int num_args, const vm_syscall_type_t *arg_types);
 int release_syscall(CPU_State* state, const char* name);
+int find_syscall(CPU_State* state, const char* name);
+void destroy_syscalls(CPU_State* state);
 
 vm_value_t vm_create_string(CPU_State* state, const char* c_str);
 vm_value_t vm_create_array(CPU_State* state);
 void vm_array_set_at(CPU_State *state, vm_value_t array, vm_type_t index, vm_value_t value);
 void vm_array_append(CPU_State *state, vm_value_t array, vm_value_t value);
 void vm_array_resize(CPU_State *state, vm_value_t array, vm_type_t size);
+void vm_array_reserve(CPU_State *state, vm_value_t array, vm_type_t capacity);
 
 #endif //FUNKY_VM_SYSCALL_H
@@ -3,14 +3,74 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "bindings.h"
 
-void print(CPU_State *state) {
-    const char* str = cstr_pointer_from_vm_value(state, STACK_VALUE(state, 0));
-    printf("%s", str);
+/*
+ * Prints any value: strings as they are, numbers the way conv.str writes them.
+ */
+vm_syscall_value_t print(CPU_State *state, const vm_syscall_value_t *args) {
+    vm_value_t value = args[0].value;
+    switch (value.type) {
+        case VM_TYPE_STRING:
+            printf("%s", cstr_pointer_from_vm_value(state, &value));
+            break;
+        case VM_TYPE_INT:
+            printf("%lld", (long long) value.int_value);
+            break;
+        case VM_TYPE_UINT:
+            printf("%llu", (unsigned long long) value.uint_value);
+            break;
+        case VM_TYPE_FLOAT:
+            printf("%f", value.float_value);
+            break;
+        case VM_TYPE_MAP:
+            printf("(map)");
+            break;
+        case VM_TYPE_ARRAY:
+            printf("(array)");
+            break;
+        case VM_TYPE_REF:
+            printf("(reference)");
+            break;
+        default:
+            break;
+    }
+    return (vm_syscall_value_t) { 0 };
+}
+
+/*
+ * Saves the VM to the file given, see cpu_save_snapshot(). Returns 0 to the VM that saved it and 1 to every VM that is
+ * restored from it, or -1 if the file could not be written.
+ */
+vm_syscall_value_t snapshot(CPU_State *state, const vm_syscall_value_t *args) {
+    char *filename = malloc(args[0].string.length + 1);
+    memcpy(filename, args[0].string.chars, args[0].string.length);
+    filename[args[0].string.length] = '\0';
+
+    vm_value_t rr = state->rr;
+    state->rr = (vm_value_t) { .type = VM_TYPE_INT, .int_value = 1 };
+    int saved = cpu_save_snapshot(state, filename);
+    state->rr = rr;
+
+    free(filename);
+    return (vm_syscall_value_t) { .int_value = saved ? 0 : -1 };
+}
+
+/*
+ * Gives the host its thread back, see cpu_yield().
+ */
+vm_syscall_value_t yield(CPU_State *state, const vm_syscall_value_t *args) {
+    cpu_yield(state);
+    return (vm_syscall_value_t) { 0 };
 }
 
 void register_bindings(CPU_State *state) {
-    register_syscall(state, "print", print);
+    static const vm_syscall_type_t print_args[] = { VM_SYSCALL_VALUE };
+    register_syscall_typed(state, "print", print, VM_SYSCALL_EMPTY, 1, print_args);
+    static const vm_syscall_type_t snapshot_args[] = { VM_SYSCALL_STRING };
+    register_syscall_typed(state, "snapshot", snapshot, VM_SYSCALL_INT, 1, snapshot_args);
+    register_syscall_typed(state, "yield", yield, VM_SYSCALL_EMPTY, 0, NULL);
 }
@@ -14,24 +14,109 @@
 #include "bindings.h"
 #include "performance.h"
 
+typedef struct host_setup_t {
+    const char **library_paths;
+    int num_library_paths;
+    int scan_library_paths;
+} host_setup_t;
+
+static void setup_state(CPU_State *state, void *userdata) {
+    host_setup_t *setup = userdata;
+
+    for (int i = 0; i < setup->num_library_paths; i++) {
+        module_register_path(state, setup->library_paths[i]);
+    }
+
+#if defined(FUNKY_VM_OS_MACOS)
+    module_register_path(state, "/usr/local/lib/funky");
+    module_register_path(state, "/usr/lib/funky");
+    module_register_path(state, "/lib/funky");
+    module_register_path(state, "/System/Library/Funky");
+    module_register_path(state, "/Library/Funky");
+    module_register_path(state, "~/Library/Funky");
+#elif defined(FUNKY_VM_OS_LINUX)
+    module_register_path(state, "/usr/local/lib/funky");
+    module_register_path(state, "/usr/lib/funky");
+    module_register_path(state, "/lib/funky");
+#elif defined(FUNKY_VM_OS_WINDOWS)
+
+#endif
+
+    char *stdlibpath = get_executable_path("stdlib");
+    module_register_path(state, stdlibpath);
+    free(stdlibpath);
+
+    if (setup->scan_library_paths) {
+        module_scan_paths(state);
+    }
+
+    register_bindings(state);
+}
+
+/*
+ * Parses a size in bytes with an optional K, M or G suffix.
+ */
+static size_t parse_size(const char *str) {
+    char *end;
+    size_t size = (size_t) strtoull(str, &end, 10);
+    switch (*end) {
+        case 'g': case 'G': size *= 1024;
+        case 'm': case 'M': size *= 1024;
+        case 'k': case 'K': size *= 1024;
+    }
+    return size;
+}
+
+/*
+ * Runs every kernel given on the command line repeat times as separate jobs on a pool of workers and reports the
+ * throughput of each worker on stderr.
+ */
+static int run_host(struct optparse *options, vm_host_options_t *host_options, int repeat) {
+    if (host_options->num_workers < 1) {
+        host_options->num_workers = vm_host_default_workers();
+    }
+    int workers = host_options->num_workers;
+
+    int num_kernels = 0;
+    const char **kernels = NULL;
+    char *filename;
+    while ((filename = optparse_arg(options))) {
+        kernels = realloc(kernels, sizeof(char*) * (num_kernels + 1));
+        kernels[num_kernels++] = filename;
+    }
+
+    size_t num_jobs = (size_t) num_kernels * repeat;
+    vm_host_job_t *jobs = calloc(num_jobs, sizeof(vm_host_job_t));
+    for (size_t j = 0; j < num_jobs; j++) {
+        jobs[j].kernel = kernels[j % num_kernels];
+    }
+    vm_host_worker_stats_t *stats = calloc((size_t) workers, sizeof(vm_host_worker_stats_t));
+
+    double start = get_wall_time();
+    int failed = vm_host_run(jobs, num_jobs, host_options, stats);
+    double duration = get_wall_time() - start;
+
+    for (int w = 0; w < workers; w++) {
+        fprintf(stderr, "worker %2d: %6lu jobs (%lu stolen) in %9.6fs, busy %9.6fs, %10.1f jobs/sec\n", w,
+                stats[w].jobs, stats[w].stolen, stats[w].wall_time, stats[w].busy_time,
+                stats[w].busy_time > 0 ? stats[w].jobs / stats[w].busy_time : 0.0);
+    }
+    fprintf(stderr, "total:     %6lu jobs (%d failed) on %d workers in %9.6fs, %10.1f jobs/sec\n",
+            (unsigned long) num_jobs, failed, workers, duration, duration > 0 ? num_jobs / duration : 0.0);
+
+    free(stats);
+    free(jobs);
+    free(kernels);
+
+    return failed ? EXIT_FAILURE : 0;
+}
+
 int main(int argc, char **argv) {
     static_assert(sizeof(vm_type_t) == sizeof(vm_type_signed_t), "vm_type_t and vm_type_signed_t must be of equal size");
     static_assert(sizeof(vm_type_t) == sizeof(vm_type_float_t), "vm_type_float_t and vm_type_t must be of equal size");
     static_assert(sizeof(vm_pointer_t) <= sizeof(vm_type_t), "vm_pointer_t must be equal or smaller than vm_type_t");
     static_assert(sizeof(enum vm_value_type_t) <= sizeof(vm_type_t), "vm_value_type_t must be equal or smaller than vm_type_t");
 
-#if defined(VM_NATIVE_MALLOC) && VM_NATIVE_MALLOC
-    unsigned char *main_memory = 0;
-#else
-    unsigned char *main_memory = malloc(VM_MEMORY_LIMIT);
-#endif
-    Memory memory;
-    memory_init(&memory, main_memory);
-    Module kernel;
-    int kernel_set = 0;
-
-    CPU_State state = cpu_init(&memory);
-
     struct optparse_long longopts[] = {
             {"amend", 'a', OPTPARSE_NONE},
             {"brief", 'b', OPTPARSE_NONE},
@@ -39,7 +124,24 @@ int main(int argc, char **argv) {
             {"performance-test", 'P', OPTPARSE_REQUIRED},
             {"delay", 'd', OPTPARSE_OPTIONAL},
             {"library-search-path", 'L', OPTPARSE_REQUIRED},
+            {"list-fusions", 'F', OPTPARSE_NONE},
+            {"list-map-caches", 'M', OPTPARSE_NONE},
+            {"list-allocations", 'A', OPTPARSE_NONE},
             {"version", 'v', OPTPARSE_NONE},
+            {"workers", 'w', OPTPARSE_OPTIONAL},
+            {"repeat", 'r', OPTPARSE_REQUIRED},
+            {"heap-size", 'H', OPTPARSE_REQUIRED},
+            {"max-heap-size", 'X', OPTPARSE_REQUIRED},
+            {"stack-size", 's', OPTPARSE_REQUIRED},
+            {"max-stack-size", 'S', OPTPARSE_REQUIRED},
+            {"cycle-threshold", 'C', OPTPARSE_REQUIRED},
+            {"list-cycles", 'Y', OPTPARSE_NONE},
+            {"release-slice", 'R', OPTPARSE_REQUIRED},
+            {"scan-library-paths", 'p', OPTPARSE_NONE},
+            {"list-module-cache", 'K', OPTPARSE_NONE},
+            {"restore", 'z', OPTPARSE_REQUIRED},
+            {"slice", 'l', OPTPARSE_REQUIRED},
+            {"fiber-quantum", 'Q', OPTPARSE_REQUIRED},
             {0}
     };
 
@@ -48,6 +150,23 @@ int main(int argc, char **argv) {
     const char *color = "white";
     int delay = 0;
     int performance_test = 0;
+    int list_fusions = 0;
+    int list_map_caches = 0;
+    int list_allocations = 0;
+    int workers = -1;
+    int repeat = 1;
+    size_t heap_size = 0;
+    size_t max_heap_size = 0;
+    vm_type_t stack_size = 0;
+    vm_type_t max_stack_size = 0;
+    vm_type_t cycle_threshold = VM_CYCLE_THRESHOLD;
+    int list_cycles = 0;
+    vm_type_t release_slice = 0;
+    int list_module_cache = 0;
+    const char *restore = NULL;
+    vm_type_t slice = 0;
+    vm_type_t fiber_quantum = VM_FIBER_QUANTUM;
+    host_setup_t setup = { .library_paths = malloc(sizeof(char*) * argc), .num_library_paths = 0 };
 
     int option;
     struct optparse options;
@@ -65,7 +184,7 @@ int main(int argc, char **argv) {
                 color = options.optarg;
                 break;
             case 'L':
-                module_register_path(&state, options.optarg);
+                setup.library_paths[setup.num_library_paths++] = options.optarg;
                 break;
             case 'd':
                 delay = options.optarg ? atoi(options.optarg) : 1;
@@ -73,6 +192,58 @@ int main(int argc, char **argv) {
             case 'P':
                 performance_test = atoi(options.optarg);
                 break;
+            case 'F':
+                list_fusions = 1;
+                break;
+            case 'M':
+                list_map_caches = 1;
+                break;
+            case 'A':
+                list_allocations = 1;
+                break;
+            case 'w':
+                workers = options.optarg ? atoi(options.optarg) : 0;
+                break;
+            case 'r':
+                repeat = atoi(options.optarg);
+                break;
+            case 'H':
+                heap_size = parse_size(options.optarg);
+                break;
+            case 'X':
+                max_heap_size = parse_size(options.optarg);
+                break;
+            case 's':
+                // in bytes, like the heap sizes; the CPU counts the stack in values
+                stack_size = (vm_type_t) (parse_size(options.optarg) / sizeof(vm_value_t));
+                break;
+            case 'S':
+                max_stack_size = (vm_type_t) (parse_size(options.optarg) / sizeof(vm_value_t));
+                break;
+            case 'C':
+                cycle_threshold = (vm_type_t) strtoul(options.optarg, NULL, 10);
+                break;
+            case 'Y':
+                list_cycles = 1;
+                break;
+            case 'R':
+                release_slice = (vm_type_t) strtoul(options.optarg, NULL, 10);
+                break;
+            case 'p':
+                setup.scan_library_paths = 1;
+                break;
+            case 'K':
+                list_module_cache = 1;
+                break;
+            case 'z':
+                restore = options.optarg;
+                break;
+            case 'l':
+                slice = (vm_type_t) strtoul(options.optarg, NULL, 10);
+                break;
+            case 'Q':
+                fiber_quantum = (vm_type_t) strtoul(options.optarg, NULL, 10);
+                break;
             case 'v':
                 printf("Funky VM version %s.%s.%s\nBuilt on %s %s\n", VERSION_MAJOR, VERSION_MINOR, VERSION_REVISION, __DATE__, __TIME__);
                 return 0;
@@ -82,55 +253,110 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (options.optind >= argc) {
+    if (options.optind >= argc && restore == NULL) {
         printf("Usage: %s [kernel]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-#if defined(FUNKY_VM_OS_MACOS)
-    module_register_path(&state, "/usr/local/lib/funky");
-    module_register_path(&state, "/usr/lib/funky");
-    module_register_path(&state, "/lib/funky");
-    module_register_path(&state, "/System/Library/Funky");
-    module_register_path(&state, "/Library/Funky");
-    module_register_path(&state, "~/Library/Funky");
-#elif defined(FUNKY_VM_OS_LINUX)
-    module_register_path(&state, "/usr/local/lib/funky");
-    module_register_path(&state, "/usr/lib/funky");
-    module_register_path(&state, "/lib/funky");
-#elif defined(FUNKY_VM_OS_WINDOWS)
-
-#endif
+    if (workers >= 0) {
+        vm_host_options_t host_options = {
+                .num_workers = workers,
+                .heap_size = heap_size,
+                .max_heap_size = max_heap_size,
+                .stack_size = stack_size,
+                .max_stack_size = max_stack_size,
+                .cycle_threshold = cycle_threshold,
+                .release_slice = release_slice,
+                .setup = setup_state,
+                .userdata = &setup
+        };
+        int ret = run_host(&options, &host_options, repeat > 0 ? repeat : 1);
+        free(setup.library_paths);
+        return ret;
+    }
 
-    char *stdlibpath = get_executable_path("stdlib");
-    module_register_path(&state, stdlibpath);
-    free(stdlibpath);
+    Memory memory;
+    if (!memory_create(&memory, heap_size, max_heap_size)) {
+        fprintf(stderr, "%s: could not reserve memory for the heap\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    Module kernel;
+    int kernel_set = 0;
 
-    register_bindings(&state);
+    CPU_State state = cpu_init(&memory);
+    if (stack_size != 0 || max_stack_size != 0) {
+        cpu_set_stack_size(&state, stack_size ? stack_size : VM_STACK_SIZE / sizeof(vm_value_t),
+                           max_stack_size ? max_stack_size : VM_STACK_MAX_SIZE / sizeof(vm_value_t));
+    }
+    cpu_set_cycle_threshold(&state, cycle_threshold);
+    cpu_set_release_slice(&state, release_slice);
+    cpu_set_fiber_quantum(&state, fiber_quantum);
+    setup_state(&state, &setup);
 
-    char *filename;
-    while ((filename = optparse_arg(&options))) {
-        Module module = module_load_name(&state, filename);
-        if (!kernel_set) {
-            kernel = module;
-            kernel_set = 1;
+    if (restore != NULL) {
+        // the snapshot continues where it was saved, with the modules it had loaded
+        if (!cpu_restore_snapshot(&state, restore)) {
+            fprintf(stderr, "%s: could not restore snapshot %s\n", argv[0], restore);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        char *filename;
+        while ((filename = optparse_arg(&options))) {
+            Module module = module_load_name(&state, filename);
+            if (!kernel_set) {
+                kernel = module;
+                kernel_set = 1;
+            }
+            module_register(&state, module);
         }
-        module_register(&state, module);
-    }
 
-    cpu_set_entry_to_module(&state, &kernel);
+        cpu_set_entry_to_module(&state, &kernel);
+    }
 
     vm_type_t ret = 0;
     if (performance_test) {
         double duration = performance_test_run(&state, performance_test);
         printf("%9.6f", duration);
+    } else if (slice != 0) {
+        // the way an event loop would run it, reports how many slices it took
+        unsigned long slices = 1;
+        vm_run_status_t status;
+        while ((status = cpu_run_slice(&state, slice)) == VM_RUN_BUDGET || status == VM_RUN_YIELDED) {
+            slices++;
+        }
+        fprintf(stderr, "%lu slices\n", slices);
+        ret = state.rr.uint_value;
     } else {
          ret = cpu_run(&state);
     }
 
+    if (list_fusions) {
+        for (int i = 0; i < state.num_modules; i++) {
+            module_print_fusions(&state.modules[i]);
+        }
+    }
+
+    if (list_map_caches) {
+        for (int i = 0; i < state.num_modules; i++) {
+            module_print_map_caches(&state, &state.modules[i]);
+        }
+    }
+
+    if (list_allocations) {
+        memory_print_allocations(&memory);
+    }
+
+    if (list_cycles) {
+        cpu_print_cycle_stats(&state);
+    }
+
+    if (list_module_cache) {
+        module_print_cache(&state);
+    }
+
     cpu_destroy(&state);
     memory_destroy(&memory);
-    free(main_memory);
+    free(setup.library_paths);
 
     return ret;
 }
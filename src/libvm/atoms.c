@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "funkyvm/funkyvm.h"
+#include "instructions/instructions.h"
+#include "atoms.h"
+
+/*
+ * Atoms are interned strings. Every map key is an atom, so keys with the same name share one allocation and map
+ * lookups compare pointers instead of strings. So are the string constants ld.str loads, which makes a constant used
+ * as a key already the atom of that key.
+ *
+ * An atom is a regular VM string, with its hash filled in, and it can be used as a string value like any other. Its
+ * refcount starts at VM_ATOM_REFCOUNT instead of 0. When the last reference is released, atom_free() removes it from
+ * the table of its CPU_State and frees it.
+ *
+ * Names and constants that appear in the code of a module, and names the VM itself uses as keys, are pinned: like the
+ * constants of a module they are not refcounted and stay around until the CPU_State is destroyed. Only maps with pinned
+ * keys get a shape (see instr_map_cache.c), which keeps the number of shapes bounded by the code, not by the data.
+ */
+
+#define ATOMS_MIN_SIZE 256
+
+static inline const char *atom_name(CPU_State *state, vm_pointer_t atom) {
+    return vm_pointer_to_native(state->memory, atom + sizeof(vm_type_t), const char*);
+}
+
+static void atoms_resize(CPU_State *state, vm_type_t size) {
+    vm_atom_slot_t *old_atoms = state->atoms;
+    vm_type_t old_size = state->atoms_size;
+
+    state->atoms = calloc(size, sizeof(vm_atom_slot_t));
+    state->atoms_size = size;
+
+    for (vm_type_t i = 0; i < old_size; i++) {
+        if (old_atoms[i].atom == 0) continue;
+        vm_type_t slot = old_atoms[i].hash & (size - 1);
+        while (state->atoms[slot].atom != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        state->atoms[slot] = old_atoms[i];
+    }
+    free(old_atoms);
+}
+
+/*
+ * Returns the atom with the given name, or 0 if there is none. A name that is not an atom is not a key of any map.
+ */
+vm_pointer_t atom_find(CPU_State *state, const char *name, vm_type_t hash) {
+    if (state->atoms_size == 0) {
+        return 0;
+    }
+
+    vm_type_t mask = state->atoms_size - 1;
+    for (vm_type_t slot = hash & mask; state->atoms[slot].atom != 0; slot = (slot + 1) & mask) {
+        if (state->atoms[slot].hash == hash && strcmp(atom_name(state, state->atoms[slot].atom), name) == 0) {
+            return state->atoms[slot].atom;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the atom with the given name, creating it if needed. The caller has to retain it to keep it.
+ */
+vm_pointer_t atom_intern(CPU_State *state, const char *name, vm_type_t hash) {
+    vm_pointer_t atom = atom_find(state, name, hash);
+    if (atom != 0) {
+        return atom;
+    }
+
+    if ((state->num_atoms + 1) * 2 > state->atoms_size) {
+        atoms_resize(state, state->atoms_size == 0 ? ATOMS_MIN_SIZE : state->atoms_size * 2);
+    }
+
+    vm_type_t length = (vm_type_t) strlen(name);
+    atom = str_alloc(state, length);
+    str_header(state, atom)->hash = hash;
+    *vm_pointer_to_native(state->memory, atom, vm_type_t*) = VM_ATOM_REFCOUNT;
+    memcpy(vm_pointer_to_native(state->memory, atom + sizeof(vm_type_t), char*), name, length);
+
+    vm_type_t mask = state->atoms_size - 1;
+    vm_type_t slot = hash & mask;
+    while (state->atoms[slot].atom != 0) {
+        slot = (slot + 1) & mask;
+    }
+    state->atoms[slot] = (vm_atom_slot_t) { .atom = atom, .hash = hash };
+    state->num_atoms++;
+
+    return atom;
+}
+
+void atom_free(CPU_State *state, vm_pointer_t atom) {
+    vm_type_t mask = state->atoms_size - 1;
+    vm_type_t slot = atom_hash(state, atom) & mask;
+    while (state->atoms[slot].atom != atom) {
+        slot = (slot + 1) & mask;
+    }
+
+    // backward shift deletion, so lookups never need tombstones
+    vm_type_t next = (slot + 1) & mask;
+    while (state->atoms[next].atom != 0) {
+        vm_type_t home = state->atoms[next].hash & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            state->atoms[slot] = state->atoms[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    state->atoms[slot] = (vm_atom_slot_t) { 0 };
+    state->num_atoms--;
+
+    str_free(state, atom);
+}
+
+/*
+ * Replaces the names in the decoded map item instructions of a module by pinned atoms, so they can be looked up
+ * without hashing or comparing the name, and the strings of its decoded ld.str instructions, so that equal constants
+ * share one copy that has a header. An ld.str that was not decoded up front keeps loading the string without one.
+ */
+void atoms_intern_module(CPU_State *state, Module *module) {
+    for (vm_type_t i = 1; i < module->num_instructions; i++) {
+        vm_instruction_t *instr = &module->code[i];
+        int num_names;
+        switch (instr->opcode) {
+            case 0x13: // ld.str
+            case 0xB0: // ld.mapitem
+            case 0xB2: // st.mapitem
+            case 0xB4: // del.mapitem
+            case 0xB6: // has.mapitem
+                num_names = 1;
+                break;
+            case 0xC0: // map.renamekey
+                num_names = 2;
+                break;
+            default:
+                continue;
+        }
+
+        for (int n = 0; n < num_names; n++) {
+            vm_pointer_t str_ptr = instr->operands[n].uint_value;
+            if (str_ptr - module->addr >= module->size) continue;
+            const char *name = cstr_pointer_from_vm_pointer_t(state, str_ptr + sizeof(vm_type_t));
+            vm_pointer_t atom = atom_intern(state, name, map_hash(name));
+            atom_pin(state, atom);
+            instr->operands[n].uint_value = atom;
+        }
+    }
+}
+
+void atoms_destroy(CPU_State *state) {
+    for (vm_type_t i = 0; i < state->atoms_size; i++) {
+        if (state->atoms[i].atom != 0) {
+            str_free(state, state->atoms[i].atom);
+        }
+    }
+    free(state->atoms);
+    state->atoms = NULL;
+    state->atoms_size = 0;
+    state->num_atoms = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef FUNKY_VM_ATOMS_H
+#define FUNKY_VM_ATOMS_H
+
+#include "../../include/funkyvm/cpu.h"
+#include "instructions/instructions.h"
+
+// Refcount of an atom that nothing refers to anymore. Atoms count their references up from here, so release() can
+// tell them apart from regular strings and take them out of the atom table before they are freed.
+#define VM_ATOM_REFCOUNT (VM_UNSIGNED_MAX / 2 + 1)
+
+// Refcount of an atom that is never freed, like the static strings of a module (VM_STRING_RAW)
+#define VM_ATOM_PINNED (VM_UNSIGNED_MAX - 1)
+
+static inline int is_atom(CPU_State *state, vm_pointer_t str_ptr) {
+    vm_type_t ref_count = *vm_pointer_to_native(state->memory, str_ptr, vm_type_t*);
+    return ref_count >= VM_ATOM_REFCOUNT && ref_count <= VM_ATOM_PINNED;
+}
+
+static inline int is_pinned_atom(CPU_State *state, vm_pointer_t atom) {
+    return *vm_pointer_to_native(state->memory, atom, vm_type_t*) == VM_ATOM_PINNED;
+}
+
+static inline void atom_pin(CPU_State *state, vm_pointer_t atom) {
+    *vm_pointer_to_native(state->memory, atom, vm_type_t*) = VM_ATOM_PINNED;
+}
+
+static inline vm_type_t atom_hash(CPU_State *state, vm_pointer_t atom) {
+    return str_header(state, atom)->hash;
+}
+
+vm_pointer_t atom_find(CPU_State *state, const char *name, vm_type_t hash);
+vm_pointer_t atom_intern(CPU_State *state, const char *name, vm_type_t hash);
+void atom_free(CPU_State *state, vm_pointer_t atom);
+void atoms_intern_module(CPU_State *state, Module *module);
+void atoms_destroy(CPU_State *state);
+
+#endif //FUNKY_VM_ATOMS_H
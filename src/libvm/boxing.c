@@ -10,16 +10,7 @@
  */
 
 vm_pointer_t create_ptype(CPU_State *state) {
-    vm_pointer_t reserved_mem     = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for first item
-    vm_type_t *ref_count          = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_pointer_t *first_ptr       = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 1;
-    vm_pointer_t *prototype_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
-
-    *ref_count = VM_UNSIGNED_MAX;
-    *first_ptr = 0;
-    *prototype_ptr = 0;
-
-    return reserved_mem;
+    return map_create(state, VM_UNSIGNED_MAX, 0);
 }
 
 void initialize_boxing_prototypes(CPU_State *state) {
@@ -52,15 +43,9 @@ void destroy_boxing_prototypes(CPU_State *state) {
 }
 
 INSTR(box) {
-    vm_pointer_t reserved_mem     = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for first item
-    vm_type_t *ref_count          = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_pointer_t *first_ptr       = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 1;
+    vm_pointer_t reserved_mem     = map_create(state, 1, 0);
     vm_pointer_t *prototype_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
 
-    *ref_count = 1;
-    *first_ptr = 0;
-    *prototype_ptr = 0;
-
     USE_STACK();
 
     vm_value_t unboxed_value = *stack;
@@ -1,18 +1,33 @@
+#include <string.h>
+
 #include "funkyvm/cpu.h"
 #include "instructions/instructions.h"
 #include "funkyvm/memory.h"
 #include "boxing.h"
+#include "atoms.h"
+#include "cycles.h"
+#include "fibers.h"
+#include "error_handling.h"
 
 #ifdef FUNKY_VM_OS_EMSCRIPTEN
 #include <emscripten/emscripten.h>
 #pragma pack(1)
 #endif
 
+// Labels-as-values is a GNU extension; other compilers use the function table loop in cpu_run
+#if defined(VM_THREADED_DISPATCH) && VM_THREADED_DISPATCH && defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
 CPU_State cpu_init(Memory* memory) {
     CPU_State state;
     state.memory = memory;
 
-    state.stack_base = vm_malloc(memory, VM_STACK_SIZE);
+    state.stack_size = VM_STACK_SIZE;
+    state.max_stack_size = VM_STACK_MAX_SIZE;
+    state.stack_base = vm_malloc(memory, VM_STACK_ALLOC_SIZE(state.stack_size));
+    state.stack_limit = state.stack_base + state.stack_size;
+    state.retired_stacks = 0;
     state.pc = 0;
     state.mp = state.stack_base - sizeof(vm_type_signed_t);
     state.sp = state.stack_base - sizeof(vm_type_signed_t);
@@ -38,8 +53,56 @@ CPU_State cpu_init(Memory* memory) {
     state.module_paths = malloc(0);
     state.num_module_paths = 0;
 
-    state.syscall_table = k_malloc(memory, 0);
+    state.module_cache = NULL;
+    state.num_module_cache_entries = 0;
+    state.module_cache_size = 0;
+    state.module_paths_scanned = 0;
+    state.module_probes = 0;
+    state.module_cache_hits = 0;
+
+    state.syscall_table = NULL;
     state.num_syscalls = 0;
+    state.syscall_table_size = 0;
+    state.syscall_index = NULL;
+    state.syscall_index_size = 0;
+
+    state.code_base = 0;
+    state.code_size = 0;
+    state.code = NULL;
+    state.code_index = NULL;
+    state.code_scratch = (vm_instruction_t) { 0 };
+    state.map_caches = NULL;
+    state.instr = NULL;
+    state.operands = NULL;
+
+    state.map_shapes = NULL;
+    state.num_map_shapes = 0;
+    state.map_shape_index = NULL;
+    state.map_shape_index_size = 0;
+
+    state.atoms = NULL;
+    state.num_atoms = 0;
+    state.atoms_size = 0;
+
+    state.cycle_roots = NULL;
+    state.num_cycle_roots = 0;
+    state.cycle_roots_size = 0;
+    state.cycle_threshold = VM_CYCLE_THRESHOLD;
+    state.cycle_stats = (vm_cycle_stats_t) { 0 };
+
+    state.released_maps = 0;
+    state.released_arrays = 0;
+    state.release_slice = 0;
+    state.releasing = 0;
+
+    state.safepoint_pending = 0;
+    state.yield_pending = 0;
+
+    state.fibers = NULL;
+    state.num_fibers = 0;
+    state.fibers_size = 0;
+    state.current_fiber = 0;
+    state.fiber_quantum = VM_FIBER_QUANTUM;
 
     state.running = 1;
 
@@ -75,44 +138,799 @@ void cpu_reset(CPU_State* state) {
 
 void cpu_destroy(CPU_State *state) {
     destroy_boxing_prototypes(state);
+    fibers_destroy(state);
+    release_deferred(state, 0);
 
     for (int i = 0; i < state->num_module_paths; i++) {
         free(state->module_paths[i]);
     }
     free(state->module_paths);
+    module_clear_cache(state);
 
     for (int i = 0; i < state->num_modules; i++) {
-        free(state->modules[i].name);
-        vm_free(state->memory, state->modules[i].addr);
+        module_unload(state->memory, state->modules[i]);
     }
     k_free(state->memory, state->modules);
 
     free(state->debug_context.stacktrace);
 
-    k_free(state->memory, state->syscall_table);
+    destroy_syscalls(state);
+
+    cycles_destroy(state);
+    map_shapes_destroy(state);
+    atoms_destroy(state);
+
+    vm_free(state->memory, state->stack_base);
+    cpu_free_retired_stacks(state, &state->retired_stacks);
+}
 
+/*
+ * Replaces the stack by one of num_values values that may grow up to max_values values; max_values equal to num_values
+ * keeps it at a fixed size. Only valid while the stack is empty, i.e. before the CPU runs.
+ */
+void cpu_set_stack_size(CPU_State *state, vm_type_t num_values, vm_type_t max_values) {
     vm_free(state->memory, state->stack_base);
 
+    state->stack_size = num_values * sizeof(vm_value_t);
+    state->max_stack_size = (max_values > num_values ? max_values : num_values) * sizeof(vm_value_t);
+    state->stack_base = vm_malloc(state->memory, VM_STACK_ALLOC_SIZE(state->stack_size));
+    state->stack_limit = state->stack_base + state->stack_size;
+
+    state->mp = state->stack_base - sizeof(vm_type_signed_t);
+    state->sp = state->stack_base - sizeof(vm_type_signed_t);
+    state->ap = state->stack_base - sizeof(vm_type_signed_t);
+}
+
+static void relocate_ref(vm_value_t *value, vm_pointer_t from, vm_pointer_t to, vm_pointer_t old_base, vm_type_t size) {
+    if (value->type == VM_TYPE_REF && value->pointer_value >= old_base && value->pointer_value < old_base + size) {
+        value->pointer_value = value->pointer_value - from + to;
+    }
+}
+
+/*
+ * Called by CHECK_STACK when num_values more values would run into the headroom. Moves the stack to a block at least
+ * twice the size, as long as that stays within max_stack_size, and rebases everything that points into it: sp, mp, ap,
+ * and references to stack slots on the stack and in the registers (saved mark and argument pointers, ld.sref and
+ * ld.lref results). Returns 0 and stops the CPU with an error if the stack cannot grow.
+ *
+ * References to the stack that were stored in maps or arrays are not found. The old block is kept as long as the
+ * stack, with every slot in it marked VM_TYPE_RETIRED, so that dereferencing one of those is an error rather than a
+ * read of a stale copy, or of whatever the heap reuses the block for. As the stack at least doubles every time, the
+ * retired blocks take up less than the stack itself.
+ */
+int cpu_grow_stack(CPU_State *state, vm_type_t num_values) {
+    vm_type_t needed = state->sp + (num_values + 1) * sizeof(vm_value_t) - state->stack_base;
+    if (needed <= state->stack_size) {
+        return 1;
+    }
+    if (needed > state->max_stack_size) {
+        vm_error(state, "Stack overflow: more than %u values", (unsigned int) (state->max_stack_size / sizeof(vm_value_t)));
+        vm_exit(state, EXIT_FAILURE);
+        return 0;
+    }
+
+    vm_type_t size = state->stack_size * 2 > needed ? state->stack_size * 2 : needed;
+    if (size > state->max_stack_size) {
+        size = state->max_stack_size;
+    }
+
+    vm_pointer_t old_base = state->stack_base;
+    vm_type_t old_size = VM_STACK_ALLOC_SIZE(state->stack_size);
+    vm_pointer_t new_base = vm_malloc(state->memory, VM_STACK_ALLOC_SIZE(size));
+    memcpy(vm_pointer_to_native(state->memory, new_base, void*), vm_pointer_to_native(state->memory, old_base, void*),
+           old_size);
+
+    // the slot below stack_base is where sp, mp and ap of an empty stack point
+    vm_pointer_t from = old_base - sizeof(vm_type_signed_t);
+    vm_pointer_t to = new_base - sizeof(vm_type_signed_t);
+    vm_type_t range = old_size + sizeof(vm_type_signed_t);
+
+    state->sp = state->sp - from + to;
+    state->mp = state->mp - from + to;
+    if (state->ap >= from && state->ap < from + range) {
+        state->ap = state->ap - from + to;
+    }
+
+    vm_value_t *bottom = vm_pointer_to_native(state->memory, to, vm_value_t*) + 1;
+    vm_value_t *top = vm_pointer_to_native(state->memory, state->sp, vm_value_t*);
+    for (vm_value_t *value = bottom; value <= top; value++) {
+        relocate_ref(value, from, to, from, range);
+    }
+    vm_value_t *registers[] = { &state->rr, &state->r0, &state->r1, &state->r2, &state->r3, &state->r4, &state->r5,
+                                &state->r6, &state->r7 };
+    for (int i = 0; i < 9; i++) {
+        relocate_ref(registers[i], from, to, from, range);
+    }
+
+    // the link to the next retired block goes in front of the first slot, which is where the slot of sp is cut off
+    vm_value_t *old_values = vm_pointer_to_native(state->memory, from, vm_value_t*) + 1;
+    for (vm_type_t i = 0; i < (old_size - sizeof(vm_type_signed_t)) / sizeof(vm_value_t); i++) {
+        old_values[i] = (vm_value_t) { .type = VM_TYPE_RETIRED };
+    }
+    *vm_pointer_to_native(state->memory, old_base, vm_pointer_t*) = state->retired_stacks;
+    state->retired_stacks = old_base;
+
+    state->stack_base = new_base;
+    state->stack_size = size;
+    state->stack_limit = new_base + size;
+    return 1;
+}
+
+/*
+ * Frees a list of blocks a stack grew out of and empties it, for a stack that is going away.
+ */
+void cpu_free_retired_stacks(CPU_State *state, vm_pointer_t *blocks) {
+    while (*blocks != 0) {
+        vm_pointer_t block = *blocks;
+        *blocks = *vm_pointer_to_native(state->memory, block, vm_pointer_t*);
+        vm_free(state->memory, block);
+    }
 }
 
 void cpu_set_entry_to_module(CPU_State *state, Module *mod) {
     state->pc = mod->addr + mod->start_of_code;
 }
 
-#ifdef FUNKY_VM_OS_EMSCRIPTEN
-void cpu_emscripten_yield(CPU_State *state) {
-    state->emscripten_yield = 1;
+void cpu_invalidate_code(CPU_State *state) {
+    state->code_size = 0;
+}
+
+static vm_instruction_t *cpu_enter_code(CPU_State *state, vm_type_t pc) {
+    Module *module = module_at_address(state, pc);
+    if (module == NULL || module->code == NULL) {
+        // not inside a loaded module, decode into the scratch record every time; there is nothing to relocate against
+        state->code_size = 0;
+        decode_instruction(state->memory->main_memory + pc, 0, &state->code_scratch);
+        return &state->code_scratch;
+    }
+
+    state->code_base = module->addr;
+    state->code_size = module->size;
+    state->code = module->code;
+    state->code_index = module->code_index;
+    state->map_caches = module->map_caches;
+    return module->code + module->code_index[pc - module->addr];
+}
+
+/*
+ * Looks up the decoded instruction at pc. The decoded code of the module that pc is in is cached in the CPU_State, so
+ * this is a bounds check and two array indexes until execution moves to another module. The instruction may not have
+ * been decoded yet, in which case running its record decodes it (see cpu_decode).
+ */
+static inline vm_instruction_t *cpu_fetch(CPU_State *state, vm_type_t pc) {
+    vm_type_t offset = pc - state->code_base;
+    return offset < state->code_size ? state->code + state->code_index[offset] : cpu_enter_code(state, pc);
+}
+
+/*
+ * Decodes the instruction at pc, which has no record yet. In a module it gets one, so this happens once for every
+ * instruction; what is not a valid instruction is decoded into the scratch record every time it runs.
+ */
+vm_instruction_t *cpu_decode(CPU_State *state, vm_pointer_t pc) {
+    Module *module = module_at_address(state, pc);
+    vm_pointer_t module_addr = 0;
+    if (module != NULL && module->code != NULL) {
+        const byte_t *native_module_addr = state->memory->main_memory + module->addr;
+        vm_instruction_t *instr = module_decode_instruction(module, native_module_addr, pc - module->addr);
+        if (state->code_base == module->addr) {
+            state->code = module->code;
+        }
+        if (instr != NULL) {
+            return instr;
+        }
+        module_addr = module->addr;
+    }
+    decode_instruction(state->memory->main_memory + pc, module_addr, &state->code_scratch);
+    return &state->code_scratch;
+}
+
+/*
+ * Runs the work release() cannot do while an instruction may still be using what it released: a cycle collection that
+ * is due, and a slice of the deferred releases. Called between two instructions, where nothing holds on to a map or
+ * array without a reference.
+ */
+void cpu_safepoint(CPU_State *state) {
+    state->safepoint_pending = 0;
+    if (state->cycle_threshold != 0 && state->num_cycle_roots >= state->cycle_threshold) {
+        cpu_collect_cycles(state);
+    }
+    if (state->release_slice != 0 && release_deferred(state, state->release_slice)) {
+        state->safepoint_pending = 1;
+    }
+}
+
+/*
+ * Sets how many maps and arrays are freed per safe point once their refcount has gone to zero. 0 frees them before
+ * release() returns.
+ */
+void cpu_set_release_slice(CPU_State *state, vm_type_t max_objects) {
+    state->release_slice = max_objects;
+    if (max_objects == 0) {
+        release_deferred(state, 0);
+    }
+}
+
+/*
+ * Ends the current slice of cpu_run_slice() at the next safe point, so the host gets control back. Meant to be called
+ * from a syscall; cpu_run() simply continues.
+ */
+void cpu_yield(CPU_State *state) {
+    state->yield_pending = 1;
+    state->safepoint_pending = 1;
+}
+
+#define VM_INSTR_CALL     0x59
+#define VM_INSTR_CALL_POP 0x5A
+
+static inline int is_call(unsigned short opcode) {
+    return opcode == VM_INSTR_CALL || opcode == VM_INSTR_CALL_POP;
+}
+
+/*
+ * Backward branches and calls until the dispatch loop has to look up: when the budget of the slice runs out, or when
+ * the running fiber has had its turn. 0 is as good as never, the count wraps around before it gets there.
+ */
+static inline vm_type_t cpu_tick_period(CPU_State *state, vm_type_t budget_left) {
+    vm_type_t quantum = state->fibers != NULL ? state->fiber_quantum : 0;
+    if (quantum == 0 || (budget_left != 0 && budget_left < quantum)) {
+        return budget_left;
+    }
+    return quantum;
+}
+
+#ifndef VM_COMPUTED_GOTO
+static inline void cpu_step(CPU_State *state) {
+    vm_instruction_t *instr = cpu_fetch(state, state->pc);
+    state->pc++;
+    state->instr = instr;
+    state->operands = instr->operands;
+    instr->impl(state);
+}
+
+/*
+ * The function table loop. Like the threaded loop it only charges the budget for backward branches and calls, which is
+ * a comparison of pc per instruction here.
+ */
+static vm_run_status_t cpu_run_loop(CPU_State *state, vm_type_t budget) {
+    vm_type_t budget_left = budget;
+    vm_type_t period = cpu_tick_period(state, budget_left);
+    vm_type_t ticks = period;
+    while (state->running) {
+        if (state->safepoint_pending) {
+            cpu_safepoint(state);
+            if (state->yield_pending) {
+                state->yield_pending = 0;
+                return VM_RUN_YIELDED;
+            }
+            if (state->fibers != NULL && period == budget_left) {
+                // the first fiber was spawned, or the quantum was set while there was none
+                budget_left -= budget_left != 0 ? period - ticks : 0;
+                period = ticks = cpu_tick_period(state, budget_left);
+            }
+        }
+        vm_type_t from = state->pc;
+        cpu_step(state);
+        if ((state->pc <= from || is_call(state->instr->opcode)) && --ticks == 0) {
+            if (budget_left != 0 && (budget_left -= period) == 0) {
+                return VM_RUN_BUDGET;
+            }
+            if (state->fibers != NULL) {
+                fibers_preempt(state);
+            }
+            period = ticks = cpu_tick_period(state, budget_left);
+        }
+    }
+    return VM_RUN_HALTED;
+}
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+
+#define IS_REFCOUNTED(VAL) ((VAL)->type == VM_TYPE_STRING || (VAL)->type == VM_TYPE_MAP || (VAL)->type == VM_TYPE_ARRAY)
+
+/*
+ * Threaded dispatch. Every handler jumps straight to the handler of the next opcode, so each opcode gets its own
+ * indirect jump (and its own branch prediction slot). pc and sp live in locals for the inlined handlers below; they are
+ * written back to the CPU_State before falling back to the instruction's implementation and reloaded afterwards.
+ * Like the regular implementations do through GET_OPERAND, the inlined handlers move pc past their own instruction
+ * (NEXT), so the dispatch itself never has to wait for the length of the decoded record.
+ *
+ * Straight-line code cannot leave a module (modules end in ret, and the decoded code is padded for truncated
+ * instructions), so only branches and the generic path check whether pc is still inside the cached module code.
+ * Records that have not been decoded yet, including the padding, dispatch to op_fetch. The same places are the safe
+ * points of the threaded loop (see cpu_safepoint()), so loops and calls cannot postpone that work indefinitely.
+ *
+ * Only the hot, non-failing cases are inlined, including the integer case of the superinstructions and the
+ * quickened arithmetic and comparisons. Anything that can error, needs type conversion, or changes registers
+ * other than pc/sp goes through op_generic, which calls the regular instruction implementation.
+ */
+static vm_run_status_t cpu_run_threaded(CPU_State *state, vm_type_t budget) {
+    static void *dispatch_table[VM_NUM_OPCODES] = {
+            [0 ... VM_NUM_OPCODES - 1] = &&op_generic,
+            [VM_OPCODE_UNDECODED] = &&op_fetch,
+            [0x00] = &&op_nop,
+            [0x10] = &&op_ld_int,
+            [0x11] = &&op_ld_uint,
+            [0x12] = &&op_ld_float,
+            [0x15] = &&op_ld_local,
+            [0x1C] = &&op_pop,
+            [0x1E] = &&op_st_local,
+            [0x2C] = &&op_dup,
+            [0x30] = &&op_add,
+            [0x31] = &&op_sub,
+            [0x32] = &&op_mul,
+            [0x3B] = &&op_eq,
+            [0x3C] = &&op_ne,
+            [0x3D] = &&op_lt,
+            [0x3E] = &&op_gt,
+            [0x3F] = &&op_le,
+            [0x40] = &&op_ge,
+            [0x50] = &&op_beq,
+            [0x51] = &&op_bne,
+            [0x52] = &&op_blt,
+            [0x53] = &&op_bgt,
+            [0x54] = &&op_ble,
+            [0x55] = &&op_bge,
+            [0x56] = &&op_jmp,
+            [0x57] = &&op_brfalse,
+            [0x58] = &&op_brtrue,
+            [0x59] = &&op_call,
+            [0x5F] = &&op_ld_arg,
+            [0x78] = &&op_swp,
+            [0x91] = &&op_ld_empty,
+            [VM_OPCODE_LD_EXTERN_RESOLVED] = &&op_ld_extern_resolved,
+            [VM_OPCODE_LOCAL_ADD_INT] = &&op_local_add_int,
+            [VM_OPCODE_LOCAL_SUB_INT] = &&op_local_sub_int,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 0] = &&op_ll_eq_brfalse,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 1] = &&op_ll_eq_brtrue,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 2] = &&op_ll_ne_brfalse,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 3] = &&op_ll_ne_brtrue,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 4] = &&op_ll_lt_brfalse,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 5] = &&op_ll_lt_brtrue,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 6] = &&op_ll_gt_brfalse,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 7] = &&op_ll_gt_brtrue,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 8] = &&op_ll_le_brfalse,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 9] = &&op_ll_le_brtrue,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 10] = &&op_ll_ge_brfalse,
+            [VM_OPCODE_BR_LOCAL_LOCAL + 11] = &&op_ll_ge_brtrue,
+            [VM_OPCODE_BR_LOCAL_INT + 0] = &&op_li_eq_brfalse,
+            [VM_OPCODE_BR_LOCAL_INT + 1] = &&op_li_eq_brtrue,
+            [VM_OPCODE_BR_LOCAL_INT + 2] = &&op_li_ne_brfalse,
+            [VM_OPCODE_BR_LOCAL_INT + 3] = &&op_li_ne_brtrue,
+            [VM_OPCODE_BR_LOCAL_INT + 4] = &&op_li_lt_brfalse,
+            [VM_OPCODE_BR_LOCAL_INT + 5] = &&op_li_lt_brtrue,
+            [VM_OPCODE_BR_LOCAL_INT + 6] = &&op_li_gt_brfalse,
+            [VM_OPCODE_BR_LOCAL_INT + 7] = &&op_li_gt_brtrue,
+            [VM_OPCODE_BR_LOCAL_INT + 8] = &&op_li_le_brfalse,
+            [VM_OPCODE_BR_LOCAL_INT + 9] = &&op_li_le_brtrue,
+            [VM_OPCODE_BR_LOCAL_INT + 10] = &&op_li_ge_brfalse,
+            [VM_OPCODE_BR_LOCAL_INT + 11] = &&op_li_ge_brtrue,
+            [VM_OPCODE_QUICK_INT + 0] = &&op_add_int,
+            [VM_OPCODE_QUICK_INT + 1] = &&op_sub_int,
+            [VM_OPCODE_QUICK_INT + 2] = &&op_mul_int,
+            [VM_OPCODE_QUICK_INT + 3] = &&op_div_int,
+            [VM_OPCODE_QUICK_INT + 4] = &&op_eq_int,
+            [VM_OPCODE_QUICK_INT + 5] = &&op_ne_int,
+            [VM_OPCODE_QUICK_INT + 6] = &&op_lt_int,
+            [VM_OPCODE_QUICK_INT + 7] = &&op_gt_int,
+            [VM_OPCODE_QUICK_INT + 8] = &&op_le_int,
+            [VM_OPCODE_QUICK_INT + 9] = &&op_ge_int,
+            [VM_OPCODE_QUICK_FLOAT + 0] = &&op_add_float,
+            [VM_OPCODE_QUICK_FLOAT + 1] = &&op_sub_float,
+            [VM_OPCODE_QUICK_FLOAT + 2] = &&op_mul_float,
+            [VM_OPCODE_QUICK_FLOAT + 3] = &&op_div_float,
+            [VM_OPCODE_QUICK_FLOAT + 4] = &&op_eq_float,
+            [VM_OPCODE_QUICK_FLOAT + 5] = &&op_ne_float,
+            [VM_OPCODE_QUICK_FLOAT + 6] = &&op_lt_float,
+            [VM_OPCODE_QUICK_FLOAT + 7] = &&op_gt_float,
+            [VM_OPCODE_QUICK_FLOAT + 8] = &&op_le_float,
+            [VM_OPCODE_QUICK_FLOAT + 9] = &&op_ge_float,
+    };
+
+    unsigned char *mem = state->memory->main_memory;
+    vm_type_t pc = state->pc;
+    vm_value_t *sp = (vm_value_t *) (mem + state->sp);
+    vm_instruction_t *instr;
+    vm_instruction_t *code = state->code;
+    vm_type_t *code_index = state->code_index;
+    vm_pointer_t code_base = state->code_base;
+    vm_type_t code_size = state->code_size;
+    vm_type_t budget_left = budget;
+    vm_type_t period = cpu_tick_period(state, budget_left);
+    vm_type_t ticks = period;
+    vm_run_status_t status;
+
+    #define OPERAND(N)          (instr->operands[N].uint_value)
+    #define OPERAND_SIGNED(N)   (instr->operands[N].int_value)
+    #define OPERAND_FLOAT(N)    (instr->operands[N].float_value)
+    #define MARK()              ((vm_value_t *) (mem + state->mp))
+    #define ARGS()              ((vm_value_t *) (mem + state->ap))
+    #define LENGTH(N)           (1 + (N) * sizeof(vm_type_t))
+    #define DISPATCH()          { instr = code + code_index[pc - code_base]; goto *dispatch_table[instr->opcode]; }
+    #define NEXT(N)             { pc += LENGTH(N); DISPATCH(); }
+    #define DISPATCH_CHECKED()  do { \
+                                    if (pc - code_base >= code_size) goto op_fetch; \
+                                    if (state->safepoint_pending) goto op_safepoint; \
+                                    DISPATCH(); \
+                                } while (0)
+    #define TICK()              { if (--ticks == 0) goto op_budget; }
+    #define JUMP(TARGET)        do { \
+                                    vm_type_t from = pc; \
+                                    pc = (TARGET); \
+                                    if (pc <= from) TICK(); \
+                                    DISPATCH_CHECKED(); \
+                                } while (0)
+
+    #define BINARY_FAST(OP) { \
+        if ((sp - 1)->type == VM_TYPE_INT && sp->type == VM_TYPE_INT) { \
+            (sp - 1)->int_value = (vm_type_signed_t) ((sp - 1)->int_value OP sp->int_value); \
+        } else if ((sp - 1)->type == VM_TYPE_FLOAT && sp->type == VM_TYPE_FLOAT) { \
+            (sp - 1)->float_value = (vm_type_float_t) ((sp - 1)->float_value OP sp->float_value); \
+        } else { \
+            goto op_generic; \
+        } \
+        sp--; \
+        NEXT(0); \
+    }
+
+    #define COMPARE_FAST(OP) { \
+        if ((sp - 1)->type == VM_TYPE_INT && sp->type == VM_TYPE_INT) { \
+            (sp - 1)->uint_value = (vm_type_t) ((sp - 1)->int_value OP sp->int_value); \
+            (sp - 1)->type = VM_TYPE_UINT; \
+            sp--; \
+            NEXT(0); \
+        } \
+        goto op_generic; \
+    }
+
+    #define CMP_BRANCH_FAST(OP) { \
+        vm_type_t jmp_addr = OPERAND(0); \
+        sp--; \
+        JUMP((sp + 1)->int_value OP 0 ? jmp_addr : pc + LENGTH(1)); \
+    }
+
+    #define LOCAL_ARITH_FAST(OP) { \
+        vm_value_t *src = MARK() + 1 + OPERAND_SIGNED(0); \
+        if (src->type != VM_TYPE_INT) goto op_generic; \
+        vm_value_t *dst = MARK() + 1 + OPERAND_SIGNED(2); \
+        vm_type_signed_t result = (vm_type_signed_t) (src->int_value OP OPERAND_SIGNED(1)); \
+        if (IS_REFCOUNTED(dst)) release(state, dst); \
+        *dst = (vm_value_t) { .int_value = result, .type = VM_TYPE_INT }; \
+        pc += SUPERINSTRUCTION_LENGTH; \
+        DISPATCH(); \
+    }
+
+    #define BR_LOCAL_LOCAL_FAST(OP, BRANCH) { \
+        vm_value_t *a = MARK() + 1 + OPERAND_SIGNED(0); \
+        vm_value_t *b = MARK() + 1 + OPERAND_SIGNED(1); \
+        if (a->type != VM_TYPE_INT || b->type != VM_TYPE_INT) goto op_generic; \
+        JUMP((a->int_value OP b->int_value) BRANCH 0 ? OPERAND(2) : pc + SUPERINSTRUCTION_LENGTH); \
+    }
+
+    #define BR_LOCAL_INT_FAST(OP, BRANCH) { \
+        vm_value_t *a = MARK() + 1 + OPERAND_SIGNED(0); \
+        if (a->type != VM_TYPE_INT) goto op_generic; \
+        JUMP((a->int_value OP OPERAND_SIGNED(1)) BRANCH 0 ? OPERAND(2) : pc + SUPERINSTRUCTION_LENGTH); \
+    }
+
+    #define QUICK_ARITH_FAST(TYPE, FIELD, CAST, OP) { \
+        if ((sp - 1)->type != TYPE || sp->type != TYPE) goto op_generic; \
+        (sp - 1)->FIELD = (CAST) ((sp - 1)->FIELD OP sp->FIELD); \
+        sp--; \
+        NEXT(0); \
+    }
+
+    #define QUICK_COMPARE_FAST(TYPE, FIELD, OP) { \
+        if ((sp - 1)->type != TYPE || sp->type != TYPE) goto op_generic; \
+        (sp - 1)->uint_value = (vm_type_t) ((sp - 1)->FIELD OP sp->FIELD); \
+        (sp - 1)->type = VM_TYPE_UINT; \
+        sp--; \
+        NEXT(0); \
+    }
+
+    if (!state->running) {
+        return VM_RUN_HALTED;
+    }
+
+    DISPATCH_CHECKED();
+
+    op_fetch:
+        // another module, or an instruction that has not been decoded yet
+        instr = cpu_fetch(state, pc);
+        if (instr->length == 0) {
+            instr = cpu_decode(state, pc);
+        }
+        code = state->code;
+        code_index = state->code_index;
+        code_base = state->code_base;
+        code_size = state->code_size;
+        if (instr == &state->code_scratch) {
+            // outside of any module the inlined handlers cannot dispatch unchecked
+            goto op_generic;
+        }
+        goto *dispatch_table[instr->opcode];
+
+    op_safepoint:
+        cpu_safepoint(state);
+        if (state->yield_pending) {
+            state->yield_pending = 0;
+            status = VM_RUN_YIELDED;
+            goto op_suspend;
+        }
+        if (state->fibers != NULL && period == budget_left) {
+            // the first fiber was spawned, or the quantum was set while there was none
+            budget_left -= budget_left != 0 ? period - ticks : 0;
+            period = ticks = cpu_tick_period(state, budget_left);
+        }
+        DISPATCH();
+
+    op_budget:
+        // a whole period has passed, the budget ran out or the running fiber has had its turn
+        if (budget_left != 0 && (budget_left -= period) == 0) {
+            status = VM_RUN_BUDGET;
+            goto op_suspend;
+        }
+        if (state->fibers != NULL) {
+            state->pc = pc;
+            state->sp = (vm_type_t) ((unsigned char *) sp - mem);
+            fibers_preempt(state);
+            pc = state->pc;
+            sp = (vm_value_t *) (mem + state->sp);
+        }
+        period = ticks = cpu_tick_period(state, budget_left);
+        DISPATCH_CHECKED();
+
+    op_suspend:
+        // pc is the next instruction to run, where the next slice starts
+        state->pc = pc;
+        state->sp = (vm_type_t) ((unsigned char *) sp - mem);
+        return status;
+
+    op_generic: {
+        // the implementation moves pc past its own operands
+        vm_type_t from = pc;
+        state->pc = pc + 1;
+        state->sp = (vm_type_t) ((unsigned char *) sp - mem);
+        state->instr = instr;
+        state->operands = instr->operands;
+        instr->impl(state);
+        if (!state->running) {
+            return VM_RUN_HALTED;
+        }
+        pc = state->pc;
+        sp = (vm_value_t *) (mem + state->sp);
+        code = state->code;
+        code_index = state->code_index;
+        code_base = state->code_base;
+        code_size = state->code_size;
+        if (pc <= from || is_call(instr->opcode)) TICK();
+        DISPATCH_CHECKED();
+    }
+
+    op_nop:
+        NEXT(0);
+
+    op_ld_int:
+        sp++;
+        sp->int_value = OPERAND_SIGNED(0);
+        sp->type = VM_TYPE_INT;
+        NEXT(1);
+
+    op_ld_uint:
+        sp++;
+        sp->uint_value = OPERAND(0);
+        sp->type = VM_TYPE_UINT;
+        NEXT(1);
+
+    op_ld_float:
+        sp++;
+        sp->float_value = OPERAND_FLOAT(0);
+        sp->type = VM_TYPE_FLOAT;
+        NEXT(1);
+
+    op_ld_empty:
+        sp++;
+        sp->type = VM_TYPE_EMPTY;
+        sp->int_value = 0;
+        NEXT(0);
+
+    op_ld_local:
+        sp++;
+        *sp = *(MARK() + 1 + OPERAND_SIGNED(0));
+        if (IS_REFCOUNTED(sp)) retain(state, sp);
+        NEXT(1);
+
+    op_ld_extern_resolved:
+        sp++;
+        sp->pointer_value = OPERAND(2);
+        sp->type = VM_TYPE_REF;
+        NEXT(2);
+
+    op_ld_arg:
+        sp++;
+        *sp = *(ARGS() + OPERAND_SIGNED(0));
+        if (IS_REFCOUNTED(sp)) retain(state, sp);
+        NEXT(1);
+
+    op_st_local: {
+        vm_value_t *dst = MARK() + 1 + OPERAND_SIGNED(0);
+        if (IS_REFCOUNTED(dst)) release(state, dst);
+        *dst = *sp;
+        sp--;
+        NEXT(1);
+    }
+
+    op_pop:
+        if (IS_REFCOUNTED(sp)) release(state, sp);
+        sp--;
+        NEXT(0);
+
+    op_dup:
+        sp++;
+        *sp = *(sp - 1);
+        if (IS_REFCOUNTED(sp)) retain(state, sp);
+        NEXT(0);
+
+    op_swp: {
+        vm_value_t tmp = *sp;
+        *sp = *(sp - 1);
+        *(sp - 1) = tmp;
+        NEXT(0);
+    }
+
+    op_add: BINARY_FAST(+)
+    op_sub: BINARY_FAST(-)
+    op_mul: BINARY_FAST(*)
+
+    op_eq: COMPARE_FAST(==)
+    op_ne: COMPARE_FAST(!=)
+    op_lt: COMPARE_FAST(<)
+    op_gt: COMPARE_FAST(>)
+    op_le: COMPARE_FAST(<=)
+    op_ge: COMPARE_FAST(>=)
+
+    op_beq: CMP_BRANCH_FAST(==)
+    op_bne: CMP_BRANCH_FAST(!=)
+    op_blt: CMP_BRANCH_FAST(<)
+    op_bgt: CMP_BRANCH_FAST(>)
+    op_ble: CMP_BRANCH_FAST(<=)
+    op_bge: CMP_BRANCH_FAST(>=)
+
+    op_jmp:
+        JUMP(OPERAND(0));
+
+    op_brfalse: {
+        vm_type_t jmp_addr = OPERAND(0);
+        sp--;
+        JUMP((sp + 1)->uint_value == 0 ? jmp_addr : pc + LENGTH(1));
+    }
+
+    op_brtrue: {
+        vm_type_t jmp_addr = OPERAND(0);
+        sp--;
+        JUMP((sp + 1)->uint_value != 0 ? jmp_addr : pc + LENGTH(1));
+    }
+
+    op_call: {
+        if ((unsigned char *) (sp + 2) - mem > state->stack_limit) goto op_generic;
+        vm_type_t addr = OPERAND(0);
+        vm_type_t num_args = OPERAND(1);
+        sp += 2;
+        (sp - 1)->uint_value = pc + LENGTH(2);
+        (sp - 1)->type = VM_TYPE_REF;
+        *sp = (vm_value_t) { .type = VM_TYPE_UINT, .uint_value = num_args };
+        pc = addr;
+        TICK();
+        DISPATCH_CHECKED();
+    }
+
+    op_local_add_int: LOCAL_ARITH_FAST(+)
+    op_local_sub_int: LOCAL_ARITH_FAST(-)
+
+    op_ll_eq_brfalse: BR_LOCAL_LOCAL_FAST(==, ==)
+    op_ll_eq_brtrue: BR_LOCAL_LOCAL_FAST(==, !=)
+    op_ll_ne_brfalse: BR_LOCAL_LOCAL_FAST(!=, ==)
+    op_ll_ne_brtrue: BR_LOCAL_LOCAL_FAST(!=, !=)
+    op_ll_lt_brfalse: BR_LOCAL_LOCAL_FAST(<, ==)
+    op_ll_lt_brtrue: BR_LOCAL_LOCAL_FAST(<, !=)
+    op_ll_gt_brfalse: BR_LOCAL_LOCAL_FAST(>, ==)
+    op_ll_gt_brtrue: BR_LOCAL_LOCAL_FAST(>, !=)
+    op_ll_le_brfalse: BR_LOCAL_LOCAL_FAST(<=, ==)
+    op_ll_le_brtrue: BR_LOCAL_LOCAL_FAST(<=, !=)
+    op_ll_ge_brfalse: BR_LOCAL_LOCAL_FAST(>=, ==)
+    op_ll_ge_brtrue: BR_LOCAL_LOCAL_FAST(>=, !=)
+
+    op_li_eq_brfalse: BR_LOCAL_INT_FAST(==, ==)
+    op_li_eq_brtrue: BR_LOCAL_INT_FAST(==, !=)
+    op_li_ne_brfalse: BR_LOCAL_INT_FAST(!=, ==)
+    op_li_ne_brtrue: BR_LOCAL_INT_FAST(!=, !=)
+    op_li_lt_brfalse: BR_LOCAL_INT_FAST(<, ==)
+    op_li_lt_brtrue: BR_LOCAL_INT_FAST(<, !=)
+    op_li_gt_brfalse: BR_LOCAL_INT_FAST(>, ==)
+    op_li_gt_brtrue: BR_LOCAL_INT_FAST(>, !=)
+    op_li_le_brfalse: BR_LOCAL_INT_FAST(<=, ==)
+    op_li_le_brtrue: BR_LOCAL_INT_FAST(<=, !=)
+    op_li_ge_brfalse: BR_LOCAL_INT_FAST(>=, ==)
+    op_li_ge_brtrue: BR_LOCAL_INT_FAST(>=, !=)
+    op_add_int: QUICK_ARITH_FAST(VM_TYPE_INT, int_value, vm_type_signed_t, +)
+    op_sub_int: QUICK_ARITH_FAST(VM_TYPE_INT, int_value, vm_type_signed_t, -)
+    op_mul_int: QUICK_ARITH_FAST(VM_TYPE_INT, int_value, vm_type_signed_t, *)
+    op_div_int: QUICK_ARITH_FAST(VM_TYPE_INT, int_value, vm_type_signed_t, /)
+    op_eq_int: QUICK_COMPARE_FAST(VM_TYPE_INT, int_value, ==)
+    op_ne_int: QUICK_COMPARE_FAST(VM_TYPE_INT, int_value, !=)
+    op_lt_int: QUICK_COMPARE_FAST(VM_TYPE_INT, int_value, <)
+    op_gt_int: QUICK_COMPARE_FAST(VM_TYPE_INT, int_value, >)
+    op_le_int: QUICK_COMPARE_FAST(VM_TYPE_INT, int_value, <=)
+    op_ge_int: QUICK_COMPARE_FAST(VM_TYPE_INT, int_value, >=)
+
+    op_add_float: QUICK_ARITH_FAST(VM_TYPE_FLOAT, float_value, vm_type_float_t, +)
+    op_sub_float: QUICK_ARITH_FAST(VM_TYPE_FLOAT, float_value, vm_type_float_t, -)
+    op_mul_float: QUICK_ARITH_FAST(VM_TYPE_FLOAT, float_value, vm_type_float_t, *)
+    op_div_float: QUICK_ARITH_FAST(VM_TYPE_FLOAT, float_value, vm_type_float_t, /)
+    op_eq_float: QUICK_COMPARE_FAST(VM_TYPE_FLOAT, float_value, ==)
+    op_ne_float: QUICK_COMPARE_FAST(VM_TYPE_FLOAT, float_value, !=)
+    op_lt_float: QUICK_COMPARE_FAST(VM_TYPE_FLOAT, float_value, <)
+    op_gt_float: QUICK_COMPARE_FAST(VM_TYPE_FLOAT, float_value, >)
+    op_le_float: QUICK_COMPARE_FAST(VM_TYPE_FLOAT, float_value, <=)
+    op_ge_float: QUICK_COMPARE_FAST(VM_TYPE_FLOAT, float_value, >=)
+    #undef OPERAND
+    #undef OPERAND_SIGNED
+    #undef OPERAND_FLOAT
+    #undef MARK
+    #undef ARGS
+    #undef LENGTH
+    #undef DISPATCH
+    #undef NEXT
+    #undef DISPATCH_CHECKED
+    #undef TICK
+    #undef JUMP
+    #undef BINARY_FAST
+    #undef COMPARE_FAST
+    #undef CMP_BRANCH_FAST
+    #undef LOCAL_ARITH_FAST
+    #undef BR_LOCAL_LOCAL_FAST
+    #undef BR_LOCAL_INT_FAST
+    #undef QUICK_ARITH_FAST
+    #undef QUICK_COMPARE_FAST
+}
+#endif
+
+/*
+ * Runs the CPU for a slice of at most budget backward branches and calls, or until a syscall calls cpu_yield() or the
+ * program ends, and tells which of these it was. Straight-line code between two of those points is bounded by the
+ * length of the code, so the budget bounds the time a slice takes while the inner loops only pay for a decrement at
+ * their back edge. A budget of 0 runs until the program yields or ends.
+ *
+ * After VM_RUN_BUDGET or VM_RUN_YIELDED the next call continues where the slice stopped, at any later time, so a host
+ * can interleave many VMs on one thread.
+ */
+vm_run_status_t cpu_run_slice(CPU_State *state, vm_type_t budget) {
+    if (!state->running) {
+        return state->in_error_state ? VM_RUN_ERROR : VM_RUN_HALTED;
+    }
+
+#if defined(VM_COMPUTED_GOTO)
+    vm_run_status_t status = cpu_run_threaded(state, budget);
+#else
+    vm_run_status_t status = cpu_run_loop(state, budget);
+#endif
+    if (status != VM_RUN_HALTED) {
+        return status;
+    }
+
+    // whatever is left of the deferred releases
+    release_deferred(state, 0);
+
+    return state->in_error_state ? VM_RUN_ERROR : VM_RUN_HALTED;
 }
 
-void emscripten_loop(void *arg) {
+#ifdef FUNKY_VM_OS_EMSCRIPTEN
+// one slice per frame of the browser, a script that wants to give the page a frame yields
+static void emscripten_loop(void *arg) {
     CPU_State *state = (CPU_State *) arg;
-    state->emscripten_yield = 0;
-    while (!state->emscripten_yield && state->running) {
-        unsigned char opcode = *(state->memory->main_memory + state->pc);
-        state->pc++;
-        instruction_implementations[opcode](state);
+    if (cpu_run_slice(state, 0) != VM_RUN_YIELDED) {
+        emscripten_cancel_main_loop();
     }
-    state->emscripten_yield = 1;
 }
 #endif
 
@@ -121,12 +939,9 @@ vm_type_t cpu_run(CPU_State *state) {
     emscripten_set_main_loop_arg(emscripten_loop, state, 0, 0);
     return 0;
 #else
-    while (state->running) {
-        unsigned char opcode = *(state->memory->main_memory + state->pc);
-        state->pc++;
-        instruction_implementations[opcode](state);
+    while (cpu_run_slice(state, 0) == VM_RUN_YIELDED) {
+        // nobody to yield to
     }
-
     return state->rr.uint_value;
 #endif
-}
\ No newline at end of file
+}
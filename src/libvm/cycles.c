@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "funkyvm/funkyvm.h"
+#include "instructions/instructions.h"
+#include "atoms.h"
+#include "cycles.h"
+
+/*
+ * Synchronous cycle collector for maps and arrays, after Bacon and Rajan, "Concurrent Cycle Collection in Reference
+ * Counted Systems" (2001). Refcounting frees everything except garbage that refers to itself, like a child map that
+ * points back at its parent. Such a cycle can only become garbage when one of its members loses a reference without
+ * going to zero, so release() remembers every map and array it decrements to a non-zero count as a candidate root.
+ *
+ * Once cycle_threshold candidates have been buffered, the collection runs at the next safe point, where no instruction
+ * is halfway done (see cpu_safepoint()):
+ *   - mark gray: everything reachable from the candidates is colored gray, and every reference between gray objects
+ *     is subtracted from the refcount of its target. What is left of a refcount is the number of references from
+ *     outside the gray subgraph: the stack, the registers, modules, and objects that are not maps or arrays.
+ *   - scan: a gray object with references left is alive, so everything it reaches is colored black again and gets its
+ *     references back. The gray objects that remain are colored white: they are only referenced by each other.
+ *   - collect white: the white objects are freed. References from white objects to objects that stay alive were
+ *     already subtracted while marking, so only their strings and keys are released.
+ *
+ * Colors are kept in a hash table that only lives for the duration of a collection. Strings cannot refer to anything,
+ * and maps and arrays with a static refcount (like the boxing prototypes) are never freed, so neither is traversed.
+ */
+
+#define CYCLES_MIN_SIZE 64
+
+enum { CYCLE_BLACK = 0, CYCLE_GRAY, CYCLE_WHITE, CYCLE_FREED };
+
+typedef struct {
+    vm_cycle_slot_t *slots;
+    vm_type_t count;
+    vm_type_t size;
+} cycle_table_t;
+
+typedef struct {
+    vm_cycle_slot_t *items;
+    vm_type_t count;
+    vm_type_t size;
+} cycle_stack_t;
+
+static inline vm_type_t cycle_hash(vm_pointer_t ptr) {
+    return (vm_type_t) (((uint32_t) ptr >> 4) * 2654435761u);
+}
+
+static inline vm_type_t *cycle_ref_count(CPU_State *state, vm_pointer_t ptr) {
+    return vm_pointer_to_native(state->memory, ptr, vm_type_t*);
+}
+
+static void table_resize(cycle_table_t *table, vm_type_t size) {
+    vm_cycle_slot_t *old_slots = table->slots;
+    vm_type_t old_size = table->size;
+
+    table->slots = calloc(size, sizeof(vm_cycle_slot_t));
+    table->size = size;
+
+    for (vm_type_t i = 0; i < old_size; i++) {
+        if (old_slots[i].ptr == 0) continue;
+        vm_type_t slot = cycle_hash(old_slots[i].ptr) & (size - 1);
+        while (table->slots[slot].ptr != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        table->slots[slot] = old_slots[i];
+    }
+    free(old_slots);
+}
+
+/*
+ * Returns the slot of ptr, adding it (colored black) if it is not in the table yet.
+ */
+static vm_cycle_slot_t *table_insert(cycle_table_t *table, vm_pointer_t ptr, unsigned char type) {
+    if ((table->count + 1) * 2 > table->size) {
+        table_resize(table, table->size == 0 ? CYCLES_MIN_SIZE : table->size * 2);
+    }
+
+    vm_type_t mask = table->size - 1;
+    vm_type_t slot = cycle_hash(ptr) & mask;
+    while (table->slots[slot].ptr != 0) {
+        if (table->slots[slot].ptr == ptr) {
+            return &table->slots[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    table->slots[slot] = (vm_cycle_slot_t) { .ptr = ptr, .type = type, .colour = CYCLE_BLACK };
+    table->count++;
+    return &table->slots[slot];
+}
+
+static void stack_push(cycle_stack_t *stack, vm_pointer_t ptr, unsigned char type) {
+    if (stack->count == stack->size) {
+        stack->size = stack->size == 0 ? CYCLES_MIN_SIZE : stack->size * 2;
+        stack->items = realloc(stack->items, stack->size * sizeof(vm_cycle_slot_t));
+    }
+    stack->items[stack->count++] = (vm_cycle_slot_t) { .ptr = ptr, .type = type };
+}
+
+static inline void push_child(CPU_State *state, cycle_stack_t *stack, vm_value_t *value) {
+    if ((value->type == VM_TYPE_MAP || value->type == VM_TYPE_ARRAY)
+        && *cycle_ref_count(state, value->pointer_value) < VM_ATOM_PINNED) {
+        stack_push(stack, value->pointer_value, (unsigned char) value->type);
+    }
+}
+
+/*
+ * Pushes the maps and arrays the object refers to, one entry per reference.
+ */
+static void push_children(CPU_State *state, cycle_stack_t *stack, vm_pointer_t ptr, unsigned char type) {
+    if (type == VM_TYPE_ARRAY) {
+        vm_type_t *reserved_mem = vm_pointer_to_native(state->memory, ptr, vm_type_t*);
+        vm_value_t *array = vm_pointer_to_native(state->memory, *(reserved_mem + 2), vm_value_t*);
+        for (vm_type_t i = 0; i < *(reserved_mem + 1); i++) {
+            push_child(state, stack, &array[i]);
+        }
+        return;
+    }
+
+    vm_map_table_t *table = map_table(state, ptr);
+    if (table != NULL) {
+        vm_map_elem_t *entries = MAP_ENTRIES(table);
+        for (vm_type_t i = 0; i < table->used; i++) {
+            if (entries[i].name != 0) {
+                push_child(state, stack, &entries[i].value);
+            }
+        }
+    }
+
+    vm_pointer_t prototype = *(vm_pointer_to_native(state->memory, ptr, vm_pointer_t*) + 2);
+    if (prototype != 0) {
+        vm_value_t value = { .type = VM_TYPE_MAP, .pointer_value = prototype };
+        push_child(state, stack, &value);
+    }
+}
+
+static void mark_gray(CPU_State *state, cycle_table_t *colours, cycle_stack_t *work, vm_cycle_slot_t root) {
+    vm_cycle_slot_t *slot = table_insert(colours, root.ptr, root.type);
+    if (slot->colour == CYCLE_GRAY) return;
+    slot->colour = CYCLE_GRAY;
+
+    stack_push(work, root.ptr, root.type);
+    while (work->count > 0) {
+        vm_cycle_slot_t node = work->items[--work->count];
+        vm_type_t first = work->count, keep = work->count;
+        push_children(state, work, node.ptr, node.type);
+        for (vm_type_t i = first; i < work->count; i++) {
+            (*cycle_ref_count(state, work->items[i].ptr))--;
+            slot = table_insert(colours, work->items[i].ptr, work->items[i].type);
+            if (slot->colour != CYCLE_GRAY) {
+                slot->colour = CYCLE_GRAY;
+                work->items[keep++] = work->items[i];
+            }
+        }
+        work->count = keep;
+    }
+}
+
+static void scan_black(CPU_State *state, cycle_table_t *colours, cycle_stack_t *work, vm_cycle_slot_t *slot) {
+    vm_type_t bottom = work->count;
+    slot->colour = CYCLE_BLACK;
+    stack_push(work, slot->ptr, slot->type);
+    while (work->count > bottom) {
+        vm_cycle_slot_t node = work->items[--work->count];
+        vm_type_t first = work->count, keep = work->count;
+        push_children(state, work, node.ptr, node.type);
+        for (vm_type_t i = first; i < work->count; i++) {
+            (*cycle_ref_count(state, work->items[i].ptr))++;
+            slot = table_insert(colours, work->items[i].ptr, work->items[i].type);
+            if (slot->colour != CYCLE_BLACK) {
+                slot->colour = CYCLE_BLACK;
+                work->items[keep++] = work->items[i];
+            }
+        }
+        work->count = keep;
+    }
+}
+
+static void scan(CPU_State *state, cycle_table_t *colours, cycle_stack_t *work, vm_cycle_slot_t root) {
+    stack_push(work, root.ptr, root.type);
+    while (work->count > 0) {
+        vm_cycle_slot_t node = work->items[--work->count];
+        vm_cycle_slot_t *slot = table_insert(colours, node.ptr, node.type);
+        if (slot->colour != CYCLE_GRAY) continue;
+
+        if (*cycle_ref_count(state, node.ptr) > 0) {
+            scan_black(state, colours, work, slot);
+        } else {
+            slot->colour = CYCLE_WHITE;
+            push_children(state, work, node.ptr, node.type);
+        }
+    }
+}
+
+static void collect_white(CPU_State *state, cycle_table_t *colours, cycle_stack_t *work, cycle_stack_t *garbage,
+                          vm_cycle_slot_t root) {
+    stack_push(work, root.ptr, root.type);
+    while (work->count > 0) {
+        vm_cycle_slot_t node = work->items[--work->count];
+        vm_cycle_slot_t *slot = table_insert(colours, node.ptr, node.type);
+        if (slot->colour != CYCLE_WHITE) continue;
+
+        slot->colour = CYCLE_FREED;
+        stack_push(garbage, node.ptr, node.type);
+        push_children(state, work, node.ptr, node.type);
+    }
+}
+
+/*
+ * Frees a white object. Its references to maps and arrays are either to other white objects, which are freed as well,
+ * or were already taken off their targets while marking, so only strings are released.
+ */
+static void free_white(CPU_State *state, vm_cycle_slot_t node) {
+    vm_type_t *reserved_mem = vm_pointer_to_native(state->memory, node.ptr, vm_type_t*);
+
+    if (node.type == VM_TYPE_ARRAY) {
+        vm_value_t *array = vm_pointer_to_native(state->memory, *(reserved_mem + 2), vm_value_t*);
+        for (vm_type_t i = 0; i < *(reserved_mem + 1); i++) {
+            if (array[i].type == VM_TYPE_STRING) {
+                release(state, &array[i]);
+            }
+        }
+        vm_free(state->memory, *(reserved_mem + 2));
+        state->cycle_stats.arrays++;
+    } else {
+        vm_map_table_t *table = map_table(state, node.ptr);
+        if (table != NULL) {
+            vm_map_elem_t *entries = MAP_ENTRIES(table);
+            for (vm_type_t i = 0; i < table->used; i++) {
+                if (entries[i].name == 0) continue;
+                if (entries[i].value.type == VM_TYPE_STRING) {
+                    release(state, &entries[i].value);
+                }
+                release_pointer(state, VM_TYPE_STRING, entries[i].name);
+            }
+            vm_free(state->memory, *(reserved_mem + 1));
+        }
+        state->cycle_stats.maps++;
+    }
+
+    vm_free(state->memory, node.ptr);
+}
+
+/*
+ * Remembers a map or array that release() decremented to a non-zero count. Once there are cycle_threshold of them, a
+ * collection is due.
+ */
+void cycles_buffer(CPU_State *state, enum vm_value_type_t type, vm_pointer_t ptr) {
+    cycle_table_t roots = { state->cycle_roots, state->num_cycle_roots, state->cycle_roots_size };
+    table_insert(&roots, ptr, (unsigned char) type);
+    state->cycle_roots = roots.slots;
+    state->num_cycle_roots = roots.count;
+    state->cycle_roots_size = roots.size;
+
+    if (state->num_cycle_roots >= state->cycle_threshold) {
+        state->safepoint_pending = 1;
+    }
+}
+
+/*
+ * Drops a candidate root that is about to be freed because its refcount went to zero.
+ */
+void cycles_forget(CPU_State *state, vm_pointer_t ptr) {
+    vm_type_t mask = state->cycle_roots_size - 1;
+    vm_type_t slot = cycle_hash(ptr) & mask;
+    while (state->cycle_roots[slot].ptr != ptr) {
+        if (state->cycle_roots[slot].ptr == 0) return;
+        slot = (slot + 1) & mask;
+    }
+
+    // backward shift deletion, like atom_free()
+    vm_type_t next = (slot + 1) & mask;
+    while (state->cycle_roots[next].ptr != 0) {
+        vm_type_t home = cycle_hash(state->cycle_roots[next].ptr) & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            state->cycle_roots[slot] = state->cycle_roots[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    state->cycle_roots[slot] = (vm_cycle_slot_t) { 0 };
+    state->num_cycle_roots--;
+}
+
+void cycles_destroy(CPU_State *state) {
+    free(state->cycle_roots);
+    state->cycle_roots = NULL;
+    state->num_cycle_roots = 0;
+    state->cycle_roots_size = 0;
+}
+
+/*
+ * Sets the number of candidate roots that triggers a collection. 0 turns the collector off and drops the candidates
+ * that were buffered so far.
+ */
+void cpu_set_cycle_threshold(CPU_State *state, vm_type_t threshold) {
+    state->cycle_threshold = threshold;
+    if (threshold == 0) {
+        cycles_destroy(state);
+    } else if (state->num_cycle_roots >= threshold) {
+        state->safepoint_pending = 1;
+    }
+}
+
+/*
+ * Frees all garbage cycles reachable from the buffered candidate roots. Must not run while an instruction is holding on
+ * to a map or array it did not retain, which is why release() leaves it to cpu_safepoint().
+ */
+void cpu_collect_cycles(CPU_State *state) {
+    if (state->num_cycle_roots == 0) {
+        return;
+    }
+
+    // take the candidates out of the buffer, releasing strings while freeing may not touch it
+    cycle_stack_t roots = { 0 };
+    for (vm_type_t i = 0; i < state->cycle_roots_size; i++) {
+        if (state->cycle_roots[i].ptr != 0) {
+            stack_push(&roots, state->cycle_roots[i].ptr, state->cycle_roots[i].type);
+        }
+    }
+    memset(state->cycle_roots, 0, state->cycle_roots_size * sizeof(vm_cycle_slot_t));
+    state->num_cycle_roots = 0;
+
+    cycle_table_t colours = { 0 };
+    cycle_stack_t work = { 0 };
+    cycle_stack_t garbage = { 0 };
+
+    for (vm_type_t i = 0; i < roots.count; i++) {
+        mark_gray(state, &colours, &work, roots.items[i]);
+    }
+    for (vm_type_t i = 0; i < roots.count; i++) {
+        scan(state, &colours, &work, roots.items[i]);
+    }
+    for (vm_type_t i = 0; i < roots.count; i++) {
+        collect_white(state, &colours, &work, &garbage, roots.items[i]);
+    }
+    for (vm_type_t i = 0; i < garbage.count; i++) {
+        free_white(state, garbage.items[i]);
+    }
+
+    state->cycle_stats.collections++;
+    state->cycle_stats.roots += roots.count;
+
+    free(roots.items);
+    free(colours.slots);
+    free(work.items);
+    free(garbage.items);
+}
+
+void cpu_print_cycle_stats(CPU_State *state) {
+    vm_cycle_stats_t *stats = &state->cycle_stats;
+    printf("Cycle collections: %lu (threshold %u), %lu candidate roots, freed %lu maps and %lu arrays\n",
+           stats->collections, (unsigned int) state->cycle_threshold, stats->roots, stats->maps, stats->arrays);
+}
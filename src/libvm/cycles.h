@@ -0,0 +1,10 @@
+#ifndef FUNKY_VM_CYCLES_H
+#define FUNKY_VM_CYCLES_H
+
+#include "../../include/funkyvm/cpu.h"
+
+void cycles_buffer(CPU_State *state, enum vm_value_type_t type, vm_pointer_t ptr);
+void cycles_forget(CPU_State *state, vm_pointer_t ptr);
+void cycles_destroy(CPU_State *state);
+
+#endif //FUNKY_VM_CYCLES_H
@@ -3,48 +3,49 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 
 #include "error_handling.h"
 
-static CPU_State unknown_state = {0};
+// errors that do not belong to any CPU_State, shared by all of them and so never written to
+static const Debug_Context unknown_context = {
+        .filename = "<unknown>",
+        .col = 0,
+        .line = 0,
+        .num_stacktrace = 0
+};
 
 void vm_exit(CPU_State* state, int res) {
+    if (state == NULL) {
+        // there is no CPU to stop, e.g. the heap ran out where the allocator does not know which CPU it serves
+        exit(res);
+    }
     state->running = 0;
 }
 
 void vm_vaerror(CPU_State* state, const char* error_message, va_list vl) {
-    if (state == NULL) {
-        if (unknown_state.debug_context.filename == 0) {
-            unknown_state = (CPU_State) {
-                    .debug_context = (Debug_Context) {
-                            .filename = "<unknown>",
-                            .col = 0,
-                            .line = 0,
-                            .num_stacktrace = 0
-                    }
-            };
-        }
-        state = &unknown_state;
+    const Debug_Context *context = &unknown_context;
+    if (state != NULL) {
+        state->in_error_state = 1;
+        context = &state->debug_context;
     }
 
-    state->in_error_state = 1;
-
     fprintf(stderr, "Error: ");
     vfprintf(stderr, error_message, vl);
     fprintf(stderr, "\n");
 
-    for (int i = state->debug_context.num_stacktrace; i >= 0; i--) {
+    for (int i = context->num_stacktrace; i >= 0; i--) {
         if (i == 0) {
             fprintf(stderr, "  at %s:%d:%d\n",
-                    state->debug_context.filename, state->debug_context.line, state->debug_context.col);
-        } else if (i == state->debug_context.num_stacktrace) {
+                    context->filename, context->line, context->col);
+        } else if (i == context->num_stacktrace) {
             fprintf(stderr, "  at %s (%s:%d:%d)\n",
-                    state->debug_context.stacktrace[state->debug_context.num_stacktrace - 1].name,
-                    state->debug_context.filename, state->debug_context.line, state->debug_context.col);
+                    context->stacktrace[context->num_stacktrace - 1].name,
+                    context->filename, context->line, context->col);
         } else {
-            struct Stacktrace_Frame *frame = &state->debug_context.stacktrace[i];
-            fprintf(stderr, "  at %s (%s:%d:%d)\n", state->debug_context.stacktrace[i - 1].name, frame->filename,
+            struct Stacktrace_Frame *frame = &context->stacktrace[i];
+            fprintf(stderr, "  at %s (%s:%d:%d)\n", context->stacktrace[i - 1].name, frame->filename,
                     frame->line, frame->col);
         }
     }
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "funkyvm/funkyvm.h"
+#include "instructions/instructions.h"
+#include "error_handling.h"
+#include "fibers.h"
+
+/*
+ * Fibers are threads of a script that take turns on the CPU of one VM. Each has its own registers and its own stack,
+ * which starts out at VM_FIBER_STACK_SIZE and grows like the main stack does (see cpu_grow_stack()); the heap and the
+ * modules are shared. The program itself runs as fiber 0, and the VM stops when it ends, whatever the other fibers are
+ * doing.
+ *
+ * fiber.spawn calls a function on a new fiber, fiber.yield gives the turn to the next fiber and fiber.join waits for a
+ * fiber to return and takes its result. A fiber that does none of these gives up its turn after fiber_quantum backward
+ * branches and calls, which the dispatch loops count anyway for cpu_run_slice(). Turns go round robin through the
+ * table, skipping fibers that wait for another one.
+ *
+ * The registers of the running fiber are the registers of the CPU_State; its slot in the table is only written when it
+ * is switched out. Fibers only switch between two instructions, so nothing is halfway done when they do.
+ */
+
+#define FIBERS_MIN_SIZE 8
+
+static void fiber_save(CPU_State *state, vm_fiber_t *fiber) {
+    fiber->pc = state->pc;
+    fiber->sp = state->sp;
+    fiber->mp = state->mp;
+    fiber->ap = state->ap;
+    fiber->rr = state->rr;
+    fiber->r0 = state->r0;
+    fiber->r1 = state->r1;
+    fiber->r2 = state->r2;
+    fiber->r3 = state->r3;
+    fiber->r4 = state->r4;
+    fiber->r5 = state->r5;
+    fiber->r6 = state->r6;
+    fiber->r7 = state->r7;
+    fiber->stack_base = state->stack_base;
+    fiber->stack_size = state->stack_size;
+    fiber->stack_limit = state->stack_limit;
+    fiber->retired_stacks = state->retired_stacks;
+}
+
+static void fiber_load(CPU_State *state, vm_fiber_t *fiber) {
+    state->pc = fiber->pc;
+    state->sp = fiber->sp;
+    state->mp = fiber->mp;
+    state->ap = fiber->ap;
+    state->rr = fiber->rr;
+    state->r0 = fiber->r0;
+    state->r1 = fiber->r1;
+    state->r2 = fiber->r2;
+    state->r3 = fiber->r3;
+    state->r4 = fiber->r4;
+    state->r5 = fiber->r5;
+    state->r6 = fiber->r6;
+    state->r7 = fiber->r7;
+    state->stack_base = fiber->stack_base;
+    state->stack_size = fiber->stack_size;
+    state->stack_limit = fiber->stack_limit;
+    state->retired_stacks = fiber->retired_stacks;
+}
+
+// fiber 0 is the program, on the stack cpu_init() made
+static void fibers_init(CPU_State *state) {
+    state->fibers = calloc(FIBERS_MIN_SIZE, sizeof(vm_fiber_t));
+    state->fibers_size = FIBERS_MIN_SIZE;
+    state->num_fibers = 1;
+    state->current_fiber = 0;
+    state->fibers[0].status = VM_FIBER_RUNNABLE;
+}
+
+static vm_type_t fibers_alloc(CPU_State *state) {
+    for (vm_type_t id = 1; id < state->num_fibers; id++) {
+        if (state->fibers[id].status == VM_FIBER_FREE) {
+            return id;
+        }
+    }
+    if (state->num_fibers == state->fibers_size) {
+        state->fibers = realloc(state->fibers, state->fibers_size * 2 * sizeof(vm_fiber_t));
+        memset(state->fibers + state->fibers_size, 0, state->fibers_size * sizeof(vm_fiber_t));
+        state->fibers_size *= 2;
+    }
+    return state->num_fibers++;
+}
+
+/*
+ * The next fiber after the current one that can run, or the current one if there is none.
+ */
+static vm_type_t fibers_next(CPU_State *state) {
+    for (vm_type_t i = 1; i < state->num_fibers; i++) {
+        vm_type_t id = (state->current_fiber + i) % state->num_fibers;
+        if (state->fibers[id].status == VM_FIBER_RUNNABLE) {
+            return id;
+        }
+    }
+    return state->current_fiber;
+}
+
+static void fibers_switch(CPU_State *state, vm_type_t id) {
+    if (id == state->current_fiber) {
+        return;
+    }
+    fiber_save(state, &state->fibers[state->current_fiber]);
+    fiber_load(state, &state->fibers[id]);
+    state->current_fiber = id;
+}
+
+// for a fiber that cannot go on, there has to be another one that can
+static void fibers_switch_away(CPU_State *state) {
+    vm_type_t next = fibers_next(state);
+    if (next == state->current_fiber) {
+        vm_error(state, "Deadlock: every fiber is waiting for another one");
+        vm_exit(state, EXIT_FAILURE);
+        return;
+    }
+    fibers_switch(state, next);
+}
+
+/*
+ * Gives the turn to the next fiber, called by the dispatch loops once the current one has had its quantum.
+ */
+void fibers_preempt(CPU_State *state) {
+    fibers_switch(state, fibers_next(state));
+}
+
+/*
+ * Called by ret when the function a fiber was spawned with returns. Its stack goes, along with the blocks the stack
+ * grew out of; its result stays in rr until it is joined.
+ */
+void fibers_exit(CPU_State *state) {
+    if (state->fibers == NULL || state->current_fiber == 0) {
+        vm_error(state, "Junk on the stack, return address is lost");
+        vm_exit(state, EXIT_FAILURE);
+        return;
+    }
+
+    vm_type_t id = state->current_fiber;
+    vm_free(state->memory, state->stack_base);
+    cpu_free_retired_stacks(state, &state->retired_stacks);
+    state->stack_base = 0;
+    state->fibers[id].status = VM_FIBER_DONE;
+    for (vm_type_t i = 0; i < state->num_fibers; i++) {
+        if (state->fibers[i].status == VM_FIBER_WAITING && state->fibers[i].joining == id) {
+            state->fibers[i].status = VM_FIBER_RUNNABLE;
+        }
+    }
+    fibers_switch_away(state);
+}
+
+/*
+ * Frees the stacks of the fibers that are switched out and the results nobody joined. The stack of the running fiber
+ * is the one cpu_destroy() frees, along with the blocks it grew out of.
+ */
+void fibers_destroy(CPU_State *state) {
+    for (vm_type_t id = 0; id < state->num_fibers; id++) {
+        vm_fiber_t *fiber = &state->fibers[id];
+        if (id == state->current_fiber || fiber->status == VM_FIBER_FREE) {
+            continue;
+        }
+        if (fiber->status == VM_FIBER_DONE) {
+            release(state, &fiber->rr);
+        } else {
+            vm_free(state->memory, fiber->stack_base);
+            cpu_free_retired_stacks(state, &fiber->retired_stacks);
+        }
+    }
+    free(state->fibers);
+    state->fibers = NULL;
+    state->num_fibers = 0;
+    state->fibers_size = 0;
+    state->current_fiber = 0;
+}
+
+/*
+ * Sets how many backward branches and calls a fiber may run before the next one gets its turn. 0 only switches
+ * fibers at fiber.yield, fiber.join, and when a fiber returns. A new quantum applies from the next turn on.
+ */
+void cpu_set_fiber_quantum(CPU_State *state, vm_type_t quantum) {
+    state->fiber_quantum = quantum;
+    state->safepoint_pending = 1; // in case no turns were counted so far, see cpu_tick_period()
+}
+
+/**!
+ * instruction: fiber.spawn
+ * category: fibers
+ * opcode: "0x63"
+ * description: Calls a function on a new fiber and pushes the id of the fiber. The new fiber gets its first turn after the current one.
+ * extra_info: The function returns with <code>ret</code> as usual; its result is what fiber.join pushes.
+ * operands:
+ *   - type: uint
+ *     description: Number of arguments
+ * stack_pre:
+ *   - type: reference
+ *     description: the function
+ *   - type: any
+ *     description: the arguments, moved to the stack of the new fiber; they may not be references to the stack
+ * stack_post:
+ *   - type: uint
+ *     description: id of the new fiber
+ */
+INSTR(fiber_spawn) {
+    vm_type_t num_args = GET_OPERAND();
+    USE_STACK();
+    if (stack->type != VM_TYPE_REF) {
+        vm_error(state, "Not a function");
+        vm_exit(state, EXIT_FAILURE);
+        return;
+    }
+
+    // the new fiber outlives the frame these would point into, and the stack they are on may move, see cpu_grow_stack()
+    vm_pointer_t stack_bottom = state->stack_base - sizeof(vm_type_signed_t);
+    for (vm_value_t *arg = stack - num_args; arg < stack; arg++) {
+        if (arg->type == VM_TYPE_REF && arg->pointer_value >= stack_bottom &&
+            arg->pointer_value < stack_bottom + VM_STACK_ALLOC_SIZE(state->stack_size)) {
+            vm_error(state, "Cannot pass a reference to the stack to a new fiber");
+            vm_exit(state, EXIT_FAILURE);
+            return;
+        }
+    }
+
+    if (state->fibers == NULL) {
+        fibers_init(state);
+        // the dispatch loop starts counting turns, see cpu_tick_period()
+        state->safepoint_pending = 1;
+    }
+    vm_type_t id = fibers_alloc(state);
+    vm_fiber_t *fiber = &state->fibers[id];
+
+    // the arguments and the frame call.pop would push, with a return address of 0 that ends the fiber
+    vm_type_t size = VM_FIBER_STACK_SIZE;
+    if (size < (num_args + 2) * sizeof(vm_value_t)) {
+        size = (num_args + 2) * sizeof(vm_value_t);
+    }
+    vm_pointer_t base = vm_malloc(state->memory, VM_STACK_ALLOC_SIZE(size));
+    vm_pointer_t empty = base - sizeof(vm_type_signed_t);
+    vm_value_t *bottom = vm_pointer_to_native(state->memory, empty, vm_value_t*) + 1;
+    memcpy(bottom, stack - num_args, num_args * sizeof(vm_value_t));
+    bottom[num_args] = (vm_value_t) { .type = VM_TYPE_REF, .uint_value = 0 };
+    bottom[num_args + 1] = (vm_value_t) { .type = VM_TYPE_UINT, .uint_value = num_args };
+
+    *fiber = (vm_fiber_t) {
+            .pc = stack->uint_value,
+            .sp = empty + (num_args + 2) * sizeof(vm_value_t),
+            .mp = empty,
+            .ap = empty,
+            .stack_base = base,
+            .stack_size = size,
+            .stack_limit = base + size,
+            .status = VM_FIBER_RUNNABLE
+    };
+
+    AJS_STACK(-(vm_type_signed_t) num_args);
+    *(stack - num_args) = (vm_value_t) { .type = VM_TYPE_UINT, .uint_value = id };
+}
+
+/**!
+ * instruction: fiber.yield
+ * category: fibers
+ * opcode: "0x64"
+ * description: Gives the turn to the next fiber that can run. Continues right away if there is none.
+ */
+INSTR(fiber_yield) {
+    if (state->fibers != NULL) {
+        fibers_switch(state, fibers_next(state));
+    }
+}
+
+/**!
+ * instruction: fiber.join
+ * category: fibers
+ * opcode: "0x65"
+ * description: Waits for a fiber to return and replaces its id by its result. Other fibers take turns while it waits.
+ * extra_info: A fiber can be joined once, after which its id may be reused by fiber.spawn.
+ * stack_pre:
+ *   - type: uint
+ *     description: id of the fiber
+ * stack_post:
+ *   - type: any
+ *     description: what the fiber returned in <code>%rr</code>
+ */
+INSTR(fiber_join) {
+    USE_STACK();
+    vm_type_t id = stack->uint_value;
+    if (state->fibers == NULL || (stack->type != VM_TYPE_UINT && stack->type != VM_TYPE_INT) ||
+        id >= state->num_fibers || state->fibers[id].status == VM_FIBER_FREE) {
+        vm_error(state, "Invalid fiber %u", (unsigned int) id);
+        vm_exit(state, EXIT_FAILURE);
+        return;
+    }
+    if (id == state->current_fiber) {
+        vm_error(state, "Fiber %u cannot join itself", (unsigned int) id);
+        vm_exit(state, EXIT_FAILURE);
+        return;
+    }
+
+    vm_fiber_t *fiber = &state->fibers[id];
+    if (fiber->status == VM_FIBER_DONE) {
+        *stack = fiber->rr;
+        *fiber = (vm_fiber_t) { .status = VM_FIBER_FREE };
+        while (state->num_fibers > 1 && state->fibers[state->num_fibers - 1].status == VM_FIBER_FREE) {
+            state->num_fibers--;
+        }
+        return;
+    }
+
+    // run fiber.join again once the fiber is done
+    state->pc--;
+    state->fibers[state->current_fiber].status = VM_FIBER_WAITING;
+    state->fibers[state->current_fiber].joining = id;
+    fibers_switch_away(state);
+}
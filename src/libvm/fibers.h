@@ -0,0 +1,10 @@
+#ifndef FUNKY_VM_FIBERS_H
+#define FUNKY_VM_FIBERS_H
+
+#include "../../include/funkyvm/cpu.h"
+
+void fibers_preempt(CPU_State *state);
+void fibers_exit(CPU_State *state);
+void fibers_destroy(CPU_State *state);
+
+#endif //FUNKY_VM_FIBERS_H
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "funkyvm/funkyvm.h"
+#include "funkyvm/host.h"
+
+#if defined(VM_HOST_THREADS) && VM_HOST_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(FUNKY_VM_OS_WINDOWS)
+#include <Windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Every worker has a queue of job indices. The owner takes jobs from the tail, thieves take them from the head, so the
+ * owner works through its own jobs in the opposite direction of whoever helps it out. Jobs do not create new jobs, so
+ * once a worker finds every queue empty there is nothing left for it to do and it stops.
+ */
+typedef struct host_queue_t {
+#if defined(VM_HOST_THREADS) && VM_HOST_THREADS
+    pthread_mutex_t lock;
+#endif
+    size_t *jobs;
+    size_t head, tail;
+} host_queue_t;
+
+typedef struct host_pool_t host_pool_t;
+
+typedef struct host_worker_t {
+    host_pool_t *pool;
+    int index;
+    vm_host_worker_stats_t stats;
+#if defined(VM_HOST_THREADS) && VM_HOST_THREADS
+    pthread_t thread;
+#endif
+} host_worker_t;
+
+struct host_pool_t {
+    vm_host_job_t *jobs;
+    host_queue_t *queues;
+    host_worker_t *workers;
+    int num_workers;
+    const vm_host_options_t *options;
+    double start_time;
+};
+
+static double host_time() {
+#if defined(FUNKY_VM_OS_WINDOWS)
+    LARGE_INTEGER time, freq;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&time);
+    return (double) time.QuadPart / freq.QuadPart;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec * .000000001;
+#endif
+}
+
+#if defined(VM_HOST_THREADS) && VM_HOST_THREADS
+#define queue_lock(queue) pthread_mutex_lock(&(queue)->lock)
+#define queue_unlock(queue) pthread_mutex_unlock(&(queue)->lock)
+#else
+#define queue_lock(queue)
+#define queue_unlock(queue)
+#endif
+
+/*
+ * Takes a job from the tail (own queue) or the head (someone else's queue). Returns 0 if the queue is empty.
+ */
+static int queue_take(host_queue_t *queue, int steal, size_t *job) {
+    int found = 0;
+    queue_lock(queue);
+    if (queue->head < queue->tail) {
+        *job = steal ? queue->jobs[queue->head++] : queue->jobs[--queue->tail];
+        found = 1;
+    }
+    queue_unlock(queue);
+    return found;
+}
+
+static void host_run_job(host_worker_t *worker, vm_host_job_t *job) {
+    const vm_host_options_t *options = worker->pool->options;
+    job->worker = worker->index;
+
+    Memory memory;
+    if (!memory_create(&memory, options->heap_size, options->max_heap_size)) {
+        fprintf(stderr, "Error: Could not reserve a heap for %s\n", job->kernel);
+        job->failed = 1;
+        return;
+    }
+    CPU_State state = cpu_init(&memory);
+    if (options->stack_size != 0 || options->max_stack_size != 0) {
+        cpu_set_stack_size(&state, options->stack_size ? options->stack_size : VM_STACK_SIZE / sizeof(vm_value_t),
+                           options->max_stack_size ? options->max_stack_size : VM_STACK_MAX_SIZE / sizeof(vm_value_t));
+    }
+    cpu_set_cycle_threshold(&state, options->cycle_threshold);
+    cpu_set_release_slice(&state, options->release_slice);
+
+    if (options->setup != NULL) {
+        options->setup(&state, options->userdata);
+    }
+
+    Module kernel = module_load_name(&state, job->kernel);
+    if (kernel.addr == 0) {
+        free(kernel.name);
+        job->failed = 1;
+    } else {
+        module_register(&state, kernel);
+        cpu_set_entry_to_module(&state, &kernel);
+        job->result = cpu_run(&state);
+        job->failed = state.in_error_state;
+    }
+
+    cpu_destroy(&state);
+    memory_destroy(&memory);
+}
+
+static void *host_worker_main(void *arg) {
+    host_worker_t *worker = arg;
+    host_pool_t *pool = worker->pool;
+
+    for (;;) {
+        size_t job;
+        int found = queue_take(&pool->queues[worker->index], 0, &job);
+        for (int i = 1; !found && i < pool->num_workers; i++) {
+            if (queue_take(&pool->queues[(worker->index + i) % pool->num_workers], 1, &job)) {
+                worker->stats.stolen++;
+                found = 1;
+            }
+        }
+        if (!found) {
+            break;
+        }
+
+        double start = host_time();
+        host_run_job(worker, &pool->jobs[job]);
+        worker->stats.busy_time += host_time() - start;
+        worker->stats.jobs++;
+    }
+
+    worker->stats.wall_time = host_time() - pool->start_time;
+    return NULL;
+}
+
+/*
+ * The number of workers to use when the host does not say: one per online processor.
+ */
+int vm_host_default_workers() {
+#if defined(FUNKY_VM_OS_WINDOWS)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int) info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Runs all jobs on options->num_workers threads and blocks until they are done. The result of every job is written back
+ * into it, and if stats is not NULL it receives one entry per worker. Returns the number of jobs that failed.
+ *
+ * Without VM_HOST_THREADS the workers run one after the other on the calling thread, which gives the same results.
+ */
+int vm_host_run(vm_host_job_t *jobs, size_t num_jobs, const vm_host_options_t *options, vm_host_worker_stats_t *stats) {
+    int num_workers = options->num_workers;
+    if (num_workers < 1) {
+        num_workers = vm_host_default_workers();
+    }
+
+    host_pool_t pool = {
+            .jobs = jobs,
+            .queues = calloc((size_t) num_workers, sizeof(host_queue_t)),
+            .workers = calloc((size_t) num_workers, sizeof(host_worker_t)),
+            .num_workers = num_workers,
+            .options = options
+    };
+
+    // deal the jobs out round robin, so every worker starts with a mix of the batch
+    for (int w = 0; w < num_workers; w++) {
+        host_queue_t *queue = &pool.queues[w];
+#if defined(VM_HOST_THREADS) && VM_HOST_THREADS
+        pthread_mutex_init(&queue->lock, NULL);
+#endif
+        queue->jobs = malloc(sizeof(size_t) * (num_jobs / num_workers + 1));
+        for (size_t j = (size_t) w; j < num_jobs; j += num_workers) {
+            queue->jobs[queue->tail++] = j;
+        }
+    }
+
+    for (size_t j = 0; j < num_jobs; j++) {
+        jobs[j].result = 0;
+        jobs[j].failed = 0;
+        jobs[j].worker = -1;
+    }
+
+    for (int w = 0; w < num_workers; w++) {
+        host_worker_t *worker = &pool.workers[w];
+        worker->pool = &pool;
+        worker->index = w;
+    }
+
+    pool.start_time = host_time();
+
+#if defined(VM_HOST_THREADS) && VM_HOST_THREADS
+    for (int w = 0; w < num_workers; w++) {
+        if (pthread_create(&pool.workers[w].thread, NULL, host_worker_main, &pool.workers[w]) != 0) {
+            fprintf(stderr, "Error: Could not start worker %d, running its jobs on the other workers\n", w);
+            pool.workers[w].thread = pthread_self();
+        }
+    }
+    pthread_t self = pthread_self();
+    for (int w = 0; w < num_workers; w++) {
+        if (!pthread_equal(pool.workers[w].thread, self)) {
+            pthread_join(pool.workers[w].thread, NULL);
+        }
+    }
+#else
+    for (int w = 0; w < num_workers; w++) {
+        host_worker_main(&pool.workers[w]);
+    }
+#endif
+
+    int failed = 0;
+    for (size_t j = 0; j < num_jobs; j++) {
+        failed += jobs[j].failed || jobs[j].worker < 0;
+    }
+
+    for (int w = 0; w < num_workers; w++) {
+        if (stats != NULL) {
+            stats[w] = pool.workers[w].stats;
+        }
+        free(pool.queues[w].jobs);
+#if defined(VM_HOST_THREADS) && VM_HOST_THREADS
+        pthread_mutex_destroy(&pool.queues[w].lock);
+#endif
+    }
+    free(pool.workers);
+    free(pool.queues);
+
+    return failed;
+}
@@ -10,13 +10,85 @@
 
 /* -- Arrays --
  * Arrays are saved in memory as a packed tuple:
- *   vm_type_t length
  *   vm_type_t ref_count
+ *   vm_type_t length
  *   vm_type_t pointer to array of multiple vm_value_t
+ *   vm_type_t capacity, the number of vm_value_t there is room for
  */
 
 // Arrays are refcounted
 // Arrays are mutable. That means that arrays are changed in-place
+// Arrays grow geometrically, so appending is amortized O(1), and only shrink once they are mostly empty
+
+#define ARR_MIN_CAPACITY 4
+
+/*
+ * Allocates an array with a refcount of 1 and room for exactly length values. The values are left for the caller to
+ * fill in.
+ */
+vm_pointer_t arr_create(CPU_State *state, vm_type_t length) {
+    vm_pointer_t reserved_mem = vm_malloc(state->memory, sizeof(vm_type_t) * 4);
+    vm_type_t *ref_count      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
+    vm_type_t *len            = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
+    vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
+    vm_type_t *capacity       = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 3;
+
+    *ref_count = 1;
+    *len = length;
+    *array_ptr = vm_malloc(state->memory, length * sizeof(vm_value_t));
+    *capacity = length;
+
+    return reserved_mem;
+}
+
+static void arr_set_capacity(CPU_State *state, vm_type_t *reserved_mem, vm_type_t capacity) {
+    vm_pointer_t *array_ptr = reserved_mem + 2;
+    *array_ptr = vm_realloc(state->memory, *array_ptr, capacity * sizeof(vm_value_t));
+    *(reserved_mem + 3) = capacity;
+}
+
+/*
+ * Makes room for at least length values, growing the capacity geometrically so a sequence of appends only copies
+ * the values O(log n) times. The factor is 1.5 rather than 2: while growing, the old and the new values have to fit in
+ * memory at the same time, and the heap is small.
+ */
+static void arr_grow(CPU_State *state, vm_type_t *reserved_mem, vm_type_t length) {
+    vm_type_t capacity = *(reserved_mem + 3);
+    if (length <= capacity) {
+        return;
+    }
+
+    capacity = capacity < ARR_MIN_CAPACITY ? ARR_MIN_CAPACITY : capacity + capacity / 2;
+    if (capacity < length) {
+        capacity = length;
+    }
+    arr_set_capacity(state, reserved_mem, capacity);
+}
+
+/*
+ * Gives back half of the room once three quarters of it is unused. Shrinking well below the point where the array
+ * would grow again keeps an array that alternates between adding and removing an element from reallocating every time.
+ */
+static void arr_shrink(CPU_State *state, vm_type_t *reserved_mem) {
+    vm_type_t length = *(reserved_mem + 1);
+    vm_type_t capacity = *(reserved_mem + 3);
+    if (capacity <= ARR_MIN_CAPACITY || length > capacity / 4) {
+        return;
+    }
+
+    capacity /= 2;
+    arr_set_capacity(state, reserved_mem, capacity < ARR_MIN_CAPACITY ? ARR_MIN_CAPACITY : capacity);
+}
+
+/*
+ * Makes room for at least capacity values, so that many can be stored without reallocating.
+ */
+void arr_reserve(CPU_State *state, vm_pointer_t ptr, vm_type_t capacity) {
+    vm_type_t *reserved_mem = vm_pointer_to_native(state->memory, ptr, vm_type_t*);
+    if (capacity > *(reserved_mem + 3)) {
+        arr_set_capacity(state, reserved_mem, capacity);
+    }
+}
 
 /**!
  * instruction: ld.arr
@@ -33,15 +105,10 @@ INSTR(ld_arr) {
     vm_value_t arrayval;
     arrayval.type = VM_TYPE_ARRAY;
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for length
-    vm_type_t *ref_count      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
+    vm_pointer_t reserved_mem = arr_create(state, GET_OPERAND());
     vm_type_t *length         = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
     vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
 
-    *ref_count = 1;
-    *length = GET_OPERAND();
-
-    *array_ptr = vm_malloc(state->memory, *length * sizeof(vm_value_t));
     vm_value_t *array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
     for (int i = 0; i < *length; i++) {
@@ -160,7 +227,7 @@ INSTR(st_arrelem) {
     vm_value_t *array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
     if (index > (vm_type_signed_t)*len - 1) {
-        *array_ptr = vm_realloc(state->memory, *array_ptr, (index + 1) * sizeof(vm_value_t));
+        arr_grow(state, reserved_mem, (vm_type_t) (index + 1));
         array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
         for (int i = (vm_type_signed_t)*len; i <= index; i++) {
             array[i] = (vm_value_t) { .type = VM_TYPE_EMPTY };
@@ -216,9 +283,6 @@ INSTR(del_arrelem) {
         // last element
         (*len)--;
         release(state, &(array[index])); // release the value
-        release(state, stack - 1); // release the array
-        AJS_STACK(-2);
-        return;
     } else {
         // element somewhere in the middle or front
         release(state, &(array[index])); // release the value
@@ -228,12 +292,11 @@ INSTR(del_arrelem) {
             array[i - 1] = array[i];
         }
         (*len)--;
-
-        *array_ptr = vm_realloc(state->memory, *array_ptr, *len * sizeof(vm_value_t));
-
-        release(state, stack - 1); // release the array
     }
 
+    arr_shrink(state, reserved_mem);
+    release(state, stack - 1); // release the array
+
     AJS_STACK(-2);
 }
 
@@ -288,7 +351,7 @@ void arr_insert_at(CPU_State *state, vm_value_t *arrayval, vm_value_t *value, vm
         vm_value_t *array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
         if (index > (vm_type_signed_t)*len - 1) {
-            *array_ptr = vm_realloc(state->memory, *array_ptr, (index + 1) * sizeof(vm_value_t));
+            arr_grow(state, reserved_mem, (vm_type_t) (index + 1));
             array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
             for (int i = (vm_type_signed_t)*len; i < index; i++) {
@@ -302,8 +365,8 @@ void arr_insert_at(CPU_State *state, vm_value_t *arrayval, vm_value_t *value, vm
     }
 
     vm_pointer_t *array_ptr = reserved_mem + 2;
+    arr_grow(state, reserved_mem, *len + 1);
     (*len)++;
-    *array_ptr = vm_realloc(state->memory, *array_ptr, *len * sizeof(vm_value_t));
     vm_value_t *array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
     // move all values after the index up one place to create a gap at index
     for (vm_type_signed_t i = *len - 1; i > index; i--) {
@@ -396,15 +459,10 @@ INSTR(arr_slice) {
         vm_exit(state, EXIT_FAILURE);
     }
 
-    vm_type_t reserved_mem = vm_malloc(state->memory, sizeof(vm_type_t) * 3);
-    vm_type_t *ref_count      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
+    vm_pointer_t reserved_mem = arr_create(state, (vm_type_t) (end - start));
     vm_type_t *length         = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
     vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
 
-    *ref_count = 1;
-    *length = (vm_type_t) (end - start);
-
-    *array_ptr = vm_malloc(state->memory, *length * sizeof(vm_value_t));
     vm_value_t *new_array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
 
@@ -449,15 +507,9 @@ INSTR(arr_concat) {
     vm_pointer_t *second_array_ptr = second_reserved_mem + 2;
     vm_value_t *second_array = vm_pointer_to_native(state->memory, *second_array_ptr, vm_value_t*);
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for length
-    vm_type_t *ref_count      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_type_t *length         = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
+    vm_pointer_t reserved_mem = arr_create(state, (vm_type_t) (*first_len + *second_len));
     vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
 
-    *ref_count = 1;
-    *length = (vm_type_t) (*first_len + *second_len);
-
-    *array_ptr = vm_malloc(state->memory, *length * sizeof(vm_value_t));
     vm_value_t *new_array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
     // copy first array
@@ -500,15 +552,10 @@ INSTR(arr_copy) {
     vm_pointer_t *orig_array_ptr = orig_reserved_mem + 2;
     vm_value_t *orig_array = vm_pointer_to_native(state->memory, *orig_array_ptr, vm_value_t*);
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for length
-    vm_type_t *ref_count      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
+    vm_pointer_t reserved_mem = arr_create(state, *orig_len);
     vm_type_t *length         = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
     vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
 
-    *ref_count = 1;
-    *length = *orig_len;
-
-    *array_ptr = vm_malloc(state->memory, *orig_len * sizeof(vm_value_t));
     vm_value_t *new_array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
     for (int i = 0; i < *length; i++) {
@@ -541,15 +588,9 @@ void instr_conv_arr_rel(CPU_State* state, vm_type_signed_t rel) {
     vm_value_t arrayval;
     arrayval.type = VM_TYPE_ARRAY;
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for length
-    vm_type_t *ref_count      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_type_t *length         = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
-    vm_pointer_t *array_ptr   = (vm_pointer_t *)vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 2;
-
-    *ref_count = 1;
-    *length = 1;
+    vm_pointer_t reserved_mem = arr_create(state, 1);
+    vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
 
-    *array_ptr = vm_malloc(state->memory, sizeof(vm_value_t));
     vm_value_t *array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
     arrayval.pointer_value = reserved_mem;
@@ -599,11 +640,6 @@ INSTR(arr_range) {
     vm_value_t arrayval;
     arrayval.type = VM_TYPE_ARRAY;
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for length
-    vm_type_t *ref_count      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_type_t *length         = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
-    vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
-
     vm_type_signed_t start = (stack - 1)->int_value;
     vm_type_signed_t end = (stack)->int_value;
 
@@ -613,10 +649,10 @@ INSTR(arr_range) {
         step = -1;
     }
 
-    *ref_count = 1;
-    *length = (vm_type_t) ((end - start) / step);
+    vm_pointer_t reserved_mem = arr_create(state, (vm_type_t) ((end - start) / step));
+    vm_type_t *length         = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
+    vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
 
-    *array_ptr = vm_malloc(state->memory, *length * sizeof(vm_value_t));
     vm_value_t *array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
     for (int i = 0; i < *length; i++) {
@@ -630,6 +666,34 @@ INSTR(arr_range) {
     AJS_STACK(-1);
 }
 
+/**!
+ * instruction: arr.reserve
+ * category: Arrays
+ * opcode: "0x82"
+ * description: Make room in an array for a number of elements
+ * extra_info: This operation does not change the length or the elements of the array, it only makes sure that storing
+ *             or inserting elements up to the given total does not have to reallocate the array.
+ * stack_pre:
+ *   - type: int
+ *     description: The number of elements to make room for
+ *   - type: array
+ *     description: The array
+ * stack_post:
+ *   - type: array
+ *     description: The same array
+ */
+INSTR(arr_reserve) {
+    USE_STACK();
+    vm_assert(state, (stack - 1)->type == VM_TYPE_ARRAY, "value is not an array");
+    instr_conv_int(state); // ensure top of stack is an integer, aka: the capacity
+
+    if (stack->int_value > 0) {
+        arr_reserve(state, (stack - 1)->pointer_value, (vm_type_t) stack->int_value);
+    }
+
+    AJS_STACK(-1);
+}
+
 void arr_compare(CPU_State *state, Instruction_Implementation compare_instr) {
     USE_STACK();
     vm_assert(state, stack->type == VM_TYPE_ARRAY, "right operand is not an array");
@@ -686,17 +750,7 @@ vm_value_t vm_create_array(CPU_State *state) {
     vm_value_t arrayval;
     arrayval.type = VM_TYPE_ARRAY;
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for length
-    vm_type_t *ref_count      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_type_t *length         = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
-    vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
-
-    *array_ptr = vm_malloc(state->memory, 0);
-
-    *ref_count = 1;
-    *length = 0;
-
-    arrayval.pointer_value = reserved_mem;
+    arrayval.pointer_value = arr_create(state, 0);
 
     return arrayval;
 }
@@ -708,7 +762,7 @@ void vm_array_set_at(CPU_State *state, vm_value_t array, vm_type_t index, vm_val
     vm_value_t *arr = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
     if ((vm_type_signed_t)index > (vm_type_signed_t)*len - 1) {
-        *array_ptr = vm_realloc(state->memory, *array_ptr, (index + 1) * sizeof(vm_value_t));
+        arr_grow(state, reserved_mem, index + 1);
         arr = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
         for (int i = (vm_type_signed_t)*len; i <= index; i++) {
             arr[i] = (vm_value_t) { .type = VM_TYPE_EMPTY };
@@ -730,17 +784,24 @@ void vm_array_resize(CPU_State *state, vm_value_t array, vm_type_t size) {
     vm_type_t *reserved_mem = vm_pointer_to_native(state->memory, array.pointer_value, vm_type_t*);
     vm_type_t *len = reserved_mem + 1;
     vm_pointer_t *array_ptr = reserved_mem + 2;
-    vm_value_t *arr = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
     if (size > *len) {
+        arr_grow(state, reserved_mem, size);
+        vm_value_t *arr = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
         for (int i = (vm_type_signed_t)*len; i < size; i++) {
             arr[i] = (vm_value_t) { .type = VM_TYPE_EMPTY };
         }
+        *len = (vm_type_t) size;
     } else if (size < *len) {
+        vm_value_t *arr = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
         for (int i = size; i < *len; i++) {
             release(state, &arr[i]);
         }
+        *len = (vm_type_t) size;
+        arr_shrink(state, reserved_mem);
     }
-    *array_ptr = vm_realloc(state->memory, *array_ptr, size * sizeof(vm_value_t));
-    *len = (vm_type_t) size;
+}
+
+void vm_array_reserve(CPU_State *state, vm_value_t array, vm_type_t capacity) {
+    arr_reserve(state, array.pointer_value, capacity);
 }
\ No newline at end of file
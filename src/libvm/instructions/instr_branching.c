@@ -5,18 +5,19 @@
 #include "../../../include/funkyvm/funkyvm.h"
 
 #include "instructions.h"
+#include "../fibers.h"
 
 /// Branch Always. Jumps to the destination. Replaces the PC with the destination address.
 INSTR(jmp) {
     // PC_post = PC_pre + M_pre[PC_pre + 1] + 2
-    state->pc = get_current_module(state)->addr + GET_OPERAND();
+    state->pc = GET_OPERAND();
 }
 
 #define CMP_BRANCH(op) { \
     USE_STACK(); \
     AJS_STACK(-1); \
     vm_type_t jmp_addr = GET_OPERAND(); \
-    if (stack->int_value op 0) { state->pc = get_current_module(state)->addr + jmp_addr; } \
+    if (stack->int_value op 0) { state->pc = jmp_addr; } \
 }
 
 INSTR(beq) {
@@ -42,7 +43,7 @@ INSTR(brfalse) {
     USE_STACK();
     vm_type_t jmp_addr = GET_OPERAND();
     if (stack->uint_value == 0)
-        state->pc = get_current_module(state)->addr + jmp_addr;
+        state->pc = jmp_addr;
     AJS_STACK(-1);
 }
 
@@ -50,7 +51,7 @@ INSTR(brtrue) {
     USE_STACK();
     vm_type_t jmp_addr = GET_OPERAND();
     if (stack->uint_value != 0)
-        state->pc = get_current_module(state)->addr + jmp_addr;
+        state->pc = jmp_addr;
     AJS_STACK(-1);
 }
 
@@ -60,7 +61,7 @@ INSTR(call) {
     // M_post[SP_post] = PC_pre + 2
     // PC_post = PC_pre + M_pre[PC_pre + 1] + 2
 
-
+    CHECK_STACK(2);
     AJS_STACK(+2);
     USE_STACK();
     vm_type_t addr = GET_OPERAND();
@@ -68,7 +69,7 @@ INSTR(call) {
     (stack - 1)->uint_value = state->pc;
     (stack - 1)->type = VM_TYPE_REF;
 
-    state->pc = get_current_module(state)->addr + addr;
+    state->pc = addr;
 
     *stack = (vm_value_t) { .type = VM_TYPE_UINT, .uint_value = num_args };
 }
@@ -81,6 +82,7 @@ INSTR(call_pop) {
 
     vm_type_t num_args = GET_OPERAND();
 
+    CHECK_STACK(1);
     AJS_STACK(+1);
     USE_STACK();
     vm_assert(state, (stack - 1)->type == VM_TYPE_REF, "Not a function");
@@ -123,9 +125,15 @@ INSTR(ret) {
     vm_assert(state, stack->type == VM_TYPE_REF, "Junk on the stack, return address is lost");
     state->pc = stack->uint_value;
     AJS_STACK(-1);
+
+    if (state->pc == 0) {
+        // the function a fiber was spawned with, see fiber.spawn
+        fibers_exit(state);
+    }
 }
 
 INSTR(args_accept) {
+    CHECK_STACK(state->operands[0].int_value + 1);
     USE_STACK();
     vm_assert(state, stack->type == VM_TYPE_UINT, "Number of arguments must be an unsigned integer"); // num passed
 
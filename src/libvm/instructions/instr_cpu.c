@@ -160,12 +160,14 @@ INSTR(trap) {
             printf("| name                | type          | value                         |\n");
             printf("|---------------------|---------------|-------------------------------|\n");
             vm_type_t *reserved_mem = vm_pointer_to_native(state->memory, stack->pointer_value, vm_type_t*);
-            vm_pointer_t *first_ptr = reserved_mem + 1;
-            if (*first_ptr > 0) {
-                vm_map_elem_t *item = vm_pointer_to_native(state->memory, *first_ptr, vm_map_elem_t*);
+            vm_pointer_t *table_ptr = reserved_mem + 1;
+            if (*table_ptr > 0) {
+                vm_map_table_t *table = vm_pointer_to_native(state->memory, *table_ptr, vm_map_table_t*);
 
-                while (1) {
-                    char *name = cstr_pointer_from_vm_pointer_t(state, item->name);
+                for (vm_type_t i = 0; i < table->used; i++) {
+                    vm_map_elem_t *item = &MAP_ENTRIES(table)[i];
+                    if (item->name == 0) continue;
+                    char *name = cstr_pointer_from_vm_pointer_t(state, item->name + sizeof(vm_type_t));
                     printf("| %-19.19s | ", name);
                     vm_value_t val = item->value;
                     if (val.type == VM_TYPE_UINT) {
@@ -207,9 +209,6 @@ INSTR(trap) {
                     } else {
                         printf("%-10s | %-#30x|\n", "CURRUPTED!", val.uint_value);
                     }
-
-                    if (item->next == 0) break;
-                    item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
                 }
             }
             printf("+---------------------+---------------+-------------------------------+\n\n");
@@ -261,7 +260,7 @@ INSTR(debug_break) {
 }
 
 INSTR(debug_setcontext) {
-    state->debug_context.filename = vm_pointer_to_native(state->memory, get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t), const char*);
+    state->debug_context.filename = vm_pointer_to_native(state->memory, GET_OPERAND() + sizeof(vm_type_t), const char*);
     state->debug_context.line = GET_OPERAND_SIGNED();
     state->debug_context.col = GET_OPERAND_SIGNED();
 }
@@ -274,7 +273,7 @@ INSTR(debug_enterscope) {
                                                                                    state->debug_context.size_stacktrace);
     }
     state->debug_context.stacktrace[state->debug_context.num_stacktrace - 1] = (struct Stacktrace_Frame) {
-            .name = vm_pointer_to_native(state->memory, get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t), const char*),
+            .name = vm_pointer_to_native(state->memory, GET_OPERAND() + sizeof(vm_type_t), const char*),
             .filename = state->debug_context.filename,
             .col = state->debug_context.col,
             .line = state->debug_context.line
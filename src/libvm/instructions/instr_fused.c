@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../../../include/funkyvm/funkyvm.h"
+
+#include "instructions.h"
+
+/*
+ * Superinstructions. These have no bytecode encoding; fuse_instructions() puts them in the decoded record of the first
+ * instruction of a common sequence when a module is loaded. Only that first record changes, the records of the other
+ * instructions in the sequence are left alone, so code that jumps into the middle of a sequence still runs as before.
+ *
+ * The fused implementations only handle integers. For anything else they run the first instruction of the sequence
+ * (always ld.local) the regular way, and the rest of the sequence follows from its own records.
+ */
+
+#define LOCAL_ARITH_INT(NAME, OP) INSTR(NAME) { \
+    USE_MARK(); \
+    vm_value_t *src = mark + 1 + state->operands[0].int_value; \
+    if (src->type != VM_TYPE_INT) { \
+        instr_ld_local(state); \
+        return; \
+    } \
+    vm_value_t *dst = mark + 1 + state->operands[2].int_value; \
+    vm_type_signed_t result = (vm_type_signed_t) (src->int_value OP state->operands[1].int_value); \
+    release(state, dst); \
+    *dst = (vm_value_t) { .int_value = result, .type = VM_TYPE_INT }; \
+    state->pc += SUPERINSTRUCTION_LENGTH - 1; \
+}
+
+// BRANCH is the condition on the comparison result under which brfalse (== 0) or brtrue (!= 0) takes the branch
+#define BR_LOCAL_LOCAL(NAME, OP, BRANCH) INSTR(NAME) { \
+    USE_MARK(); \
+    vm_value_t *a = mark + 1 + state->operands[0].int_value; \
+    vm_value_t *b = mark + 1 + state->operands[1].int_value; \
+    if (a->type != VM_TYPE_INT || b->type != VM_TYPE_INT) { \
+        instr_ld_local(state); \
+        return; \
+    } \
+    if ((a->int_value OP b->int_value) BRANCH 0) { \
+        state->pc = state->operands[2].uint_value; \
+    } else { \
+        state->pc += SUPERINSTRUCTION_LENGTH - 1; \
+    } \
+}
+
+#define BR_LOCAL_INT(NAME, OP, BRANCH) INSTR(NAME) { \
+    USE_MARK(); \
+    vm_value_t *a = mark + 1 + state->operands[0].int_value; \
+    if (a->type != VM_TYPE_INT) { \
+        instr_ld_local(state); \
+        return; \
+    } \
+    if ((a->int_value OP state->operands[1].int_value) BRANCH 0) { \
+        state->pc = state->operands[2].uint_value; \
+    } else { \
+        state->pc += SUPERINSTRUCTION_LENGTH - 1; \
+    } \
+}
+
+LOCAL_ARITH_INT(fused_local_add_int, +)
+LOCAL_ARITH_INT(fused_local_sub_int, -)
+
+BR_LOCAL_LOCAL(fused_ll_eq_brfalse, ==, ==)
+BR_LOCAL_LOCAL(fused_ll_eq_brtrue,  ==, !=)
+BR_LOCAL_LOCAL(fused_ll_ne_brfalse, !=, ==)
+BR_LOCAL_LOCAL(fused_ll_ne_brtrue,  !=, !=)
+BR_LOCAL_LOCAL(fused_ll_lt_brfalse, <,  ==)
+BR_LOCAL_LOCAL(fused_ll_lt_brtrue,  <,  !=)
+BR_LOCAL_LOCAL(fused_ll_gt_brfalse, >,  ==)
+BR_LOCAL_LOCAL(fused_ll_gt_brtrue,  >,  !=)
+BR_LOCAL_LOCAL(fused_ll_le_brfalse, <=, ==)
+BR_LOCAL_LOCAL(fused_ll_le_brtrue,  <=, !=)
+BR_LOCAL_LOCAL(fused_ll_ge_brfalse, >=, ==)
+BR_LOCAL_LOCAL(fused_ll_ge_brtrue,  >=, !=)
+
+BR_LOCAL_INT(fused_li_eq_brfalse, ==, ==)
+BR_LOCAL_INT(fused_li_eq_brtrue,  ==, !=)
+BR_LOCAL_INT(fused_li_ne_brfalse, !=, ==)
+BR_LOCAL_INT(fused_li_ne_brtrue,  !=, !=)
+BR_LOCAL_INT(fused_li_lt_brfalse, <,  ==)
+BR_LOCAL_INT(fused_li_lt_brtrue,  <,  !=)
+BR_LOCAL_INT(fused_li_gt_brfalse, >,  ==)
+BR_LOCAL_INT(fused_li_gt_brtrue,  >,  !=)
+BR_LOCAL_INT(fused_li_le_brfalse, <=, ==)
+BR_LOCAL_INT(fused_li_le_brtrue,  <=, !=)
+BR_LOCAL_INT(fused_li_ge_brfalse, >=, ==)
+BR_LOCAL_INT(fused_li_ge_brtrue,  >=, !=)
+
+Instruction_Implementation superinstruction_implementations[VM_NUM_SUPERINSTRUCTIONS] = {
+        &instr_fused_local_add_int,
+        &instr_fused_local_sub_int,
+
+        &instr_fused_ll_eq_brfalse, &instr_fused_ll_eq_brtrue,
+        &instr_fused_ll_ne_brfalse, &instr_fused_ll_ne_brtrue,
+        &instr_fused_ll_lt_brfalse, &instr_fused_ll_lt_brtrue,
+        &instr_fused_ll_gt_brfalse, &instr_fused_ll_gt_brtrue,
+        &instr_fused_ll_le_brfalse, &instr_fused_ll_le_brtrue,
+        &instr_fused_ll_ge_brfalse, &instr_fused_ll_ge_brtrue,
+
+        &instr_fused_li_eq_brfalse, &instr_fused_li_eq_brtrue,
+        &instr_fused_li_ne_brfalse, &instr_fused_li_ne_brtrue,
+        &instr_fused_li_lt_brfalse, &instr_fused_li_lt_brtrue,
+        &instr_fused_li_gt_brfalse, &instr_fused_li_gt_brtrue,
+        &instr_fused_li_le_brfalse, &instr_fused_li_le_brtrue,
+        &instr_fused_li_ge_brfalse, &instr_fused_li_ge_brtrue,
+};
+
+#define BR_NAMES(SECOND) \
+        "ld.local, " SECOND ", eq, brfalse", "ld.local, " SECOND ", eq, brtrue", \
+        "ld.local, " SECOND ", ne, brfalse", "ld.local, " SECOND ", ne, brtrue", \
+        "ld.local, " SECOND ", lt, brfalse", "ld.local, " SECOND ", lt, brtrue", \
+        "ld.local, " SECOND ", gt, brfalse", "ld.local, " SECOND ", gt, brtrue", \
+        "ld.local, " SECOND ", le, brfalse", "ld.local, " SECOND ", le, brtrue", \
+        "ld.local, " SECOND ", ge, brfalse", "ld.local, " SECOND ", ge, brtrue"
+
+const char *superinstruction_names[VM_NUM_SUPERINSTRUCTIONS] = {
+        "ld.local, ld.int, add, st.local",
+        "ld.local, ld.int, sub, st.local",
+        BR_NAMES("ld.local"),
+        BR_NAMES("ld.int"),
+};
+
+#define OP_LD_INT   0x10
+#define OP_LD_LOCAL 0x15
+#define OP_ST_LOCAL 0x1E
+#define OP_ADD      0x30
+#define OP_SUB      0x31
+#define OP_EQ       0x3B
+#define OP_GE       0x40
+#define OP_BRFALSE  0x57
+#define OP_BRTRUE   0x58
+
+/*
+ * Returns the superinstruction that the four instructions starting at seq form, or 0 if they do not form one.
+ */
+static unsigned short match_superinstruction(vm_instruction_t *seq[4]) {
+    if (seq[0]->opcode != OP_LD_LOCAL) {
+        return 0;
+    }
+
+    if (seq[1]->opcode == OP_LD_INT && seq[3]->opcode == OP_ST_LOCAL) {
+        if (seq[2]->opcode == OP_ADD) return VM_OPCODE_LOCAL_ADD_INT;
+        if (seq[2]->opcode == OP_SUB) return VM_OPCODE_LOCAL_SUB_INT;
+        return 0;
+    }
+
+    if ((seq[1]->opcode == OP_LD_LOCAL || seq[1]->opcode == OP_LD_INT)
+        && seq[2]->opcode >= OP_EQ && seq[2]->opcode <= OP_GE
+        && (seq[3]->opcode == OP_BRFALSE || seq[3]->opcode == OP_BRTRUE)) {
+        unsigned short base = seq[1]->opcode == OP_LD_LOCAL ? VM_OPCODE_BR_LOCAL_LOCAL : VM_OPCODE_BR_LOCAL_INT;
+        return (unsigned short) (base + (seq[2]->opcode - OP_EQ) * 2 + (seq[3]->opcode - OP_BRFALSE));
+    }
+
+    return 0;
+}
+
+/*
+ * Peephole pass over the decoded code of a module. Walks the instructions the decoder reached and replaces the first
+ * record of every matching sequence by a superinstruction, counting how often each one was formed.
+ */
+void fuse_instructions(Module *module) {
+    module->fusions = calloc(VM_NUM_SUPERINSTRUCTIONS, sizeof(vm_type_t));
+
+    // the records of the sweep are in the order of the code, so a sequence of instructions is a run of records
+    vm_type_t i = 1;
+    while (i + 3 < module->num_instructions) {
+        vm_instruction_t *seq[4];
+        for (int j = 0; j < 4; j++) {
+            seq[j] = &module->code[i + j];
+        }
+
+        unsigned short opcode = match_superinstruction(seq);
+        if (opcode == 0) {
+            i++;
+            continue;
+        }
+
+        // operands: local, second local or constant, destination local or branch target
+        vm_instruction_t *head = seq[0];
+        head->operands[1] = seq[1]->operands[0];
+        head->operands[2] = seq[3]->operands[0];
+        head->opcode = opcode;
+        head->impl = superinstruction_implementations[opcode - VM_FIRST_SUPERINSTRUCTION];
+        head->length = SUPERINSTRUCTION_LENGTH;
+
+        module->fusions[opcode - VM_FIRST_SUPERINSTRUCTION]++;
+        i += 4;
+    }
+}
@@ -4,55 +4,207 @@
 #include "instructions.h"
 #include "../../../include/funkyvm/funkyvm.h"
 #include "../error_handling.h"
+#include "../atoms.h"
+
+#define MAP_MIN_CAPACITY 4
+#define MAP_SCAN_CAPACITY 8 // maps up to this many entries have no index
+
+/*
+ * FNV-1a, never 0 so a string header can use 0 for a hash that has not been computed yet
+ */
+vm_type_t map_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash == 0 ? 1 : (vm_type_t) hash;
+}
 
-INSTR(ld_map) {
-    USE_STACK();
+vm_pointer_t map_create(CPU_State *state, vm_type_t ref_count, vm_pointer_t prototype) {
+    vm_pointer_t reserved_mem     = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // refcount, table, prototype
+    vm_type_t *ref_count_ptr      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
+    vm_pointer_t *table_ptr       = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 1;
+    vm_pointer_t *prototype_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
 
-    vm_value_t mapval;
-    mapval.type = VM_TYPE_MAP;
+    *ref_count_ptr = ref_count;
+    *table_ptr = 0;
+    *prototype_ptr = prototype;
 
-    vm_pointer_t reserved_mem     = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for first item
-    vm_type_t *ref_count          = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_pointer_t *first_ptr       = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 1;
-    vm_pointer_t *prototype_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
+    return reserved_mem;
+}
 
-    *ref_count = 1;
-    *first_ptr = 0;
-    *prototype_ptr = 0;
+static void map_index_insert(vm_map_table_t *table, vm_type_t hash, vm_type_t position) {
+    vm_type_t *index = MAP_INDEX(table);
+    vm_type_t mask = table->index_size - 1;
+    vm_type_t slot = hash & mask;
+    while (index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    index[slot] = position + 1;
+}
 
-    mapval.pointer_value = reserved_mem;
+/*
+ * Takes the slot of the entry at `position` out of the index, moving later slots of the same probe sequence back so
+ * that lookups still find them.
+ */
+static void map_index_remove(vm_map_table_t *table, vm_type_t hash, vm_type_t position) {
+    vm_type_t *index = MAP_INDEX(table);
+    vm_map_elem_t *entries = MAP_ENTRIES(table);
+    vm_type_t mask = table->index_size - 1;
+    vm_type_t slot = hash & mask;
+    while (index[slot] != position + 1) {
+        slot = (slot + 1) & mask;
+    }
 
-    *(stack + 1) = mapval;
+    for (vm_type_t next = (slot + 1) & mask; index[next] != 0; next = (next + 1) & mask) {
+        vm_type_t home = entries[index[next] - 1].hash & mask;
+        // a slot can move back unless its home lies between the hole and itself
+        int stays = slot <= next ? (slot < home && home <= next) : (slot < home || home <= next);
+        if (!stays) {
+            index[slot] = index[next];
+            slot = next;
+        }
+    }
+    index[slot] = 0;
+}
 
-    AJS_STACK(+1);
+static void map_reindex(vm_map_table_t *table) {
+    if (table->index_size == 0) return;
+
+    memset(MAP_INDEX(table), 0, table->index_size * sizeof(vm_type_t));
+    vm_map_elem_t *entries = MAP_ENTRIES(table);
+    for (vm_type_t i = 0; i < table->used; i++) {
+        if (entries[i].name != 0) {
+            map_index_insert(table, entries[i].hash, i);
+        }
+    }
 }
 
-vm_map_elem_t* ld_mapitem(CPU_State *state, vm_pointer_t map_ptr, const char* name) {
-    vm_pointer_t *first_ptr = vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 1;
-    vm_pointer_t *prototype_ptr = vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 2;
-
-    if (*first_ptr == 0) {
-        if (*prototype_ptr == 0) {
-            return NULL;
-        } else {
-            return ld_mapitem(state, *prototype_ptr, name);
+/*
+ * Moves the live entries of a map into a new table that has room for at least `capacity` entries, dropping deleted
+ * entries and rebuilding the index. The order of the entries is kept.
+ */
+void map_reserve(CPU_State *state, vm_pointer_t map_ptr, vm_type_t capacity) {
+    vm_pointer_t *table_ptr = vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 1;
+    vm_map_table_t *old_table = map_table(state, map_ptr);
+
+    if (old_table != NULL) {
+        if (capacity < old_table->count) capacity = old_table->count;
+        if (old_table->capacity - old_table->used >= capacity - old_table->count) return;
+    }
+
+    vm_type_t new_capacity = MAP_MIN_CAPACITY;
+    while (new_capacity < capacity) new_capacity *= 2;
+    vm_type_t index_size = new_capacity > MAP_SCAN_CAPACITY ? new_capacity * 2 : 0;
+
+    vm_pointer_t new_table_ptr = vm_malloc(state->memory, sizeof(vm_map_table_t)
+                                                          + new_capacity * sizeof(vm_map_elem_t)
+                                                          + index_size * sizeof(vm_type_t));
+    vm_map_table_t *table = vm_pointer_to_native(state->memory, new_table_ptr, vm_map_table_t*);
+    table->count = 0;
+    table->used = 0;
+    table->capacity = new_capacity;
+    table->index_size = index_size;
+    table->shape = old_table == NULL ? VM_MAP_SHAPE_EMPTY : old_table->shape;
+
+    if (old_table != NULL) {
+        vm_map_elem_t *old_entries = MAP_ENTRIES(old_table);
+        vm_map_elem_t *entries = MAP_ENTRIES(table);
+        for (vm_type_t i = 0; i < old_table->used; i++) {
+            if (old_entries[i].name != 0) {
+                entries[table->used++] = old_entries[i];
+            }
         }
-    } else {
-        vm_map_elem_t *item = vm_pointer_to_native(state->memory, *first_ptr, vm_map_elem_t*);
-        while (1) {
-            if (strcmp(name, vm_pointer_to_native(state->memory, item->name, char*)) == 0) {
-                return item;
+        table->count = table->used;
+        vm_free(state->memory, *table_ptr);
+    }
+
+    map_reindex(table);
+    *table_ptr = new_table_ptr;
+}
+
+/*
+ * Returns the atom for the string at str_ptr (a string value or constant) along with its hash, or 0 if there is no
+ * atom with that name, in which case no map has an item with that name either.
+ */
+vm_pointer_t map_key(CPU_State *state, vm_pointer_t str_ptr, vm_type_t *hash) {
+    if (is_atom(state, str_ptr)) {
+        *hash = atom_hash(state, str_ptr);
+        return str_ptr;
+    }
+    *hash = str_hash(state, str_ptr);
+    return atom_find(state, cstr_pointer_from_vm_pointer_t(state, str_ptr + sizeof(vm_type_t)), *hash);
+}
+
+vm_pointer_t map_key_intern(CPU_State *state, vm_pointer_t str_ptr, vm_type_t *hash) {
+    if (is_atom(state, str_ptr)) {
+        *hash = atom_hash(state, str_ptr);
+        return str_ptr;
+    }
+    *hash = str_hash(state, str_ptr);
+    return atom_intern(state, cstr_pointer_from_vm_pointer_t(state, str_ptr + sizeof(vm_type_t)), *hash);
+}
+
+/*
+ * Finds an entry in the map itself, not looking at its prototypes. Keys are atoms, so they are compared by address.
+ */
+vm_map_elem_t* map_find(CPU_State *state, vm_map_table_t *table, vm_pointer_t key, vm_type_t hash) {
+    vm_map_elem_t *entries = MAP_ENTRIES(table);
+
+    if (table->index_size == 0) {
+        for (vm_type_t i = 0; i < table->used; i++) {
+            if (entries[i].name == key) {
+                return &entries[i];
             }
-            if (item->next == 0) break;
-            item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
         }
+        return NULL;
+    }
 
-        if (*prototype_ptr == 0) {
-            return NULL;
-        } else {
-            return ld_mapitem(state, *prototype_ptr, name);
+    vm_type_t *index = MAP_INDEX(table);
+    vm_type_t mask = table->index_size - 1;
+    for (vm_type_t slot = hash & mask; index[slot] != 0; slot = (slot + 1) & mask) {
+        // deleted entries keep their slot, so probing continues past them
+        if (entries[index[slot] - 1].name == key) {
+            return &entries[index[slot] - 1];
         }
     }
+    return NULL;
+}
+
+/*
+ * Finds an item in a map or its prototypes.
+ */
+vm_map_elem_t* map_lookup(CPU_State *state, vm_pointer_t map_ptr, vm_pointer_t key, vm_type_t hash) {
+    if (key == 0) return NULL;
+
+    while (map_ptr != 0) {
+        vm_map_table_t *table = map_table(state, map_ptr);
+        if (table != NULL) {
+            vm_map_elem_t *elem = map_find(state, table, key, hash);
+            if (elem != NULL) return elem;
+        }
+        map_ptr = *(vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 2);
+    }
+
+    return NULL;
+}
+
+INSTR(ld_map) {
+    USE_STACK();
+
+    vm_value_t mapval;
+    mapval.type = VM_TYPE_MAP;
+    mapval.pointer_value = map_create(state, 1, 0);
+
+    *(stack + 1) = mapval;
+
+    AJS_STACK(+1);
+}
+
+vm_map_elem_t* ld_mapitem(CPU_State *state, vm_pointer_t map_ptr, const char* name) {
+    vm_type_t hash = map_hash(name);
+    return map_lookup(state, map_ptr, atom_find(state, name, hash), hash);
 }
 
 
@@ -61,11 +213,11 @@ INSTR(ld_mapitem) {
     if (stack->type != VM_TYPE_MAP) {
         instr_box(state);
     }
-    vm_pointer_t name_ptr = get_current_module(state)->addr + GET_OPERAND();
-    const char *name = cstr_pointer_from_vm_pointer_t(state, name_ptr) + sizeof(vm_type_t);
+    vm_type_t hash;
+    vm_pointer_t key = map_key(state, GET_OPERAND(), &hash);
     vm_value_t val;
 
-    vm_map_elem_t *elem = ld_mapitem(state, stack->pointer_value, name);
+    vm_map_elem_t *elem = map_lookup(state, stack->pointer_value, key, hash);
     if (elem == NULL) {
         val.type = VM_TYPE_EMPTY;
         val.int_value = 0;
@@ -82,11 +234,12 @@ INSTR(ld_mapitem_pop) {
     USE_STACK();
     vm_assert(state, (stack - 1)->type == VM_TYPE_MAP, "value is not a map type");
     vm_assert(state, stack->type == VM_TYPE_STRING, "map reference is not of string type");
-    const char *name = cstr_pointer_from_vm_value(state, stack);
+    vm_type_t hash;
+    vm_pointer_t key = map_key(state, stack->pointer_value, &hash);
 
     vm_value_t val;
 
-    vm_map_elem_t *elem = ld_mapitem(state, (stack - 1)->pointer_value, name);
+    vm_map_elem_t *elem = map_lookup(state, (stack - 1)->pointer_value, key, hash);
     if (elem == NULL) {
         val.type = VM_TYPE_EMPTY;
     } else {
@@ -100,58 +253,71 @@ INSTR(ld_mapitem_pop) {
     AJS_STACK(-1);
 }
 
-void st_mapitem(CPU_State *state, vm_pointer_t map_ptr, const char* name, vm_value_t* value) {
-    vm_pointer_t *first_ptr = vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 1;
-
-    // first item
-    if (*first_ptr == 0) {
-        vm_pointer_t name_ptr = vm_malloc(state->memory, strlen(name) + 1);
-        strcpy(vm_pointer_to_native(state->memory, name_ptr, char*), name);
-        vm_pointer_t mem = vm_malloc(state->memory, sizeof(vm_map_elem_t));
-        vm_map_elem_t *elem = vm_pointer_to_native(state->memory, mem, vm_map_elem_t*);
-        elem->name = name_ptr;
-        elem->value = *value;
-
-        elem->next = 0;
-        elem->prev = 0;
-        *first_ptr = mem;
-        return;
+/*
+ * Adds an item to a table that has room for it.
+ */
+void map_append(CPU_State *state, vm_map_table_t *table, vm_pointer_t key, vm_type_t hash, vm_value_t* value,
+                vm_type_t shape) {
+    retain_pointer(state, VM_TYPE_STRING, key);
+
+    vm_type_t position = table->used++;
+    vm_map_elem_t *elem = &MAP_ENTRIES(table)[position];
+    elem->name = key;
+    elem->hash = hash;
+    elem->value = *value;
+    table->count++;
+    table->shape = shape;
+
+    if (table->index_size != 0) {
+        map_index_insert(table, hash, position);
     }
+}
+
+void map_store(CPU_State *state, vm_pointer_t map_ptr, vm_pointer_t key, vm_type_t hash, vm_value_t* value) {
+    vm_map_table_t *table = map_table(state, map_ptr);
 
     // existing item
-    vm_map_elem_t *item = vm_pointer_to_native(state->memory, *first_ptr, vm_map_elem_t*);
-    while (1) {
-        if (strcmp(name, vm_pointer_to_native(state->memory, item->name, char*)) == 0) {
+    if (table != NULL) {
+        vm_map_elem_t *item = map_find(state, table, key, hash);
+        if (item != NULL) {
             vm_value_t oldval = item->value;
             item->value = *value;
             release(state, &oldval);
             return;
         }
-        if (item->next == 0) break;
-        item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
     }
 
     // If we're here, this is a new item
-    vm_pointer_t name_ptr = vm_malloc(state->memory, strlen(name) + 1);
-    strcpy(vm_pointer_to_native(state->memory, name_ptr, char*), name);
-    vm_pointer_t mem = vm_malloc(state->memory, sizeof(vm_map_elem_t));
-    vm_map_elem_t *elem = vm_pointer_to_native(state->memory, mem, vm_map_elem_t*);
-    elem->name = name_ptr;
-    elem->value = *value;
+    if (table == NULL || table->used == table->capacity) {
+        map_reserve(state, map_ptr, table == NULL ? MAP_MIN_CAPACITY : (table->count + 1) * 2);
+        table = map_table(state, map_ptr);
+    }
+
+#if defined(VM_INLINE_CACHES) && VM_INLINE_CACHES
+    vm_type_t shape = map_shape_transition(state, table->shape, key, hash);
+#else
+    vm_type_t shape = VM_MAP_SHAPE_NONE;
+#endif
+    map_append(state, table, key, hash, value, shape);
+}
 
-    elem->next = *first_ptr;
-    elem->prev = 0;
-    vm_map_elem_t *next_elem = vm_pointer_to_native(state->memory, *first_ptr, vm_map_elem_t*);
-    next_elem->prev = mem;
-    *first_ptr = mem;
+/*
+ * Stores an item under a name the VM itself chose, such as the value of a boxed type or the exports of a module. These
+ * names are pinned.
+ */
+void st_mapitem(CPU_State *state, vm_pointer_t map_ptr, const char* name, vm_value_t* value) {
+    vm_type_t hash = map_hash(name);
+    vm_pointer_t key = atom_intern(state, name, hash);
+    atom_pin(state, key);
+    map_store(state, map_ptr, key, hash, value);
 }
 
 INSTR(st_mapitem) {
     USE_STACK();
     vm_assert(state, (stack)->type == VM_TYPE_MAP, "value is not a map type");
-    vm_pointer_t name_ptr = get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
-    const char *name = cstr_pointer_from_vm_pointer_t(state, name_ptr);
-    st_mapitem(state, stack->pointer_value, name, stack - 1);
+    vm_type_t hash;
+    vm_pointer_t key = map_key_intern(state, GET_OPERAND(), &hash);
+    map_store(state, stack->pointer_value, key, hash, stack - 1);
     release(state, stack); // release the map
     // no release/retain for value, as it is reduced by one because of stack pop, but added by one because of array storage
     AJS_STACK(-2);
@@ -162,57 +328,54 @@ INSTR(st_mapitem_pop) {
     vm_assert(state, (stack - 1)->type == VM_TYPE_MAP, "value is not a map type");
     vm_assert(state, (stack)->type == VM_TYPE_STRING, "map reference is not of string type");
 
-    const char *name = cstr_pointer_from_vm_value(state, stack);
+    vm_type_t hash;
+    vm_pointer_t key = map_key_intern(state, stack->pointer_value, &hash);
 
-    st_mapitem(state, (stack - 1)->pointer_value, name, stack - 2);
+    map_store(state, (stack - 1)->pointer_value, key, hash, stack - 2);
     release(state, stack - 1); // release the map
     release(state, stack); // release the name
     // no release/retain for value, as it is reduced by one because of stack pop, but added by one because of array storage
     AJS_STACK(-3);
 }
 
-void del_mapitem(CPU_State *state, vm_pointer_t map_ptr, const char* name) {
-    vm_pointer_t *first_ptr = vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 1;
+/*
+ * The entry stays in place as a tombstone until the table is rebuilt.
+ */
+static void map_remove(CPU_State *state, vm_map_table_t *table, vm_map_elem_t *item) {
+    vm_value_t oldval = item->value;
+    vm_pointer_t key = item->name;
+    item->name = 0;
+    item->value = (vm_value_t) { .type = VM_TYPE_EMPTY };
+    table->count--;
+    table->shape = VM_MAP_SHAPE_NONE;
+    release(state, &oldval);
+    release_pointer(state, VM_TYPE_STRING, key);
+}
+
+void del_mapitem(CPU_State *state, vm_pointer_t map_ptr, vm_pointer_t str_ptr) {
+    vm_map_table_t *table = map_table(state, map_ptr);
 
-    if (*first_ptr == 0) {
+    if (table == NULL || table->count == 0) {
         vm_error(state, "map is empty");
         vm_exit(state, EXIT_FAILURE);
     }
 
-    vm_map_elem_t *item = vm_pointer_to_native(state->memory, *first_ptr, vm_map_elem_t*);
-    while (1) {
-        if (strcmp(name, vm_pointer_to_native(state->memory, item->name, char*)) == 0) {
-            if (item->prev) {
-                vm_map_elem_t *prev = vm_pointer_to_native(state->memory, item->prev, vm_map_elem_t*);
-                prev->next = item->next;
-            }
-            if (item->next) {
-                vm_map_elem_t *next = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
-                next->prev = item->prev;
-            }
-            if (*first_ptr == native_to_vm_pointer(state->memory, item)) {
-                *first_ptr = item->next;
-            }
-            release(state, &item->value);
-            vm_free(state->memory, item->name);
-            k_free(state->memory, item); // use k_free because we only have a native pointer at this moment
-            return;
-        }
-        if (item->next == 0) break;
-        item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
+    vm_type_t hash;
+    vm_pointer_t key = map_key(state, str_ptr, &hash);
+    vm_map_elem_t *item = key == 0 ? NULL : map_find(state, table, key, hash);
+    if (item == NULL) {
+        vm_error(state, "map does not contain element with key '%s'",
+                 cstr_pointer_from_vm_pointer_t(state, str_ptr + sizeof(vm_type_t)));
+        vm_exit(state, EXIT_FAILURE);
     }
 
-    // If we're here, this is a new item
-    vm_error(state, "map does not contain element with key '%s'", name);
-    vm_exit(state, EXIT_FAILURE);
+    map_remove(state, table, item);
 }
 
 INSTR(del_mapitem) {
     USE_STACK();
     vm_assert(state, (stack)->type == VM_TYPE_MAP, "value is not a map type");
-    vm_pointer_t name_ptr = get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
-    const char *name = cstr_pointer_from_vm_pointer_t(state, name_ptr);
-    del_mapitem(state, stack->pointer_value, name);
+    del_mapitem(state, stack->pointer_value, GET_OPERAND());
     release(state, stack); // release the map
     AJS_STACK(-1);
 }
@@ -221,40 +384,28 @@ INSTR(del_mapitem_pop) {
     USE_STACK();
     vm_assert(state, (stack - 1)->type == VM_TYPE_MAP, "value is not a map type");
     vm_assert(state, (stack)->type == VM_TYPE_STRING, "map reference is not of string type");
-    const char *name = cstr_pointer_from_vm_value(state, stack);
-    del_mapitem(state, (stack - 1)->pointer_value, name);
+    del_mapitem(state, (stack - 1)->pointer_value, stack->pointer_value);
     release(state, stack - 1); // release the map
     release(state, stack); // release the name
     // no release/retain for value, as it is reduced by one because of stack pop, but added by one because of array storage
     AJS_STACK(-2);
 }
 
-vm_type_t map_contains_key(CPU_State *state, vm_pointer_t map_ptr, const char* name) {
-    vm_pointer_t *item_ptr = vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 1;
+vm_type_t map_contains_key(CPU_State *state, vm_pointer_t map_ptr, vm_pointer_t str_ptr) {
+    vm_map_table_t *table = map_table(state, map_ptr);
 
-    if (*item_ptr == 0) return 0;
+    if (table == NULL) return 0;
 
-    vm_map_elem_t *item = vm_pointer_to_native(state->memory, *item_ptr, vm_map_elem_t*);
-
-    while (item != 0) {
-        if (strcmp(name, vm_pointer_to_native(state->memory, item->name, const char*)) == 0) {
-            return 1;
-        }
-        if (item->next == 0) break;
-        item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
-    }
-
-    return 0;
+    vm_type_t hash;
+    vm_pointer_t key = map_key(state, str_ptr, &hash);
+    return key != 0 && map_find(state, table, key, hash) != NULL;
 }
 
 INSTR(has_mapitem) {
     USE_STACK();
     vm_assert(state, (stack)->type == VM_TYPE_MAP, "value is not a map type");
 
-    vm_pointer_t name_ptr = get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
-    const char *name = cstr_pointer_from_vm_pointer_t(state, name_ptr);
-
-    vm_type_t contains = map_contains_key(state, stack->pointer_value, name);
+    vm_type_t contains = map_contains_key(state, stack->pointer_value, GET_OPERAND());
     release(state, stack); // release the map
 
     stack->type = VM_TYPE_UINT;
@@ -265,9 +416,8 @@ INSTR(has_mapitem_pop) {
     USE_STACK();
     vm_assert(state, (stack - 1)->type == VM_TYPE_MAP, "value is not a map type");
     vm_assert(state, (stack)->type == VM_TYPE_STRING, "map reference is not of string type");
-    const char *name = cstr_pointer_from_vm_value(state, stack);
 
-    vm_type_t contains = map_contains_key(state, (stack - 1)->pointer_value, name);
+    vm_type_t contains = map_contains_key(state, (stack - 1)->pointer_value, stack->pointer_value);
     release(state, stack); // release the string
     release(state, stack - 1); // release the map
 
@@ -276,6 +426,25 @@ INSTR(has_mapitem_pop) {
     AJS_STACK(-1);
 }
 
+/*
+ * Stores all items of the map at src_ptr into the map at dst_ptr, retaining their values.
+ */
+static void map_store_all(CPU_State *state, vm_pointer_t dst_ptr, vm_pointer_t src_ptr) {
+    vm_map_table_t *table = map_table(state, src_ptr);
+    if (table == NULL) return;
+
+    vm_map_table_t *dst_table = map_table(state, dst_ptr);
+    map_reserve(state, dst_ptr, (dst_table == NULL ? 0 : dst_table->count) + table->count);
+
+    // map_store never moves the source table, the destination is always a different map
+    vm_map_elem_t *entries = MAP_ENTRIES(table);
+    for (vm_type_t i = 0; i < table->used; i++) {
+        if (entries[i].name == 0) continue;
+        retain(state, &entries[i].value);
+        map_store(state, dst_ptr, entries[i].name, entries[i].hash, &entries[i].value);
+    }
+}
+
 INSTR(map_copy) {
     USE_STACK();
     vm_assert(state, stack->type == VM_TYPE_MAP, "value is not a map type");
@@ -283,32 +452,10 @@ INSTR(map_copy) {
     vm_value_t mapval;
     mapval.type = VM_TYPE_MAP;
 
-    vm_pointer_t reserved_mem     = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for first item
-    vm_type_t *ref_count          = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_pointer_t *first_ptr       = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 1;
-    vm_pointer_t *prototype_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
-
-    *ref_count = 1;
-    *first_ptr = 0;
-
-    mapval.pointer_value = reserved_mem;
-
-    *prototype_ptr = *(vm_pointer_to_native(state->memory, stack->pointer_value, vm_pointer_t*) + 2);
+    vm_pointer_t prototype = *(vm_pointer_to_native(state->memory, stack->pointer_value, vm_pointer_t*) + 2);
+    mapval.pointer_value = map_create(state, 1, prototype);
 
-    vm_pointer_t *item_ptr = vm_pointer_to_native(state->memory, stack->pointer_value, vm_pointer_t*) + 1;
-
-    if (*item_ptr != 0) {
-        vm_map_elem_t *item = vm_pointer_to_native(state->memory, *item_ptr, vm_map_elem_t*);
-
-        while (1) {
-            const char *name = cstr_pointer_from_vm_pointer_t(state, item->name);
-            st_mapitem(state, reserved_mem, name, &item->value);
-            // TODO: this might leak if both map 1 and 2 contains the same key
-            retain(state, &item->value);
-            if (item->next == 0) break;
-            item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
-        }
-    }
+    map_store_all(state, mapval.pointer_value, stack->pointer_value);
 
     release(state, stack); // release original map
 
@@ -319,19 +466,8 @@ INSTR(map_len) {
     USE_STACK();
     vm_assert(state, stack->type == VM_TYPE_MAP, "value is not a map type");
 
-    vm_pointer_t *item_ptr = vm_pointer_to_native(state->memory, stack->pointer_value, vm_pointer_t*) + 1;
-    vm_type_t len = 0;
-
-    if (*item_ptr != 0) {
-        vm_map_elem_t *item = vm_pointer_to_native(state->memory, *item_ptr, vm_map_elem_t*);
-
-        while (1) {
-            len++;
-
-            if (item->next == 0) break;
-            item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
-        }
-    }
+    vm_map_table_t *table = map_table(state, stack->pointer_value);
+    vm_type_t len = table == NULL ? 0 : table->count;
 
     release(state, stack); // release original map
 
@@ -345,43 +481,10 @@ INSTR(map_merge) {
 
     vm_value_t mapval;
     mapval.type = VM_TYPE_MAP;
+    mapval.pointer_value = map_create(state, 1, 0);
 
-    vm_pointer_t reserved_mem   = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for first item
-    vm_type_t *ref_count        = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_pointer_t *first_ptr     = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 1;
-    vm_pointer_t *prototype_ptr = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
-
-    *ref_count = 1;
-    *first_ptr = 0;
-    *prototype_ptr = 0;
-
-    mapval.pointer_value = reserved_mem;
-
-    vm_pointer_t *item_ptr = vm_pointer_to_native(state->memory, (stack - 1)->pointer_value, vm_pointer_t*) + 1;
-    if (*item_ptr != 0) {
-        vm_map_elem_t *item = vm_pointer_to_native(state->memory, *item_ptr, vm_map_elem_t*);
-
-        while (1) {
-            const char *name = cstr_pointer_from_vm_pointer_t(state, item->name);
-            st_mapitem(state, reserved_mem, name, &item->value);
-            retain(state, &item->value);
-            if (item->next == 0) break;
-            item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
-        }
-    }
-
-    item_ptr = vm_pointer_to_native(state->memory, stack->pointer_value, vm_pointer_t*) + 1;
-    if (*item_ptr != 0) {
-        vm_map_elem_t *item = vm_pointer_to_native(state->memory, *item_ptr, vm_map_elem_t*);
-
-        while (1) {
-            const char *name = cstr_pointer_from_vm_pointer_t(state, item->name);
-            st_mapitem(state, reserved_mem, name, &item->value);
-            retain(state, &item->value);
-            if (item->next == 0) break;
-            item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
-        }
-    }
+    map_store_all(state, mapval.pointer_value, (stack - 1)->pointer_value);
+    map_store_all(state, mapval.pointer_value, stack->pointer_value);
 
     release(state, stack - 1); // release original map
     release(state, stack); // release original map
@@ -392,17 +495,19 @@ INSTR(map_merge) {
 
 void map_release(CPU_State* state, vm_pointer_t ptr) {
     vm_type_t *reserved_mem = vm_pointer_to_native(state->memory, ptr, vm_type_t*);
-    vm_pointer_t *first_ptr = reserved_mem + 1;
+    vm_pointer_t *table_ptr = reserved_mem + 1;
     vm_pointer_t *prototype_ptr = reserved_mem + 2;
-    vm_map_elem_t *elem = vm_pointer_to_native(state->memory, *first_ptr, vm_map_elem_t*);
-
-    while (*first_ptr != 0) {
-        vm_free(state->memory, elem->name);
-        release(state, &elem->value);
-        vm_pointer_t next = elem->next;
-        k_free(state->memory, elem);
-        if (next == 0) break;
-        elem = vm_pointer_to_native(state->memory, next, vm_map_elem_t*);
+    vm_map_table_t *table = map_table(state, ptr);
+
+    if (table != NULL) {
+        vm_map_elem_t *entries = MAP_ENTRIES(table);
+        for (vm_type_t i = 0; i < table->used; i++) {
+            if (entries[i].name == 0) continue;
+            release(state, &entries[i].value);
+            release_pointer(state, VM_TYPE_STRING, entries[i].name);
+        }
+        vm_free(state->memory, *table_ptr);
+        *table_ptr = 0;
     }
 
     if (*prototype_ptr != 0) {
@@ -445,38 +550,46 @@ INSTR(map_getprototype) {
     }
 }
 
-vm_type_t map_rename_key(CPU_State *state, vm_pointer_t map_ptr, const char* old_name, const char* new_name) {
-    vm_pointer_t *item_ptr = vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 1;
+vm_type_t map_rename_key(CPU_State *state, vm_pointer_t map_ptr, vm_pointer_t old_str_ptr, vm_pointer_t new_str_ptr) {
+    vm_map_table_t *table = map_table(state, map_ptr);
 
-    if (*item_ptr == 0) return 0;
+    if (table == NULL) return 0;
 
-    vm_map_elem_t *item = vm_pointer_to_native(state->memory, *item_ptr, vm_map_elem_t*);
+    vm_type_t old_hash;
+    vm_pointer_t old_key = map_key(state, old_str_ptr, &old_hash);
+    vm_map_elem_t *item = old_key == 0 ? NULL : map_find(state, table, old_key, old_hash);
+    if (item == NULL) return 0;
 
-    while (item != 0) {
-        if (strcmp(old_name, vm_pointer_to_native(state->memory, item->name, const char*)) == 0) {
-            vm_free(state->memory, item->name);
-            item->name = vm_malloc(state->memory, strlen(new_name) + 1);
-            strcpy(vm_pointer_to_native(state->memory, item->name, char*), new_name);
-            return 1;
-        }
-        if (item->next == 0) break;
-        item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
+    vm_type_t new_hash;
+    vm_pointer_t new_key = map_key_intern(state, new_str_ptr, &new_hash);
+
+    // an item that already has the new name is replaced by the renamed one
+    vm_map_elem_t *existing = map_find(state, table, new_key, new_hash);
+    if (existing != NULL && existing != item) {
+        map_remove(state, table, existing);
     }
 
-    return 0;
+    retain_pointer(state, VM_TYPE_STRING, new_key);
+    if (table->index_size != 0) {
+        vm_type_t position = (vm_type_t) (item - MAP_ENTRIES(table));
+        map_index_remove(table, item->hash, position);
+        map_index_insert(table, new_hash, position);
+    }
+    item->name = new_key;
+    item->hash = new_hash;
+    table->shape = VM_MAP_SHAPE_NONE;
+    release_pointer(state, VM_TYPE_STRING, old_key);
+    return 1;
 }
 
 INSTR(map_renamekey) {
     USE_STACK();
     vm_assert(state, stack->type == VM_TYPE_MAP, "value is not a map type"); // the map
 
-    vm_pointer_t old_name_ptr = get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
-    const char *old_name = cstr_pointer_from_vm_pointer_t(state, old_name_ptr);
-
-    vm_pointer_t new_name_ptr = get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
-    const char *new_name = cstr_pointer_from_vm_pointer_t(state, new_name_ptr);
+    vm_pointer_t old_name_ptr = GET_OPERAND();
+    vm_pointer_t new_name_ptr = GET_OPERAND();
 
-    map_rename_key(state, stack->pointer_value, old_name, new_name);
+    map_rename_key(state, stack->pointer_value, old_name_ptr, new_name_ptr);
 
     AJS_STACK(-1);
 }
@@ -487,10 +600,7 @@ INSTR(map_renamekey_pop) {
     vm_assert(state, (stack - 1)->type == VM_TYPE_STRING, "value is not a string");
     vm_assert(state, (stack)->type == VM_TYPE_STRING, "value is not a string");
 
-    const char *new_name = cstr_pointer_from_vm_value(state, stack);
-    const char *old_name = cstr_pointer_from_vm_value(state, stack - 1);
-
-    map_rename_key(state, (stack - 2)->pointer_value, old_name, new_name);
+    map_rename_key(state, (stack - 2)->pointer_value, (stack - 1)->pointer_value, stack->pointer_value);
 
     AJS_STACK(-3);
 }
@@ -502,52 +612,20 @@ INSTR(map_getkeys) {
     vm_value_t arrayval;
     arrayval.type = VM_TYPE_ARRAY;
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for length
-    vm_type_t *ref_count      = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_type_t *length         = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*) + 1;
+    vm_map_table_t *table = map_table(state, stack->pointer_value);
+    vm_pointer_t reserved_mem = arr_create(state, table == NULL ? 0 : table->count);
     vm_pointer_t *array_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
 
-    *ref_count = 1;
-
-    vm_pointer_t *item_ptr = vm_pointer_to_native(state->memory, stack->pointer_value, vm_pointer_t*) + 1;
-    vm_type_t len = 0;
-
-    if (*item_ptr != 0) {
-        vm_map_elem_t *item = vm_pointer_to_native(state->memory, *item_ptr, vm_map_elem_t*);
-
-        while (1) {
-            len++;
-
-            if (item->next == 0) break;
-            item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
-        }
-    }
-
-    *length = len;
-
-    *array_ptr = vm_malloc(state->memory, *length * sizeof(vm_value_t));
     vm_value_t *array = vm_pointer_to_native(state->memory, *array_ptr, vm_value_t*);
 
-    item_ptr = vm_pointer_to_native(state->memory, stack->pointer_value, vm_pointer_t*) + 1;
-    if (*item_ptr != 0) {
-        vm_map_elem_t *item = vm_pointer_to_native(state->memory, *item_ptr, vm_map_elem_t*);
+    if (table != NULL) {
+        // the keys are atoms, which are strings themselves
+        vm_map_elem_t *entries = MAP_ENTRIES(table);
         int i = 0;
-        while (1) {
-            // create string
-            vm_pointer_t str_reserved_mem = vm_malloc(state->memory,
-                                                  sizeof(vm_type_t)
-                                                  + strlen(cstr_pointer_from_vm_pointer_t(state, item->name))
-                                                  + 1);
-            vm_type_t *str_ref_count = vm_pointer_to_native(state->memory, str_reserved_mem, vm_type_t*);
-            char *str = vm_pointer_to_native(state->memory, str_reserved_mem + sizeof(vm_type_t), char*);
-            *str_ref_count = 1;
-            strcpy(str, cstr_pointer_from_vm_pointer_t(state, item->name));
-
-            array[i] = (vm_value_t) { .type = VM_TYPE_STRING, .pointer_value = str_reserved_mem };
-
-            if (item->next == 0) break;
-            item = vm_pointer_to_native(state->memory, item->next, vm_map_elem_t*);
-            i++;
+        for (vm_type_t e = 0; e < table->used; e++) {
+            if (entries[e].name == 0) continue;
+            array[i] = (vm_value_t) { .type = VM_TYPE_STRING, .pointer_value = entries[e].name };
+            retain(state, &array[i++]);
         }
     }
 
@@ -564,11 +642,12 @@ void ld_arrelem_map(CPU_State *state) {
     vm_assert(state, (stack-1)->type == VM_TYPE_MAP, "value is not a map");
     instr_conv_str(state); // ensure top of stack is a string, aka: the index
 
-    const char *name = cstr_pointer_from_vm_value(state, stack);
+    vm_type_t hash;
+    vm_pointer_t key = map_key(state, stack->pointer_value, &hash);
 
     vm_value_t val;
 
-    vm_map_elem_t *elem = ld_mapitem(state, (stack - 1)->pointer_value, name);
+    vm_map_elem_t *elem = map_lookup(state, (stack - 1)->pointer_value, key, hash);
     if (elem == NULL) {
         val.type = VM_TYPE_EMPTY;
     } else {
@@ -590,9 +669,10 @@ void st_arrelem_map(CPU_State *state) {
 
     vm_assert(state, (stack)->type == VM_TYPE_STRING, "map reference is not of string type");
 
-    const char *name = cstr_pointer_from_vm_value(state, stack);
+    vm_type_t hash;
+    vm_pointer_t key = map_key_intern(state, stack->pointer_value, &hash);
 
-    st_mapitem(state, (stack - 1)->pointer_value, name, stack - 2);
+    map_store(state, (stack - 1)->pointer_value, key, hash, stack - 2);
     release(state, stack - 1); // release the map
     release(state, stack); // release the name
     // no release/retain for value, as it is reduced by one because of stack pop, but added by one because of array storage
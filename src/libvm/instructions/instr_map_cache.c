@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../../include/funkyvm/funkyvm.h"
+
+#include "instructions.h"
+#include "../boxing.h"
+#include "../atoms.h"
+
+/*
+ * Map shapes and inline caches.
+ *
+ * Maps that get the same keys in the same order share a shape (hidden class): the empty map has shape
+ * VM_MAP_SHAPE_EMPTY, and adding a key moves a map to the shape that extends its current one with that key. As long
+ * as no item is deleted or renamed, the entries of a map are in the order its keys were added, so the shape alone
+ * tells at which position an item is. Maps that did have items deleted or renamed, that grew too large, or that got a
+ * key that is not a pinned atom (a name computed at runtime), have shape VM_MAP_SHAPE_NONE and are only ever looked up
+ * the regular way.
+ *
+ * When a module is loaded, every ld.mapitem and st.mapitem site gets a vm_map_cache_t. The site remembers the
+ * positions it found its item at for up to VM_MAP_CACHE_WAYS shapes, including items found in the direct prototype
+ * of a map, and for st.mapitem the shape a map gets when the item is added.
+ */
+
+#define MAP_MAX_SHAPES 65536
+#define MAP_MAX_SHAPED_KEYS 64
+#define MAP_MIN_SHAPES 64
+
+#define OP_LD_MAPITEM 0xB0
+#define OP_ST_MAPITEM 0xB2
+
+static inline vm_type_t shape_slot(CPU_State *state, vm_type_t parent, vm_type_t hash) {
+    return (hash ^ (parent * 0x9E3779B1u)) & (state->map_shape_index_size - 1);
+}
+
+static void shapes_reindex(CPU_State *state, vm_type_t index_size) {
+    free(state->map_shape_index);
+    state->map_shape_index = calloc(index_size, sizeof(vm_type_t));
+    state->map_shape_index_size = index_size;
+
+    for (vm_type_t id = VM_MAP_SHAPE_EMPTY + 1; id < state->num_map_shapes; id++) {
+        vm_map_shape_t *shape = &state->map_shapes[id];
+        vm_type_t slot = shape_slot(state, shape->parent, shape->hash);
+        while (state->map_shape_index[slot] != 0) {
+            slot = (slot + 1) & (index_size - 1);
+        }
+        state->map_shape_index[slot] = id;
+    }
+}
+
+/*
+ * Returns the shape a map with the given shape gets when an item with the given key is added to it.
+ */
+vm_type_t map_shape_transition(CPU_State *state, vm_type_t shape, vm_pointer_t key, vm_type_t hash) {
+    if (shape == VM_MAP_SHAPE_NONE || !is_pinned_atom(state, key)) {
+        return VM_MAP_SHAPE_NONE;
+    }
+
+    if (state->map_shapes == NULL) {
+        state->map_shapes = calloc(MAP_MIN_SHAPES, sizeof(vm_map_shape_t));
+        state->num_map_shapes = VM_MAP_SHAPE_EMPTY + 1;
+        shapes_reindex(state, MAP_MIN_SHAPES * 2);
+    }
+
+    if (state->map_shapes[shape].num_keys >= MAP_MAX_SHAPED_KEYS) {
+        return VM_MAP_SHAPE_NONE;
+    }
+
+    vm_type_t mask = state->map_shape_index_size - 1;
+    vm_type_t slot = shape_slot(state, shape, hash);
+    for (; state->map_shape_index[slot] != 0; slot = (slot + 1) & mask) {
+        vm_map_shape_t *next = &state->map_shapes[state->map_shape_index[slot]];
+        if (next->parent == shape && next->name == key) {
+            return state->map_shape_index[slot];
+        }
+    }
+
+    if (state->num_map_shapes >= MAP_MAX_SHAPES) {
+        return VM_MAP_SHAPE_NONE;
+    }
+
+    // the index is kept at twice the capacity of the shape array
+    if (state->num_map_shapes == state->map_shape_index_size / 2) {
+        state->map_shapes = realloc(state->map_shapes, state->map_shape_index_size * sizeof(vm_map_shape_t));
+        shapes_reindex(state, state->map_shape_index_size * 2);
+        mask = state->map_shape_index_size - 1;
+        slot = shape_slot(state, shape, hash);
+        while (state->map_shape_index[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    vm_type_t id = state->num_map_shapes++;
+    vm_map_shape_t *next = &state->map_shapes[id];
+    next->parent = shape;
+    next->hash = hash;
+    next->name = key;
+    next->num_keys = state->map_shapes[shape].num_keys + 1;
+    state->map_shape_index[slot] = id;
+
+    return id;
+}
+
+void map_shapes_destroy(CPU_State *state) {
+    free(state->map_shapes);
+    free(state->map_shape_index);
+    state->map_shapes = NULL;
+    state->map_shape_index = NULL;
+    state->num_map_shapes = 0;
+    state->map_shape_index_size = 0;
+}
+
+static inline vm_type_t shape_of(vm_map_table_t *table) {
+    return table == NULL ? VM_MAP_SHAPE_EMPTY : table->shape;
+}
+
+static inline vm_pointer_t prototype_of(CPU_State *state, vm_pointer_t map_ptr) {
+    return *(vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 2);
+}
+
+static void cache_insert(vm_map_cache_t *cache, vm_map_cache_entry_t entry) {
+    cache->entries[cache->next_entry] = entry;
+    cache->next_entry = (cache->next_entry + 1) % VM_MAP_CACHE_WAYS;
+}
+
+/*
+ * Returns the item the cache knows the position of for this map, or NULL.
+ */
+static vm_map_elem_t* cache_lookup(CPU_State *state, vm_map_cache_t *cache, vm_pointer_t map_ptr) {
+    vm_map_table_t *table = map_table(state, map_ptr);
+    vm_type_t shape = shape_of(table);
+    if (shape == VM_MAP_SHAPE_NONE) {
+        return NULL;
+    }
+
+    for (int i = 0; i < VM_MAP_CACHE_WAYS; i++) {
+        vm_map_cache_entry_t *entry = &cache->entries[i];
+        if (entry->shape != shape || entry->new_shape != VM_MAP_SHAPE_NONE) {
+            continue;
+        }
+        if (entry->holder_shape == VM_MAP_SHAPE_NONE) {
+            return &MAP_ENTRIES(table)[entry->position];
+        }
+        // the map holds a reference to its prototype, so as long as it is the same one it is still alive
+        if (prototype_of(state, map_ptr) == entry->prototype) {
+            vm_map_table_t *holder = map_table(state, entry->prototype);
+            if (holder != NULL && holder->shape == entry->holder_shape) {
+                return &MAP_ENTRIES(holder)[entry->position];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Looks an item up the regular way, and remembers where it was found if that was in the map or in its prototype.
+ */
+static vm_map_elem_t* cache_miss(CPU_State *state, vm_map_cache_t *cache, vm_pointer_t map_ptr, vm_pointer_t key) {
+    if (key == 0) {
+        return NULL;
+    }
+
+    vm_map_table_t *table = map_table(state, map_ptr);
+    vm_type_t shape = shape_of(table);
+
+    vm_map_elem_t *elem = table == NULL ? NULL : map_find(state, table, key, cache->hash);
+    if (elem != NULL) {
+        if (shape != VM_MAP_SHAPE_NONE) {
+            cache_insert(cache, (vm_map_cache_entry_t) {
+                    .shape = shape, .position = (vm_type_t) (elem - MAP_ENTRIES(table)) });
+        }
+        return elem;
+    }
+
+    vm_pointer_t prototype = prototype_of(state, map_ptr);
+    if (prototype == 0) {
+        return NULL;
+    }
+
+    vm_map_table_t *holder = map_table(state, prototype);
+    elem = holder == NULL ? NULL : map_find(state, holder, key, cache->hash);
+    if (elem != NULL) {
+        if (shape != VM_MAP_SHAPE_NONE && holder->shape != VM_MAP_SHAPE_NONE) {
+            cache_insert(cache, (vm_map_cache_entry_t) {
+                    .shape = shape, .holder_shape = holder->shape, .prototype = prototype,
+                    .position = (vm_type_t) (elem - MAP_ENTRIES(holder)) });
+        }
+        return elem;
+    }
+
+    return map_lookup(state, prototype, key, cache->hash);
+}
+
+INSTR(ld_mapitem_cached) {
+    USE_STACK();
+    if (stack->type != VM_TYPE_MAP) {
+        instr_box(state);
+    }
+    vm_map_cache_t *cache = &state->map_caches[state->operands[1].uint_value];
+    vm_pointer_t name_ptr = GET_OPERAND();
+    vm_value_t val;
+
+    vm_map_elem_t *elem = cache_lookup(state, cache, stack->pointer_value);
+    if (elem != NULL) {
+        cache->hits++;
+    } else {
+        cache->misses++;
+        vm_type_t hash;
+        elem = cache_miss(state, cache, stack->pointer_value, map_key(state, name_ptr, &hash));
+    }
+
+    if (elem == NULL) {
+        val.type = VM_TYPE_EMPTY;
+        val.int_value = 0;
+    } else {
+        val = elem->value;
+        retain(state, &val);
+    }
+
+    release(state, stack); // release the map
+    *stack = val;
+}
+
+INSTR(st_mapitem_cached) {
+    USE_STACK();
+    vm_assert(state, (stack)->type == VM_TYPE_MAP, "value is not a map type");
+    vm_map_cache_t *cache = &state->map_caches[state->operands[1].uint_value];
+    vm_type_t hash;
+    vm_pointer_t key = map_key_intern(state, GET_OPERAND(), &hash);
+
+    vm_pointer_t map_ptr = stack->pointer_value;
+    vm_map_table_t *table = map_table(state, map_ptr);
+    vm_type_t shape = shape_of(table);
+
+    for (int i = 0; shape != VM_MAP_SHAPE_NONE && i < VM_MAP_CACHE_WAYS; i++) {
+        vm_map_cache_entry_t *entry = &cache->entries[i];
+        if (entry->shape != shape || entry->holder_shape != VM_MAP_SHAPE_NONE) {
+            continue;
+        }
+
+        if (entry->new_shape == VM_MAP_SHAPE_NONE) {
+            vm_map_elem_t *item = &MAP_ENTRIES(table)[entry->position];
+            vm_value_t oldval = item->value;
+            item->value = *(stack - 1);
+            release(state, &oldval);
+        } else {
+            if (table == NULL || table->used == table->capacity) {
+                map_reserve(state, map_ptr, table == NULL ? 1 : (table->count + 1) * 2);
+                table = map_table(state, map_ptr);
+            }
+            map_append(state, table, key, hash, stack - 1, entry->new_shape);
+        }
+
+        cache->hits++;
+        release(state, stack); // release the map
+        // no release/retain for value, as it is reduced by one because of stack pop, but added by one because of array storage
+        AJS_STACK(-2);
+        return;
+    }
+
+    cache->misses++;
+    map_store(state, map_ptr, key, hash, stack - 1);
+
+    table = map_table(state, map_ptr);
+    if (shape != VM_MAP_SHAPE_NONE && table->shape != VM_MAP_SHAPE_NONE) {
+        vm_map_elem_t *elem = map_find(state, table, key, hash);
+        cache_insert(cache, (vm_map_cache_entry_t) {
+                .shape = shape, .position = (vm_type_t) (elem - MAP_ENTRIES(table)),
+                .new_shape = table->shape == shape ? VM_MAP_SHAPE_NONE : table->shape });
+    }
+
+    release(state, stack); // release the map
+    // no release/retain for value, as it is reduced by one because of stack pop, but added by one because of array storage
+    AJS_STACK(-2);
+}
+
+/*
+ * Gives every ld.mapitem and st.mapitem the decoder reached in a module its own cache. operands[1] of these records
+ * (they only have one operand) holds the index of the cache in module->map_caches.
+ */
+void assign_map_caches(Module *module, const byte_t *native_module_addr) {
+    module->map_caches = NULL;
+    module->num_map_caches = 0;
+
+    vm_type_t num_sites = 0;
+    for (vm_type_t i = 1; i < module->num_instructions; i++) {
+        if (module->code[i].opcode == OP_LD_MAPITEM || module->code[i].opcode == OP_ST_MAPITEM) {
+            num_sites++;
+        }
+    }
+    if (num_sites == 0) {
+        return;
+    }
+
+    module->map_caches = calloc(num_sites, sizeof(vm_map_cache_t));
+    for (vm_type_t offset = module->start_of_code;
+         offset < module->size && module->code_index[offset] != 0;
+         offset += module->code[module->code_index[offset]].length) {
+        vm_instruction_t *instr = &module->code[module->code_index[offset]];
+        if (instr->opcode != OP_LD_MAPITEM && instr->opcode != OP_ST_MAPITEM) {
+            continue;
+        }
+
+        // the name is a string constant of the module, its operand has been relocated to point at its refcount
+        vm_type_t name_offset = instr->operands[0].uint_value + sizeof(vm_type_t) - module->addr;
+        if (name_offset >= module->size) {
+            continue;
+        }
+
+        vm_map_cache_t *cache = &module->map_caches[module->num_map_caches];
+        cache->offset = offset;
+        cache->name = module->addr + name_offset;
+        cache->hash = map_hash((const char *) native_module_addr + name_offset);
+
+        instr->operands[1].uint_value = module->num_map_caches++;
+        instr->impl = instr->opcode == OP_LD_MAPITEM ? &instr_ld_mapitem_cached : &instr_st_mapitem_cached;
+    }
+}
@@ -8,42 +8,83 @@
 #include "../../../include/funkyvm/funkyvm.h"
 #include "../../../include/funkyvm/memory.h"
 #include "../error_handling.h"
+#include "../atoms.h"
+#include "../cycles.h"
+
+/*
+ * Maps and arrays whose refcount drops to zero are not freed right away, but pushed on a list that is linked through
+ * their (now unused) refcount, one list per type. Freeing an object releases what it refers to, which may push more
+ * objects, so a large graph is freed by working through the lists instead of by recursion, and the native stack does
+ * not grow with the depth of the graph.
+ *
+ * With a release_slice of 0 the lists are emptied before the outermost release() returns, which frees the same objects
+ * as freeing them recursively would. Otherwise release() leaves the work to cpu_safepoint(), which frees at most
+ * release_slice objects each time, so dropping a large map does not pause the program for the whole graph at once.
+ */
+static void free_object(CPU_State *state, enum vm_value_type_t type, vm_pointer_t ptr) {
+    if (type == VM_TYPE_ARRAY) {
+        arr_release(state, ptr);
+    } else {
+        map_release(state, ptr);
+    }
+    vm_free(state->memory, ptr);
+}
 
-void release_pointer(CPU_State *state, enum vm_value_type_t type, vm_pointer_t ptr) {
-    vm_type_t *ref_count = vm_pointer_to_native(state->memory, ptr, vm_type_t*);
+static void release_object(CPU_State *state, enum vm_value_type_t type, vm_pointer_t ptr) {
+    if (state->num_cycle_roots != 0) {
+        cycles_forget(state, ptr);
+    }
 
-    // do not free constants from code or null pointers
-    if (*ref_count == VM_UNSIGNED_MAX) {
-        //printf("Not released string \"%s\", it is in static memory.\n", cstr_pointer_from_vm_value(state, val));
+    if (state->release_slice == 0 && !state->releasing) {
+        // the outermost release, free it right away and then whatever that pushed
+        state->releasing = 1;
+        free_object(state, type, ptr);
+        state->releasing = 0;
+        if (state->released_arrays != 0 || state->released_maps != 0) {
+            release_deferred(state, 0);
+        }
         return;
     }
 
-    (*ref_count)--;
+    vm_pointer_t *list = type == VM_TYPE_ARRAY ? &state->released_arrays : &state->released_maps;
+    *vm_pointer_to_native(state->memory, ptr, vm_pointer_t*) = *list;
+    *list = ptr;
 
-    //printf("Released string \"%s\". Refcount from %d to %d.", cstr_pointer_from_vm_value(state, val), *ref_count + 1, *ref_count);
+    if (state->release_slice != 0) {
+        state->safepoint_pending = 1;
+    }
+}
 
-    if (*ref_count == 0) {
-        if (type == VM_TYPE_ARRAY) {
-            arr_release(state, ptr);
-        } else if (type == VM_TYPE_MAP) {
-            map_release(state, ptr);
+/*
+ * Frees up to max_objects maps and arrays from the release lists, or all of them for 0. Returns whether any are left.
+ */
+int release_deferred(CPU_State *state, vm_type_t max_objects) {
+    int releasing = state->releasing;
+    state->releasing = 1;
+
+    for (vm_type_t freed = 0; max_objects == 0 || freed < max_objects; freed++) {
+        if (state->released_arrays != 0) {
+            vm_pointer_t ptr = state->released_arrays;
+            state->released_arrays = *vm_pointer_to_native(state->memory, ptr, vm_pointer_t*);
+            free_object(state, VM_TYPE_ARRAY, ptr);
+        } else if (state->released_maps != 0) {
+            vm_pointer_t ptr = state->released_maps;
+            state->released_maps = *vm_pointer_to_native(state->memory, ptr, vm_pointer_t*);
+            free_object(state, VM_TYPE_MAP, ptr);
+        } else {
+            break;
         }
-
-        //printf(" Refcount is 0, so free memory.");
-        vm_free(state->memory, ptr);
     }
 
+    state->releasing = releasing;
+    return state->released_arrays != 0 || state->released_maps != 0;
 }
 
-void release(CPU_State *state, vm_value_t *val) {
-    if (val->type != VM_TYPE_STRING && val->type != VM_TYPE_MAP && val->type != VM_TYPE_ARRAY) {
-        return;
-    }
-
-    vm_type_t *ref_count = vm_pointer_to_native(state->memory, val->pointer_value, vm_type_t*);
+void release_pointer(CPU_State *state, enum vm_value_type_t type, vm_pointer_t ptr) {
+    vm_type_t *ref_count = vm_pointer_to_native(state->memory, ptr, vm_type_t*);
 
-    // do not free constants from code or null pointers
-    if (*ref_count == VM_UNSIGNED_MAX) {
+    // do not free constants from code, pinned atoms or null pointers
+    if (*ref_count >= VM_ATOM_PINNED) {
         //printf("Not released string \"%s\", it is in static memory.\n", cstr_pointer_from_vm_value(state, val));
         return;
     }
@@ -53,17 +94,27 @@ void release(CPU_State *state, vm_value_t *val) {
     //printf("Released string \"%s\". Refcount from %d to %d.", cstr_pointer_from_vm_value(state, val), *ref_count + 1, *ref_count);
 
     if (*ref_count == 0) {
-        if (val->type == VM_TYPE_ARRAY) {
-            arr_release(state, val->pointer_value);
-        } else if (val->type == VM_TYPE_MAP) {
-            map_release(state, val->pointer_value);
+        //printf(" Refcount is 0, so free memory.");
+        if (type == VM_TYPE_STRING) {
+            str_free(state, ptr);
+        } else {
+            release_object(state, type, ptr);
         }
+    } else if (*ref_count == VM_ATOM_REFCOUNT) {
+        atom_free(state, ptr);
+    } else if (type != VM_TYPE_STRING && state->cycle_threshold != 0) {
+        // it may have been the last reference from outside a cycle, see cycles.c
+        cycles_buffer(state, type, ptr);
+    }
 
-        //printf(" Refcount is 0, so free memory.");
-        vm_free(state->memory, val->pointer_value);
+}
+
+void release(CPU_State *state, vm_value_t *val) {
+    if (val->type != VM_TYPE_STRING && val->type != VM_TYPE_MAP && val->type != VM_TYPE_ARRAY) {
+        return;
     }
 
-    //printf("\n");
+    release_pointer(state, val->type, val->pointer_value);
 }
 
 void retain_pointer(CPU_State *state, enum vm_value_type_t type, vm_pointer_t ptr) {
@@ -73,8 +124,8 @@ void retain_pointer(CPU_State *state, enum vm_value_type_t type, vm_pointer_t pt
 
     vm_type_t *ref_count = vm_pointer_to_native(state->memory, ptr, vm_type_t*);
 
-    // do not retain constants from code or null pointers
-    if (*ref_count == VM_UNSIGNED_MAX) {
+    // do not retain constants from code, pinned atoms or null pointers
+    if (*ref_count >= VM_ATOM_PINNED) {
         return;
     }
 
@@ -88,8 +139,8 @@ void retain(CPU_State *state, vm_value_t *val) {
 
     vm_type_t *ref_count = vm_pointer_to_native(state->memory, val->pointer_value, vm_type_t*);
 
-    // do not retain constants from code or null pointers
-    if (*ref_count == VM_UNSIGNED_MAX) {
+    // do not retain constants from code, pinned atoms or null pointers
+    if (*ref_count >= VM_ATOM_PINNED) {
         //printf("Not retaining string \"%s\", it is in static memory.\n", cstr_pointer_from_vm_value(state, val));
         return;
     }
@@ -126,7 +177,7 @@ INSTR(ld_str) {
     AJS_STACK(+1);
     USE_STACK();
 
-    stack->pointer_value = get_current_module(state)->addr + GET_OPERAND();
+    stack->pointer_value = GET_OPERAND();
     stack->type = VM_TYPE_STRING;
 }
 
@@ -214,7 +265,7 @@ INSTR(ld_ref) {
     AJS_STACK(+1);
     USE_STACK();
     *stack = (vm_value_t) {
-            .pointer_value = get_current_module(state)->addr + GET_OPERAND(),
+            .pointer_value = GET_OPERAND(),
             .type = VM_TYPE_REF
     };
 }
@@ -233,7 +284,14 @@ INSTR(deref) {
 
     vm_assert(state, stack->type == VM_TYPE_REF, "Can't dereference value");
     //*stack = *((vm_value_t*)(state->memory->main_memory + stack->uint_value));
-    *stack = *vm_pointer_to_native(state->memory, stack->pointer_value, vm_value_t*);
+    vm_value_t *value = vm_pointer_to_native(state->memory, stack->pointer_value, vm_value_t*);
+    if (value->type == VM_TYPE_RETIRED) {
+        // a reference to the stack from before it grew, see cpu_grow_stack()
+        vm_error(state, "Can't dereference a stack slot the stack has grown out of");
+        vm_exit(state, EXIT_FAILURE);
+        return;
+    }
+    *stack = *value;
 
     retain(state, stack);
 }
@@ -242,7 +300,7 @@ INSTR(ld_deref) {
     AJS_STACK(+1);
     USE_STACK();
 
-    *stack = *vm_pointer_to_native(state->memory, get_current_module(state)->addr + GET_OPERAND(), vm_value_t*);
+    *stack = *vm_pointer_to_native(state->memory, GET_OPERAND(), vm_value_t*);
     retain(state, stack);
 }
 
@@ -321,7 +379,7 @@ INSTR(st_addr) {
 
 INSTR(st_ref) {
     USE_STACK();
-    vm_value_t *dst = vm_pointer_to_native(state->memory, get_current_module(state)->addr + GET_OPERAND(), vm_value_t*);
+    vm_value_t *dst = vm_pointer_to_native(state->memory, GET_OPERAND(), vm_value_t*);
     release(state, dst);
     *dst = *stack;
     AJS_STACK(-1);
@@ -335,6 +393,7 @@ INSTR(ajs) {
             instr_pop(state);
         }
     } else {
+        CHECK_STACK(operand);
         AJS_STACK(operand);
     }
 }
@@ -345,13 +404,14 @@ INSTR(locals_res) {
     // M_post[MP_post] = MP_pre
     // SP_post = MP_post + M_pre[PC_pre+1]
 
+    vm_type_signed_t num = GET_OPERAND_SIGNED();
+    CHECK_STACK(num + 1);
+
     vm_value_t MP_pre = { .uint_value = state->mp, .type = VM_TYPE_REF };
     state->mp = state->sp + sizeof(vm_value_t);
 
     USE_MARK();
 
-    vm_type_signed_t num = GET_OPERAND_SIGNED();
-
     *mark = MP_pre;
     state->sp = state->mp + sizeof(vm_value_t) * num;
 
@@ -27,26 +27,13 @@ static void link(CPU_State *state, const char* name) {
         *module = module_load_name(state, name);
     }
 
-    vm_pointer_t reserved_mem     = vm_malloc(state->memory, sizeof(vm_type_t) * 3); // first for refcount, second for first item
-    vm_type_t *ref_count          = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    vm_pointer_t *first_ptr       = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 1;
-    vm_pointer_t *prototype_ptr   = vm_pointer_to_native(state->memory, reserved_mem, vm_pointer_t*) + 2;
-
-    *ref_count = VM_UNSIGNED_MAX;
-    *first_ptr = 0;
-    *prototype_ptr = 0;
-
-    char *addr = vm_pointer_to_native(state->memory, module->addr, char*);
-    int num_found = 0;
-    while (num_found < module->num_exports) {
-        const char *curname = addr;
-        while (*(addr++) != '\0') {}
-        vm_type_t ref = *((vm_type_t *) addr);
-        vm_value_t refval = (vm_value_t) {.type = VM_TYPE_REF, .pointer_value = module->addr + ref};
-        st_mapitem(state, reserved_mem, curname, &refval);
-
-        num_found++;
-        addr += sizeof(vm_type_t);
+    vm_pointer_t reserved_mem = map_create(state, VM_UNSIGNED_MAX, 0);
+    map_reserve(state, reserved_mem, module->num_exports + 1); // the exports and @init
+
+    for (vm_type_t i = 0; i < module->num_exports; i++) {
+        vm_module_export_t *export = &module->exports[i];
+        vm_value_t refval = (vm_value_t) {.type = VM_TYPE_REF, .pointer_value = export->addr};
+        st_mapitem(state, reserved_mem, vm_pointer_to_native(state->memory, export->name, const char*), &refval);
     }
 
     vm_value_t refval = (vm_value_t) {.type = VM_TYPE_REF, .pointer_value = module->addr + module->start_of_code};
@@ -82,7 +69,7 @@ static void link(CPU_State *state, const char* name) {
  *     description: Named references that have been exported from module
  */
 INSTR(link) {
-    char *name = (char*)state->memory->main_memory + get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
+    char *name = (char*)state->memory->main_memory + GET_OPERAND() + sizeof(vm_type_t);
 
     link(state, name);
 }
@@ -117,7 +104,7 @@ static void module_unlink(CPU_State *state, const char *name) {
 }
 
 INSTR(unlink) {
-    char *name = (char*)state->memory->main_memory + get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
+    char *name = (char*)state->memory->main_memory + GET_OPERAND() + sizeof(vm_type_t);
     module_unlink(state, name);
 }
 
@@ -145,28 +132,39 @@ INSTR(unlink_pop) {
  *     description: Reference to symbol
  */
 INSTR(ld_extern) {
-    char *module = (char*)state->memory->main_memory + get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
-    char *name = (char*)state->memory->main_memory + get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
-
-    for (int i = 0; i < state->num_modules; i++) {
-        if (strcmp(state->modules[i].name, module) == 0) {
-            char *addr = (char *) state->memory->main_memory + state->modules[i].addr;
-            int num_found = 0;
-            while (num_found < state->modules[i].num_exports) {
-                char c, *curname = addr;
-                while (*(addr++) != '\0') {}
-                vm_type_t ref = *((vm_type_t *) addr);
-                addr += sizeof(vm_type_t);
-                if (strcmp(name, curname) == 0) {
-                    AJS_STACK(+1);
-                    USE_STACK();
-                    stack->uint_value = ref + state->modules[i].addr;
-                    stack->type = VM_TYPE_REF;
-                }
-                num_found++;
-            }
-        }
+    char *module_name = (char*)state->memory->main_memory + GET_OPERAND() + sizeof(vm_type_t);
+    char *name = (char*)state->memory->main_memory + GET_OPERAND() + sizeof(vm_type_t);
+
+    Module *module = module_get(state, module_name);
+    vm_module_export_t *export = module == NULL ? NULL : module_find_export(state->memory, module, name);
+    if (export == NULL) {
+        vm_error(state, "Unresolved external '%s' in module %s", name, module_name);
+        vm_exit(state, EXIT_FAILURE);
+        return;
     }
+
+    // rewrite the decoded instruction to load the address directly next time. The address stays valid until the
+    // module is unloaded, which turns the instruction back into ld.extern (see module_release).
+    state->instr->opcode = VM_OPCODE_LD_EXTERN_RESOLVED;
+    state->instr->impl = &instr_ld_extern_resolved;
+    state->instr->operands[2].uint_value = export->addr;
+
+    AJS_STACK(+1);
+    USE_STACK();
+    *stack = (vm_value_t) {
+            .pointer_value = export->addr,
+            .type = VM_TYPE_REF
+    };
+}
+
+INSTR(ld_extern_resolved) {
+    state->pc += 2 * sizeof(vm_type_t);
+    AJS_STACK(+1);
+    USE_STACK();
+    *stack = (vm_value_t) {
+            .pointer_value = state->operands[2].uint_value,
+            .type = VM_TYPE_REF
+    };
 }
 
 INSTR(mod_exists) {
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../../../include/funkyvm/funkyvm.h"
+
+#include "instructions.h"
+
+/*
+ * Quickening. Arithmetic and comparison sites start out with instr_quicken as their implementation. The first time a
+ * site runs, instr_quicken looks at the operand types and, if both are ints or both are floats, rewrites the decoded
+ * record into a variant that only handles those types (much like syscall.byname rewrites itself into syscall). When a
+ * quickened site later sees other types, it rewrites itself back to instr_quicken and runs the generic instruction.
+ * operands[0] of these records (they have no operands of their own) counts those deoptimizations, so a site whose types
+ * keep changing eventually stays generic.
+ */
+
+unsigned char quick_generic_opcodes[VM_NUM_QUICK_SITES] = {
+        0x30,   // add
+        0x31,   // sub
+        0x32,   // mul
+        0x33,   // div
+        0x3B,   // eq
+        0x3C,   // ne
+        0x3D,   // lt
+        0x3E,   // gt
+        0x3F,   // le
+        0x40,   // ge
+};
+
+int quick_site(unsigned short opcode) {
+    if (opcode >= 0x30 && opcode <= 0x33) return opcode - 0x30;
+    if (opcode >= 0x3B && opcode <= 0x40) return opcode - 0x3B + 4;
+    return -1;
+}
+
+static void deoptimize(CPU_State *state) {
+    vm_instruction_t *instr = state->instr;
+    unsigned char opcode = quick_generic_opcodes[(instr->opcode - VM_OPCODE_QUICK_INT) % VM_NUM_QUICK_SITES];
+    instr->opcode = opcode;
+    instr->impl = &instr_quicken;
+    instr->operands[0].uint_value++;
+    instruction_implementations[opcode](state);
+}
+
+#define QUICK_ARITH(NAME, TYPE, FIELD, CAST, OP) INSTR(NAME) { \
+    USE_STACK(); \
+    if ((stack - 1)->type != TYPE || stack->type != TYPE) { \
+        deoptimize(state); \
+        return; \
+    } \
+    (stack - 1)->FIELD = (CAST) ((stack - 1)->FIELD OP stack->FIELD); \
+    AJS_STACK(-1); \
+}
+
+#define QUICK_COMPARE(NAME, TYPE, FIELD, OP) INSTR(NAME) { \
+    USE_STACK(); \
+    if ((stack - 1)->type != TYPE || stack->type != TYPE) { \
+        deoptimize(state); \
+        return; \
+    } \
+    (stack - 1)->uint_value = (vm_type_t) ((stack - 1)->FIELD OP stack->FIELD); \
+    (stack - 1)->type = VM_TYPE_UINT; \
+    AJS_STACK(-1); \
+}
+
+QUICK_ARITH(add_int, VM_TYPE_INT, int_value, vm_type_signed_t, +)
+QUICK_ARITH(sub_int, VM_TYPE_INT, int_value, vm_type_signed_t, -)
+QUICK_ARITH(mul_int, VM_TYPE_INT, int_value, vm_type_signed_t, *)
+QUICK_ARITH(div_int, VM_TYPE_INT, int_value, vm_type_signed_t, /)
+QUICK_COMPARE(eq_int, VM_TYPE_INT, int_value, ==)
+QUICK_COMPARE(ne_int, VM_TYPE_INT, int_value, !=)
+QUICK_COMPARE(lt_int, VM_TYPE_INT, int_value, <)
+QUICK_COMPARE(gt_int, VM_TYPE_INT, int_value, >)
+QUICK_COMPARE(le_int, VM_TYPE_INT, int_value, <=)
+QUICK_COMPARE(ge_int, VM_TYPE_INT, int_value, >=)
+
+QUICK_ARITH(add_float, VM_TYPE_FLOAT, float_value, vm_type_float_t, +)
+QUICK_ARITH(sub_float, VM_TYPE_FLOAT, float_value, vm_type_float_t, -)
+QUICK_ARITH(mul_float, VM_TYPE_FLOAT, float_value, vm_type_float_t, *)
+QUICK_ARITH(div_float, VM_TYPE_FLOAT, float_value, vm_type_float_t, /)
+QUICK_COMPARE(eq_float, VM_TYPE_FLOAT, float_value, ==)
+QUICK_COMPARE(ne_float, VM_TYPE_FLOAT, float_value, !=)
+QUICK_COMPARE(lt_float, VM_TYPE_FLOAT, float_value, <)
+QUICK_COMPARE(gt_float, VM_TYPE_FLOAT, float_value, >)
+QUICK_COMPARE(le_float, VM_TYPE_FLOAT, float_value, <=)
+QUICK_COMPARE(ge_float, VM_TYPE_FLOAT, float_value, >=)
+
+static Instruction_Implementation quick_implementations[2 * VM_NUM_QUICK_SITES] = {
+        &instr_add_int, &instr_sub_int, &instr_mul_int, &instr_div_int,
+        &instr_eq_int, &instr_ne_int, &instr_lt_int, &instr_gt_int, &instr_le_int, &instr_ge_int,
+
+        &instr_add_float, &instr_sub_float, &instr_mul_float, &instr_div_float,
+        &instr_eq_float, &instr_ne_float, &instr_lt_float, &instr_gt_float, &instr_le_float, &instr_ge_float,
+};
+
+INSTR(quicken) {
+    USE_STACK();
+    vm_instruction_t *instr = state->instr;
+    int site = quick_site(instr->opcode);
+
+    if (instr->operands[0].uint_value < VM_QUICKEN_MAX_DEOPTS && (stack - 1)->type == stack->type) {
+        unsigned short quick_opcode = 0;
+        if (stack->type == VM_TYPE_INT) {
+            quick_opcode = (unsigned short) (VM_OPCODE_QUICK_INT + site);
+        } else if (stack->type == VM_TYPE_FLOAT) {
+            quick_opcode = (unsigned short) (VM_OPCODE_QUICK_FLOAT + site);
+        }
+
+        if (quick_opcode != 0) {
+            instr->opcode = quick_opcode;
+            instr->impl = quick_implementations[quick_opcode - VM_OPCODE_QUICK_INT];
+            instr->impl(state);
+            return;
+        }
+    }
+
+    instruction_implementations[quick_generic_opcodes[site]](state);
+}
@@ -7,6 +7,7 @@
 #include "../../../include/funkyvm/funkyvm.h"
 #include "../../../include/funkyvm/cpu.h"
 #include "../error_handling.h"
+#include "../atoms.h"
 
 #include "../../../include/funkyvm/os.h"
 #ifdef FUNKY_VM_OS_EMSCRIPTEN
@@ -14,9 +15,11 @@
 #endif
 
 /* -- Strings --
- * Arrays are saved in memory as a packed tuple:
+ * Strings are saved in memory as a packed tuple, see vm_string_header_t:
  *   vm_type_t length
- *   char*     pointer to char* (c string)
+ *   vm_type_t hash
+ *   vm_type_t refcount  <- the string pointer
+ *   char[]    characters, NUL-terminated
  */
 
 // Strings are refcounted
@@ -30,6 +33,75 @@ char *cstr_pointer_from_vm_value(CPU_State* state, vm_value_t* val) {
     return cstr_pointer_from_vm_pointer_t(state, val->pointer_value + sizeof(vm_type_t));
 }
 
+/*
+ * Allocates a string of length bytes with a refcount of 1. Only the terminating NUL is written, the caller fills in
+ * the characters.
+ */
+vm_pointer_t str_alloc(CPU_State *state, vm_type_t length) {
+    vm_pointer_t reserved_mem = vm_malloc(state->memory,
+                                          sizeof(vm_string_header_t)
+                                          + sizeof(vm_type_t)
+                                          + length
+                                          + 1);
+    vm_pointer_t str_ptr = reserved_mem + sizeof(vm_string_header_t);
+
+    *str_header(state, str_ptr) = (vm_string_header_t) { .length = length, .hash = 0 };
+    *vm_pointer_to_native(state->memory, str_ptr, vm_type_t*) = 1;
+    cstr_pointer_from_vm_pointer_t(state, str_ptr + sizeof(vm_type_t))[length] = '\0';
+
+    return str_ptr;
+}
+
+static inline int str_has_header(CPU_State *state, vm_pointer_t str_ptr) {
+    return *vm_pointer_to_native(state->memory, str_ptr, vm_type_t*) != VM_STRING_RAW;
+}
+
+vm_type_t str_length(CPU_State *state, vm_pointer_t str_ptr) {
+    if (!str_has_header(state, str_ptr)) {
+        return (vm_type_t) strlen(cstr_pointer_from_vm_pointer_t(state, str_ptr + sizeof(vm_type_t)));
+    }
+    return str_header(state, str_ptr)->length;
+}
+
+/*
+ * Returns map_hash() of the string, computing it only the first time it is asked for.
+ */
+vm_type_t str_hash(CPU_State *state, vm_pointer_t str_ptr) {
+    const char *chars = cstr_pointer_from_vm_pointer_t(state, str_ptr + sizeof(vm_type_t));
+    if (!str_has_header(state, str_ptr)) {
+        return map_hash(chars);
+    }
+
+    vm_string_header_t *header = str_header(state, str_ptr);
+    if (header->hash == 0) {
+        header->hash = map_hash(chars);
+    }
+    return header->hash;
+}
+
+static int str_equals(CPU_State *state, vm_pointer_t str1, vm_pointer_t str2) {
+    if (str1 == str2) {
+        return 1;
+    }
+
+    vm_type_t length = str_length(state, str1);
+    if (length != str_length(state, str2)) {
+        return 0;
+    }
+
+    // only compare hashes that are known already, computing them costs as much as comparing the strings
+    if (str_has_header(state, str1) && str_has_header(state, str2)) {
+        vm_type_t hash1 = str_header(state, str1)->hash;
+        vm_type_t hash2 = str_header(state, str2)->hash;
+        if (hash1 != 0 && hash2 != 0 && hash1 != hash2) {
+            return 0;
+        }
+    }
+
+    return memcmp(cstr_pointer_from_vm_pointer_t(state, str1 + sizeof(vm_type_t)),
+                  cstr_pointer_from_vm_pointer_t(state, str2 + sizeof(vm_type_t)), length) == 0;
+}
+
 /**!
  * instruction: strcat
  * category: strings
@@ -49,17 +121,14 @@ INSTR(strcat) {
     vm_assert(state, stack->type == VM_TYPE_STRING, "String concatenation with non-string left operand");
     vm_assert(state, (stack - 1)->type == VM_TYPE_STRING, "String concatenation with non-string right operand");
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory,
-                                          sizeof(vm_type_t)
-                                          + strlen(cstr_pointer_from_vm_value(state, stack))
-                                          + strlen(cstr_pointer_from_vm_value(state, stack - 1))
-                                          + 1);
-    vm_type_t *ref_count = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
+    vm_type_t length1 = str_length(state, (stack - 1)->pointer_value);
+    vm_type_t length2 = str_length(state, stack->pointer_value);
+
+    vm_pointer_t reserved_mem = str_alloc(state, length1 + length2);
     char *str = vm_pointer_to_native(state->memory, reserved_mem + sizeof(vm_type_t), char*);
 
-    *ref_count = 1;
-    strcpy(str, cstr_pointer_from_vm_value(state, stack-1));
-    strcat(str, cstr_pointer_from_vm_value(state, stack));
+    memcpy(str, cstr_pointer_from_vm_value(state, stack - 1), length1);
+    memcpy(str + length1, cstr_pointer_from_vm_value(state, stack), length2);
 
     release(state, stack);
     release(state, stack - 1);
@@ -91,7 +160,7 @@ INSTR(substr) {
     vm_type_signed_t start = (stack - 1)->int_value;
     vm_type_signed_t length = stack->int_value;
 
-    vm_type_signed_t orig_length = (vm_type_signed_t) strlen(cstr_pointer_from_vm_value(state, stack - 2));
+    vm_type_signed_t orig_length = (vm_type_signed_t) str_length(state, (stack - 2)->pointer_value);
 
     if (start < 0) {
         start = orig_length + start + 1;
@@ -102,18 +171,17 @@ INSTR(substr) {
         if (length < 0) length = 0;
     }
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory,
-                                          sizeof(vm_type_t)
-                                          + length
-                                          + 1);
-    vm_type_t *ref_count = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
-    char *str = vm_pointer_to_native(state->memory, reserved_mem + sizeof(vm_type_t), char*);
+    if (orig_length - start <= 0) {
+        length = 0;
+    } else if (length > orig_length - start) {
+        length = orig_length - start;
+    }
 
-    *ref_count = 1;
+    vm_pointer_t reserved_mem = str_alloc(state, (vm_type_t) length);
+    char *str = vm_pointer_to_native(state->memory, reserved_mem + sizeof(vm_type_t), char*);
 
-    str[0] = '\0';
-    if (orig_length - start > 0) {
-        strncat(str, cstr_pointer_from_vm_value(state, stack - 2) + start, length);
+    if (length > 0) {
+        memcpy(str, cstr_pointer_from_vm_value(state, stack - 2) + start, (size_t) length);
     }
 
     release(state, stack - 2);
@@ -139,7 +207,7 @@ INSTR(strlen) {
     USE_STACK();
     vm_assert(state, stack->type == VM_TYPE_STRING, "Can't get string length from non-string value");
 
-    vm_type_t len = (vm_type_t) strlen(cstr_pointer_from_vm_value(state, stack));
+    vm_type_t len = str_length(state, stack->pointer_value);
     release(state, stack);
     stack->uint_value = len;
     stack->type = VM_TYPE_UINT;
@@ -157,15 +225,9 @@ INSTR(strlen) {
  */
 int conv_str_rel(CPU_State *state, vm_type_signed_t rel) {
     USE_STACK();
-    vm_pointer_t reserved_mem = vm_malloc(state->memory,
-                                          sizeof(vm_type_t)
-                                          + 32
-                                          + 1);
-    vm_type_t *ref_count = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
+    vm_pointer_t reserved_mem = str_alloc(state, 32);
     char *str = vm_pointer_to_native(state->memory, reserved_mem + sizeof(vm_type_t), char*);
 
-    *ref_count = 1;
-
     switch ((stack + rel)->type) {
         case VM_TYPE_UINT:
             sprintf(str, "%llu", (unsigned long long) (stack + rel)->uint_value);
@@ -181,8 +243,8 @@ int conv_str_rel(CPU_State *state, vm_type_signed_t rel) {
             break;
         }
         case VM_TYPE_STRING:
-            vm_free(state->memory, reserved_mem);
-            break;
+            str_free(state, reserved_mem);
+            return 0;
         case VM_TYPE_EMPTY: {
             strcpy(str, "");
             (stack + rel)->pointer_value = reserved_mem;
@@ -211,7 +273,7 @@ int conv_str_rel(CPU_State *state, vm_type_signed_t rel) {
                 state->pc = addr;
 
                 *stack = (vm_value_t) { .type = VM_TYPE_UINT, .uint_value = num_args };
-                vm_free(state->memory, reserved_mem);
+                str_free(state, reserved_mem);
                 return 1;
             } else {
                 strcpy(str, "(map)");
@@ -224,11 +286,12 @@ int conv_str_rel(CPU_State *state, vm_type_signed_t rel) {
             //break;
         case VM_TYPE_UNKNOWN:
         default:
-            vm_free(state->memory, reserved_mem);
+            str_free(state, reserved_mem);
             vm_error(state, "Top of stack is of unknown type, can't convert to INT");
             vm_exit(state, EXIT_FAILURE);
     }
     (stack + rel)->type = VM_TYPE_STRING;
+    str_header(state, reserved_mem)->length = (vm_type_t) strlen(str);
 
     return 0;
 }
@@ -259,10 +322,7 @@ void str_eq(CPU_State *state) {
         if (conv_str_rel(state, -1)) return;
     }
 
-    const char *str1 = cstr_pointer_from_vm_value(state, stack - 1);
-    const char *str2 = cstr_pointer_from_vm_value(state, stack);
-
-    vm_type_signed_t eq = strcmp(str1, str2) == 0;
+    vm_type_signed_t eq = str_equals(state, (stack - 1)->pointer_value, stack->pointer_value);
 
     release(state, stack);
     release(state, stack - 1);
@@ -281,10 +341,7 @@ void str_ne(CPU_State *state) {
     if ((stack - 1)->type != VM_TYPE_STRING) {
         if (conv_str_rel(state, -1)) return;
     }
-    const char *str1 = cstr_pointer_from_vm_value(state, stack - 1);
-    const char *str2 = cstr_pointer_from_vm_value(state, stack);
-
-    vm_type_signed_t ne = strcmp(str1, str2) != 0;
+    vm_type_signed_t ne = !str_equals(state, (stack - 1)->pointer_value, stack->pointer_value);
 
     release(state, stack);
     release(state, stack - 1);
@@ -303,7 +360,7 @@ void ld_arrelem_str(CPU_State *state) {
     vm_type_signed_t index = stack->int_value;
 
     const char *str = (const char*)cstr_pointer_from_vm_value(state, stack - 1);
-    vm_type_t len = (vm_type_t)strlen(str);
+    vm_type_t len = str_length(state, (stack - 1)->pointer_value);
 
     // Negative index is index from end
     if (index < 0) index = len + index;
@@ -330,7 +387,7 @@ void st_arrelem_str(CPU_State *state) {
     vm_type_signed_t index = stack->int_value;
 
     char *str = cstr_pointer_from_vm_value(state, stack - 1);
-    vm_type_t len = (vm_type_t)strlen(str);
+    vm_type_t len = str_length(state, (stack - 1)->pointer_value);
 
     // Negative index is index from end
     if (index < 0) index = len + index;
@@ -340,19 +397,17 @@ void st_arrelem_str(CPU_State *state) {
         vm_exit(state, EXIT_FAILURE);
     }
 
+    if (is_atom(state, (stack - 1)->pointer_value)) {
+        vm_error(state, "Error: string is a constant or a map key and can not be modified");
+        vm_exit(state, EXIT_FAILURE);
+    }
+
     if (index > len - 1) {
-        vm_pointer_t reserved_mem = vm_malloc(state->memory,
-                                              sizeof(vm_type_t)
-                                              + index + 1
-                                              + 1);
-        vm_type_t *ref_count = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
+        vm_pointer_t reserved_mem = str_alloc(state, (vm_type_t) index + 1);
         char *str2 = vm_pointer_to_native(state->memory, reserved_mem + sizeof(vm_type_t), char*);
 
-        *ref_count = 1;
-        strcpy(str2, str);
-        for (int i = 0; i < index - (len - 1); i++) {
-            strcat(str2, " ");
-        }
+        memcpy(str2, str, len);
+        memset(str2 + len, ' ', index + 1 - len);
         str = str2;
         release(state, stack - 1);
 
@@ -360,6 +415,13 @@ void st_arrelem_str(CPU_State *state) {
     }
 
     str[index] = (char)((stack - 2)->uint_value);
+    if (str_has_header(state, (stack - 1)->pointer_value)) {
+        vm_string_header_t *header = str_header(state, (stack - 1)->pointer_value);
+        header->hash = 0;
+        if (str[index] == '\0') {
+            header->length = (vm_type_t) index;
+        }
+    }
 
     release(state, stack - 1); // release the string
     AJS_STACK(-3);
@@ -385,15 +447,11 @@ void arr_slice_str(CPU_State *state) {
 vm_value_t vm_create_string(CPU_State *state, const char* c_str) {
     USE_STACK();
 
-    vm_pointer_t reserved_mem = vm_malloc(state->memory,
-                                          sizeof(vm_type_t)
-                                          + strlen(c_str)
-                                          + 1);
-    vm_type_t *ref_count = vm_pointer_to_native(state->memory, reserved_mem, vm_type_t*);
+    vm_type_t length = (vm_type_t) strlen(c_str);
+    vm_pointer_t reserved_mem = str_alloc(state, length);
     char *str = vm_pointer_to_native(state->memory, reserved_mem + sizeof(vm_type_t), char*);
 
-    *ref_count = 1;
-    strcpy(str, c_str);
+    memcpy(str, c_str, length);
 
     return (vm_value_t) {
         .type = VM_TYPE_STRING,
@@ -9,7 +9,7 @@
 #include "../error_handling.h"
 
 void NOT_IMPLEMENTED(CPU_State* s) {
-    int opcode = 0; // TODO
+    int opcode = s->instr->opcode;
     vm_error(s, "Fatal: opcode %#02X is not implemented", opcode);
     vm_exit(s, EXIT_FAILURE);
 }
@@ -114,9 +114,9 @@ Instruction_Implementation instruction_implementations[256] = {
         /* 0x60 */    &instr_strcat,
         /* 0x61 */    &instr_substr,
         /* 0x62 */    &instr_strlen,
-        /* 0x63 */    &NOT_IMPLEMENTED,
-        /* 0x64 */    &NOT_IMPLEMENTED,
-        /* 0x65 */    &NOT_IMPLEMENTED,
+        /* 0x63 */    &instr_fiber_spawn,
+        /* 0x64 */    &instr_fiber_yield,
+        /* 0x65 */    &instr_fiber_join,
         /* 0x66 */    &NOT_IMPLEMENTED,
         /* 0x67 */    &instr_arr_copy,
         /* 0x68 */    &instr_ld_arr,
@@ -145,7 +145,7 @@ Instruction_Implementation instruction_implementations[256] = {
         /* 0x7F */    &NOT_IMPLEMENTED,
         /* 0x80 */    &instr_conv_arr,
         /* 0x81 */    &instr_arr_range,
-        /* 0x82 */    &NOT_IMPLEMENTED,
+        /* 0x82 */    &instr_arr_reserve,
         /* 0x83 */    &NOT_IMPLEMENTED,
         /* 0x84 */    &NOT_IMPLEMENTED,
         /* 0x85 */    &NOT_IMPLEMENTED,
@@ -273,3 +273,348 @@ Instruction_Implementation instruction_implementations[256] = {
         /* 0xFF */    &NOT_IMPLEMENTED
 };
 
+/*
+ * Number of vm_type_t operands that follow each opcode in the bytecode. var (0x2E) is the only instruction with an
+ * irregular length; it reserves room for a vm_value_t and is special-cased in decode_instruction.
+ */
+unsigned char instruction_operand_counts[256] = {
+        /* 0x00 */    0,    // nop
+        /* 0x01 */    0,    // halt
+        /* 0x02 */    1,    // trap
+        /* 0x03 */    1,    // int
+        /* 0x04 */    1,    // link
+        /* 0x05 */    0,    // debug_break
+        /* 0x06 */    3,    // debug_setcontext
+        /* 0x07 */    1,    // debug_enterscope
+        /* 0x08 */    0,    // debug_leavescope
+        /* 0x09 */    1,    // unlink
+        /* 0x0A */    0,
+        /* 0x0B */    0,    // syscall_getindex_pop
+        /* 0x0C */    1,    // syscall_getindex
+        /* 0x0D */    1,    // syscall_byname
+        /* 0x0E */    1,    // syscall
+        /* 0x0F */    0,    // syscall_pop
+        /* 0x10 */    1,    // ld_int
+        /* 0x11 */    1,    // ld_uint
+        /* 0x12 */    1,    // ld_float
+        /* 0x13 */    1,    // ld_str
+        /* 0x14 */    0,    // ld_map
+        /* 0x15 */    1,    // ld_local
+        /* 0x16 */    1,    // ld_reg
+        /* 0x17 */    1,    // ld_stack
+        /* 0x18 */    1,    // ld_sref
+        /* 0x19 */    1,    // st_stack
+        /* 0x1A */    1,    // ld_lref
+        /* 0x1B */    1,    // ld_ref
+        /* 0x1C */    0,    // pop
+        /* 0x1D */    1,    // st_reg
+        /* 0x1E */    1,    // st_local
+        /* 0x1F */    1,    // st_ref
+        /* 0x20 */    0,    // conv_int
+        /* 0x21 */    0,    // conv_uint
+        /* 0x22 */    0,    // conv_float
+        /* 0x23 */    0,    // conv_str
+        /* 0x24 */    0,    // cast_int
+        /* 0x25 */    0,    // cast_uint
+        /* 0x26 */    0,    // cast_float
+        /* 0x27 */    0,    // cast_str
+        /* 0x28 */    0,    // cast_ref
+        /* 0x29 */    1,    // ajs
+        /* 0x2A */    1,    // locals_res
+        /* 0x2B */    0,    // locals_cleanup
+        /* 0x2C */    0,    // dup
+        /* 0x2D */    0,    // deref
+        /* 0x2E */    0,    // var
+        /* 0x2F */    1,    // ld_deref
+        /* 0x30 */    0,    // add
+        /* 0x31 */    0,    // sub
+        /* 0x32 */    0,    // mul
+        /* 0x33 */    0,    // div
+        /* 0x34 */    0,    // mod
+        /* 0x35 */    0,    // neg
+        /* 0x36 */    0,    // and
+        /* 0x37 */    0,    // or
+        /* 0x38 */    0,    // xor
+        /* 0x39 */    0,    // not
+        /* 0x3A */    0,    // cmp
+        /* 0x3B */    0,    // eq
+        /* 0x3C */    0,    // ne
+        /* 0x3D */    0,    // lt
+        /* 0x3E */    0,    // gt
+        /* 0x3F */    0,    // le
+        /* 0x40 */    0,    // ge
+        /* 0x41 */    0,    // pow
+        /* 0x42 */    0,    // lsh
+        /* 0x43 */    0,    // rsh
+        /* 0x44 */    0,    // not_bitwise
+        /* 0x45 */    0,
+        /* 0x46 */    0,
+        /* 0x47 */    0,
+        /* 0x48 */    0,
+        /* 0x49 */    0,
+        /* 0x4A */    0,
+        /* 0x4B */    0,
+        /* 0x4C */    0,
+        /* 0x4D */    0,
+        /* 0x4E */    0,
+        /* 0x4F */    0,
+        /* 0x50 */    1,    // beq
+        /* 0x51 */    1,    // bne
+        /* 0x52 */    1,    // blt
+        /* 0x53 */    1,    // bgt
+        /* 0x54 */    1,    // ble
+        /* 0x55 */    1,    // bge
+        /* 0x56 */    1,    // jmp
+        /* 0x57 */    1,    // brfalse
+        /* 0x58 */    1,    // brtrue
+        /* 0x59 */    2,    // call
+        /* 0x5A */    1,    // call_pop
+        /* 0x5B */    0,    // jmp_pop
+        /* 0x5C */    0,    // ret
+        /* 0x5D */    1,    // args_accept
+        /* 0x5E */    0,    // args_cleanup
+        /* 0x5F */    1,    // ld_arg
+        /* 0x60 */    0,    // strcat
+        /* 0x61 */    0,    // substr
+        /* 0x62 */    0,    // strlen
+        /* 0x63 */    1,    // fiber_spawn
+        /* 0x64 */    0,    // fiber_yield
+        /* 0x65 */    0,    // fiber_join
+        /* 0x66 */    0,
+        /* 0x67 */    0,    // arr_copy
+        /* 0x68 */    1,    // ld_arr
+        /* 0x69 */    0,    // ld_arrelem
+        /* 0x6A */    0,    // st_arrelem
+        /* 0x6B */    0,    // del_arrelem
+        /* 0x6C */    0,    // arr_len
+        /* 0x6D */    0,    // arr_insert
+        /* 0x6E */    0,    // arr_slice
+        /* 0x6F */    0,    // arr_concat
+        /* 0x70 */    0,    // cmp_id
+        /* 0x71 */    0,    // eq_id
+        /* 0x72 */    0,    // ne_id
+        /* 0x73 */    0,    // lt_id
+        /* 0x74 */    0,    // gt_id
+        /* 0x75 */    0,    // le_id
+        /* 0x76 */    0,    // ge_id
+        /* 0x77 */    1,    // st_addr
+        /* 0x78 */    0,    // swp
+        /* 0x79 */    1,    // ld_addr
+        /* 0x7A */    1,    // st_arg
+        /* 0x7B */    0,
+        /* 0x7C */    0,
+        /* 0x7D */    0,
+        /* 0x7E */    0,
+        /* 0x7F */    0,
+        /* 0x80 */    0,    // conv_arr
+        /* 0x81 */    0,    // arr_range
+        /* 0x82 */    0,    // arr_reserve
+        /* 0x83 */    0,
+        /* 0x84 */    0,
+        /* 0x85 */    0,
+        /* 0x86 */    0,
+        /* 0x87 */    0,
+        /* 0x88 */    0,
+        /* 0x89 */    0,
+        /* 0x8A */    0,
+        /* 0x8B */    0,
+        /* 0x8C */    0,
+        /* 0x8D */    0,
+        /* 0x8E */    0,
+        /* 0x8F */    0,
+        /* 0x90 */    2,    // ld_extern
+        /* 0x91 */    0,    // ld_empty
+        /* 0x92 */    0,    // st_stack_pop
+        /* 0x93 */    0,    // st_arg_pop
+        /* 0x94 */    0,
+        /* 0x95 */    0,
+        /* 0x96 */    0,
+        /* 0x97 */    0,
+        /* 0x98 */    0,
+        /* 0x99 */    0,
+        /* 0x9A */    0,
+        /* 0x9B */    0,
+        /* 0x9C */    0,
+        /* 0x9D */    0,
+        /* 0x9E */    0,
+        /* 0x9F */    0,
+        /* 0xA0 */    0,    // is_int
+        /* 0xA1 */    0,    // is_uint
+        /* 0xA2 */    0,    // is_float
+        /* 0xA3 */    0,    // is_str
+        /* 0xA4 */    0,    // is_arr
+        /* 0xA5 */    0,    // is_map
+        /* 0xA6 */    0,    // is_ref
+        /* 0xA7 */    0,    // is_empty
+        /* 0xA8 */    0,
+        /* 0xA9 */    0,
+        /* 0xAA */    0,
+        /* 0xAB */    0,
+        /* 0xAC */    0,
+        /* 0xAD */    0,
+        /* 0xAE */    0,
+        /* 0xAF */    0,
+        /* 0xB0 */    1,    // ld_mapitem
+        /* 0xB1 */    0,    // ld_mapitem_pop
+        /* 0xB2 */    1,    // st_mapitem
+        /* 0xB3 */    0,    // st_mapitem_pop
+        /* 0xB4 */    1,    // del_mapitem
+        /* 0xB5 */    0,    // del_mapitem_pop
+        /* 0xB6 */    1,    // has_mapitem
+        /* 0xB7 */    0,    // has_mapitem_pop
+        /* 0xB8 */    0,    // map_len
+        /* 0xB9 */    0,    // map_merge
+        /* 0xBA */    0,    // map_copy
+        /* 0xBB */    0,    // map_getprototype
+        /* 0xBC */    0,    // map_setprototype
+        /* 0xBD */    0,    // box
+        /* 0xBE */    0,    // unbox
+        /* 0xBF */    1,    // ld_boxingproto
+        /* 0xC0 */    2,    // map_renamekey
+        /* 0xC1 */    0,    // map_renamekey_pop
+        /* 0xC2 */    0,    // map_getkeys
+        /* 0xC3 */    0,
+        /* 0xC4 */    0,
+        /* 0xC5 */    0,
+        /* 0xC6 */    0,
+        /* 0xC7 */    0,
+        /* 0xC8 */    0,
+        /* 0xC9 */    0,
+        /* 0xCA */    0,
+        /* 0xCB */    0,
+        /* 0xCC */    0,
+        /* 0xCD */    0,
+        /* 0xCE */    0,
+        /* 0xCF */    0,
+        /* 0xD0 */    0,    // link_pop
+        /* 0xD1 */    0,    // unlink_pop
+        /* 0xD2 */    0,    // mod_exists
+        /* 0xD3 */    0,    // mod_isloaded
+        /* 0xD4 */    0,
+        /* 0xD5 */    0,
+        /* 0xD6 */    0,
+        /* 0xD7 */    0,
+        /* 0xD8 */    0,
+        /* 0xD9 */    0,
+        /* 0xDA */    0,
+        /* 0xDB */    0,
+        /* 0xDC */    0,
+        /* 0xDD */    0,
+        /* 0xDE */    0,
+        /* 0xDF */    0,
+        /* 0xE0 */    0,
+        /* 0xE1 */    0,
+        /* 0xE2 */    0,
+        /* 0xE3 */    0,
+        /* 0xE4 */    0,
+        /* 0xE5 */    0,
+        /* 0xE6 */    0,
+        /* 0xE7 */    0,
+        /* 0xE8 */    0,
+        /* 0xE9 */    0,
+        /* 0xEA */    0,
+        /* 0xEB */    0,
+        /* 0xEC */    0,
+        /* 0xED */    0,
+        /* 0xEE */    0,
+        /* 0xEF */    0,
+        /* 0xF0 */    0,
+        /* 0xF1 */    0,
+        /* 0xF2 */    0,
+        /* 0xF3 */    0,
+        /* 0xF4 */    0,
+        /* 0xF5 */    0,
+        /* 0xF6 */    0,
+        /* 0xF7 */    0,
+        /* 0xF8 */    0,
+        /* 0xF9 */    0,
+        /* 0xFA */    0,
+        /* 0xFB */    0,
+        /* 0xFC */    0,
+        /* 0xFD */    0,
+        /* 0xFE */    0,
+        /* 0xFF */    0,
+};
+
+/*
+ * Operands that hold an offset into the module (branch targets, static strings, static data) rather than a value.
+ * decode_instruction relocates these to absolute addresses, so the implementations never have to look up the module
+ * they are running in.
+ */
+#define RELOC(N) (1u << (N))
+unsigned char instruction_relocations[256] = {
+        [0x04] = RELOC(0),              // link
+        [0x06] = RELOC(0),              // debug_setcontext
+        [0x07] = RELOC(0),              // debug_enterscope
+        [0x09] = RELOC(0),              // unlink
+        [0x0C] = RELOC(0),              // syscall_getindex
+        [0x0D] = RELOC(0),              // syscall_byname
+        [0x13] = RELOC(0),              // ld_str
+        [0x1B] = RELOC(0),              // ld_ref
+        [0x1F] = RELOC(0),              // st_ref
+        [0x2F] = RELOC(0),              // ld_deref
+        [0x50] = RELOC(0),              // beq
+        [0x51] = RELOC(0),              // bne
+        [0x52] = RELOC(0),              // blt
+        [0x53] = RELOC(0),              // bgt
+        [0x54] = RELOC(0),              // ble
+        [0x55] = RELOC(0),              // bge
+        [0x56] = RELOC(0),              // jmp
+        [0x57] = RELOC(0),              // brfalse
+        [0x58] = RELOC(0),              // brtrue
+        [0x59] = RELOC(0),              // call
+        [0x90] = RELOC(0) | RELOC(1),   // ld_extern
+        [0xB0] = RELOC(0),              // ld_mapitem
+        [0xB2] = RELOC(0),              // st_mapitem
+        [0xB4] = RELOC(0),              // del_mapitem
+        [0xB6] = RELOC(0),              // has_mapitem
+        [0xC0] = RELOC(0) | RELOC(1),   // map_renamekey
+};
+#undef RELOC
+
+/*
+ * Implementation of the record that stands in for instructions that have not been decoded yet: decode the one at pc,
+ * then run it as if it had been decoded all along.
+ */
+void instr_undecoded(CPU_State *state) {
+    vm_instruction_t *instr = cpu_decode(state, state->pc - 1);
+    state->instr = instr;
+    state->operands = instr->operands;
+    instr->impl(state);
+}
+
+/**
+ * Decodes the instruction at bytes into instr. The operands are copied out of the bytecode so handlers never have to
+ * touch the (possibly unaligned) bytes again, and module-relative operands are relocated against module_addr.
+ * @return the length of the instruction in bytes, or 0 if the opcode is not a valid instruction
+ */
+unsigned char decode_instruction(const unsigned char *bytes, vm_pointer_t module_addr, vm_instruction_t *instr) {
+    unsigned char opcode = bytes[0];
+    unsigned char num_operands = instruction_operand_counts[opcode];
+
+    instr->opcode = opcode;
+    instr->impl = instruction_implementations[opcode];
+
+#if defined(VM_QUICKENING) && VM_QUICKENING
+    if (quick_site(opcode) >= 0) {
+        // start out generic, instr_quicken specializes the record once it has seen the operand types
+        instr->impl = &instr_quicken;
+        instr->operands[0].uint_value = 0; // number of deoptimizations
+    }
+#endif
+
+    if (opcode == VM_INSTR_VAR) {
+        instr->length = sizeof(vm_value_t);
+    } else {
+        instr->length = (unsigned char) (1 + num_operands * sizeof(vm_type_t));
+    }
+
+    for (int i = 0; i < num_operands; i++) {
+        instr->operands[i].uint_value = *(vm_type_t *) (bytes + 1 + i * sizeof(vm_type_t));
+        if (instruction_relocations[opcode] & (1u << i)) {
+            instr->operands[i].uint_value += module_addr;
+        }
+    }
+
+    return instr->impl == &NOT_IMPLEMENTED ? 0 : instr->length;
+}
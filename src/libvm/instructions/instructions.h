@@ -14,18 +14,74 @@
 typedef void (*Instruction_Implementation)(CPU_State *state);    /* A pointer to a handler function */
 
 extern Instruction_Implementation instruction_implementations[256];
+extern unsigned char instruction_operand_counts[256];
+extern unsigned char instruction_relocations[256];
+
+#define VM_INSTR_VAR 0x2E
+#define VM_INSTR_LD_EXTERN 0x90
+
+// Decoded instructions can carry opcodes that have no bytecode encoding; they are numbered from 0x100
+#define VM_OPCODE_UNDECODED         0x100
+#define VM_OPCODE_LOCAL_ADD_INT     0x101   // ld.local; ld.int; add; st.local
+#define VM_OPCODE_LOCAL_SUB_INT     0x102   // ld.local; ld.int; sub; st.local
+#define VM_OPCODE_BR_LOCAL_LOCAL    0x103   // ld.local; ld.local; eq..ge; brfalse/brtrue, (compare - eq) * 2 + brtrue
+#define VM_OPCODE_BR_LOCAL_INT      0x10F   // ld.local; ld.int; eq..ge; brfalse/brtrue, same layout
+#define VM_OPCODE_QUICK_INT         0x11B   // add, sub, mul, div, eq..ge on two ints, see quick_generic_opcodes
+#define VM_OPCODE_QUICK_FLOAT       0x125   // the same on two floats
+#define VM_OPCODE_LD_EXTERN_RESOLVED 0x12F  // ld.extern that found its symbol, loads the address in operand 2
+#define VM_NUM_OPCODES              0x130
+
+#define VM_FIRST_SUPERINSTRUCTION   VM_OPCODE_LOCAL_ADD_INT
+#define VM_NUM_SUPERINSTRUCTIONS    (VM_OPCODE_QUICK_INT - VM_FIRST_SUPERINSTRUCTION)
+#define VM_NUM_QUICK_SITES          (VM_OPCODE_QUICK_FLOAT - VM_OPCODE_QUICK_INT)
+
+// a site that had to fall back to the generic instruction this many times is not quickened again
+#define VM_QUICKEN_MAX_DEOPTS       4
+
+// every superinstruction covers three instructions with one operand and one without
+#define SUPERINSTRUCTION_LENGTH     (3 * (1 + sizeof(vm_type_t)) + 1)
+
+extern Instruction_Implementation superinstruction_implementations[VM_NUM_SUPERINSTRUCTIONS];
+extern const char *superinstruction_names[VM_NUM_SUPERINSTRUCTIONS];
+void fuse_instructions(Module *module);
+
+extern unsigned char quick_generic_opcodes[VM_NUM_QUICK_SITES];
+int quick_site(unsigned short opcode);
+void instr_quicken(CPU_State *state);
+
+#define VM_UNDECODED_INSTRUCTION ((vm_instruction_t) { .impl = &instr_undecoded, .opcode = VM_OPCODE_UNDECODED, .length = 0 })
+
+void instr_undecoded(CPU_State *state);
+
+unsigned char decode_instruction(const unsigned char *bytes, vm_pointer_t module_addr, vm_instruction_t *instr);
 
 #define INSTR_NOT_IMPLEMENTED(name) void instr_##name (CPU_State* s) { vm_error(s, "Fatal: opcode '%s' is not implemented", #name); vm_exit(s, EXIT_FAILURE); }
 #define INSTR(name) void instr_##name (CPU_State* state)
-#define GET_OPERAND() (state->pc += sizeof(vm_type_t), *(vm_type_t*)(state->memory->main_memory + state->pc - sizeof(vm_type_t)))
-#define GET_OPERAND_SIGNED() (state->pc += sizeof(vm_type_signed_t), *(vm_type_signed_t*)(state->memory->main_memory + state->pc - sizeof(vm_type_signed_t)))
-#define GET_OPERAND_FLOAT() (state->pc += sizeof(vm_type_float_t), *(vm_type_float_t*)(state->memory->main_memory + state->pc - sizeof(vm_type_float_t)))
+// operands are read from the decoded instruction, but pc still moves past them in the bytecode
+#define GET_OPERAND() (state->pc += sizeof(vm_type_t), (state->operands++)->uint_value)
+#define GET_OPERAND_SIGNED() (state->pc += sizeof(vm_type_signed_t), (state->operands++)->int_value)
+#define GET_OPERAND_FLOAT() (state->pc += sizeof(vm_type_float_t), (state->operands++)->float_value)
 
 #define USE_STACK() vm_value_t *stack = ((vm_value_t *)(state->memory->main_memory + state->sp))
 #define AJS_STACK(n) { state->sp += sizeof(vm_value_t) * (n); }
+// Pushes are not checked one by one. Instructions that start a frame or push an unbounded number of values make sure
+// there is room for them plus VM_STACK_HEADROOM with this, and return if the stack overflowed.
+#define CHECK_STACK(n) { if (state->sp + sizeof(vm_value_t) * (n) > state->stack_limit && !cpu_grow_stack(state, n)) return; }
 #define USE_MARK() vm_value_t *mark = ((vm_value_t *)(state->memory->main_memory + state->mp))
 #define USE_ARGS() vm_value_t *args = ((vm_value_t *)(state->memory->main_memory + state->ap))
 
+static inline vm_string_header_t* str_header(CPU_State *state, vm_pointer_t str_ptr) {
+    return vm_pointer_to_native(state->memory, str_ptr, vm_string_header_t*) - 1;
+}
+
+static inline void str_free(CPU_State *state, vm_pointer_t str_ptr) {
+    vm_free(state->memory, str_ptr - sizeof(vm_string_header_t));
+}
+
+vm_pointer_t str_alloc(CPU_State *state, vm_type_t length);
+vm_type_t str_length(CPU_State *state, vm_pointer_t str_ptr);
+vm_type_t str_hash(CPU_State *state, vm_pointer_t str_ptr);
+
 int is_ptr_in_static_memory(CPU_State *state, vm_value_t *val);
 int conv_str_rel(CPU_State *state, vm_type_signed_t rel);
 void str_eq(CPU_State *state);
@@ -34,6 +90,8 @@ void ld_arrelem_str(CPU_State *state);
 void st_arrelem_str(CPU_State *state);
 void arr_slice_str(CPU_State *state);
 
+vm_pointer_t arr_create(CPU_State *state, vm_type_t length);
+void arr_reserve(CPU_State *state, vm_pointer_t ptr, vm_type_t capacity);
 void arr_release(CPU_State* state, vm_pointer_t ptr);
 void arr_insert_at(CPU_State *state, vm_value_t *arrayval, vm_value_t *value, vm_type_signed_t index);
 vm_type_t arr_len(CPU_State *state, vm_value_t *arrayval);
@@ -41,8 +99,29 @@ void instr_conv_arr_rel(CPU_State* state, vm_type_signed_t rel);
 void arr_eq(CPU_State *state);
 void arr_ne(CPU_State *state);
 
+#define MAP_ENTRIES(TABLE) ((vm_map_elem_t*) ((TABLE) + 1))
+#define MAP_INDEX(TABLE) ((vm_type_t*) (MAP_ENTRIES(TABLE) + (TABLE)->capacity))
+
+static inline vm_map_table_t* map_table(CPU_State *state, vm_pointer_t map_ptr) {
+    vm_pointer_t table_ptr = *(vm_pointer_to_native(state->memory, map_ptr, vm_pointer_t*) + 1);
+    return table_ptr == 0 ? NULL : vm_pointer_to_native(state->memory, table_ptr, vm_map_table_t*);
+}
+
+vm_type_t map_hash(const char *name);
+vm_pointer_t map_key(CPU_State *state, vm_pointer_t str_ptr, vm_type_t *hash);
+vm_pointer_t map_key_intern(CPU_State *state, vm_pointer_t str_ptr, vm_type_t *hash);
+vm_map_elem_t* map_find(CPU_State *state, vm_map_table_t *table, vm_pointer_t key, vm_type_t hash);
+vm_map_elem_t* map_lookup(CPU_State *state, vm_pointer_t map_ptr, vm_pointer_t key, vm_type_t hash);
+void map_append(CPU_State *state, vm_map_table_t *table, vm_pointer_t key, vm_type_t hash, vm_value_t* value,
+                vm_type_t shape);
+void map_store(CPU_State *state, vm_pointer_t map_ptr, vm_pointer_t key, vm_type_t hash, vm_value_t* value);
+vm_type_t map_shape_transition(CPU_State *state, vm_type_t shape, vm_pointer_t key, vm_type_t hash);
+void map_shapes_destroy(CPU_State *state);
+void assign_map_caches(Module *module, const byte_t *native_module_addr);
+vm_pointer_t map_create(CPU_State *state, vm_type_t ref_count, vm_pointer_t prototype);
+void map_reserve(CPU_State *state, vm_pointer_t map_ptr, vm_type_t capacity);
 void map_release(CPU_State* state, vm_pointer_t ptr);
-vm_type_t map_contains_key(CPU_State *state, vm_pointer_t map_ptr, const char* name);
+vm_type_t map_contains_key(CPU_State *state, vm_pointer_t map_ptr, vm_pointer_t str_ptr);
 vm_map_elem_t* ld_mapitem(CPU_State *state, vm_pointer_t map_ptr, const char* name);
 void ld_arrelem_map(CPU_State *state);
 void st_arrelem_map(CPU_State *state);
@@ -158,6 +237,10 @@ INSTR(strcat);
 INSTR(substr);
 INSTR(strlen);
 
+INSTR(fiber_spawn);
+INSTR(fiber_yield);
+INSTR(fiber_join);
+
 INSTR(ld_arr);
 INSTR(ld_arrelem);
 INSTR(st_arrelem);
@@ -169,8 +252,10 @@ INSTR(arr_concat);
 INSTR(arr_copy);
 INSTR(conv_arr);
 INSTR(arr_range);
+INSTR(arr_reserve);
 
 INSTR(ld_extern);
+INSTR(ld_extern_resolved);
 
 INSTR(is_int);
 INSTR(is_uint);
@@ -183,8 +268,10 @@ INSTR(is_empty);
 
 INSTR(ld_mapitem);
 INSTR(ld_mapitem_pop);
+INSTR(ld_mapitem_cached);
 INSTR(st_mapitem);
 INSTR(st_mapitem_pop);
+INSTR(st_mapitem_cached);
 INSTR(del_mapitem);
 INSTR(del_mapitem_pop);
 INSTR(has_mapitem);
@@ -105,21 +105,20 @@ struct liballoc_minor
 };
 
 
-static struct liballoc_major* l_memRoot = NULL;		///< The root memory block acquired from the system.
-static struct liballoc_major* l_bestBet = NULL; 	///< The major with the most free memory.
-
 static const liballoc_uint l_pageSize  = 4096;		///< The size of an individual page. Set up in liballoc_init.
 static const liballoc_uint l_pageCount = 16;			///< The number of pages to request per chunk. Set up in liballoc_init.
-static unsigned long long l_allocated = 0;	///< Running total of allocated memory.
-static unsigned long long l_inuse	 = 0;		///< Running total of used memory.
-
 
-static long long l_warningCount = 0;		///< Number of warnings encountered
-static long long l_errorCount = 0;			///< Number of actual errors
-static long long l_possibleOverruns = 0;	///< Number of possible overruns
+// the rest of the state belongs to the Memory being allocated from, see vm_allocator_t
+#define l_memRoot           (mem->allocator.mem_root)
+#define l_bestBet           (mem->allocator.best_bet)
+#define l_allocated         (mem->allocator.allocated)
+#define l_inuse             (mem->allocator.inuse)
+#define l_warningCount      (mem->allocator.warning_count)
+#define l_errorCount        (mem->allocator.error_count)
+#define l_possibleOverruns  (mem->allocator.possible_overruns)
 
 
-void liballoc_reset() {
+void liballoc_reset(Memory *mem) {
 	l_memRoot = NULL;
 	l_bestBet = NULL;
 
@@ -131,6 +130,29 @@ void liballoc_reset() {
 	l_possibleOverruns = 0;
 }
 
+#define RELOCATE(ptr, delta) ((ptr) = (ptr) == NULL ? NULL : (void*) ((char*) (ptr) + (delta)))
+
+/*
+ * The blocks link to each other with native pointers, which no longer hold once the heap is at another address, like
+ * a heap restored from a snapshot (see snapshot.c). This moves all of them by delta bytes. The heap must already be at
+ * its new address.
+ */
+void liballoc_relocate(Memory *mem, ptrdiff_t delta) {
+	RELOCATE(l_memRoot, delta);
+	RELOCATE(l_bestBet, delta);
+
+	for (struct liballoc_major *maj = l_memRoot; maj != NULL; maj = maj->next) {
+		RELOCATE(maj->prev, delta);
+		RELOCATE(maj->next, delta);
+		RELOCATE(maj->first, delta);
+		for (struct liballoc_minor *min = maj->first; min != NULL; min = min->next) {
+			RELOCATE(min->prev, delta);
+			RELOCATE(min->next, delta);
+			RELOCATE(min->block, delta);
+		}
+	}
+}
+
 
 // ***********   HELPER FUNCTIONS  *******************************
 
@@ -169,7 +191,7 @@ static void* liballoc_memcpy(void* s1, const void* s2, size_t n)
 
 
 #if defined DEBUG || defined INFO
-static void liballoc_dump()
+static void liballoc_dump(Memory *mem)
 {
 #ifdef DEBUG
 	struct liballoc_major *maj = l_memRoot;
@@ -309,7 +331,6 @@ void *PREFIX(malloc)(Memory * mem, size_t req_size)
 		#ifdef DEBUG
 		printf( "liballoc: initialization of liballoc " VERSION "\n" );
 		#endif
-		atexit( liballoc_dump );
 		FLUSH();
 		#endif
 
@@ -606,7 +627,7 @@ void *PREFIX(malloc)(Memory * mem, size_t req_size)
 	#endif
 	#if defined DEBUG || defined INFO
 	printf( "liballoc: WARNING: PREFIX(malloc)( %i ) returning NULL.\n", size);
-	liballoc_dump();
+	liballoc_dump(mem);
 	FLUSH();
 	#endif
 	return NULL;
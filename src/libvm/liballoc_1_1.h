@@ -11,6 +11,7 @@
 /** @{ */
 
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "funkyvm/cpu.h"
 
@@ -20,13 +21,14 @@
 //typedef	unsigned long	uintptr_t;
 
 //This lets you prefix malloc and friends
-#define PREFIX(func)		k_ ## func
+#define PREFIX(func)		la_ ## func
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void liballoc_reset();
+void liballoc_reset(Memory *mem);
+void liballoc_relocate(Memory *mem, ptrdiff_t delta);
 
 /** This function is supposed to lock the memory data structures. It
  * could be as simple as disabling interrupts or acquiring a spinlock.
@@ -1,6 +1,5 @@
 #include <memory.h>
 #include <stdio.h>
-#include <math.h>
 #include <assert.h>
 #include "funkyvm/funkyvm.h"
 #include "funkyvm/memory.h"
@@ -11,63 +10,168 @@
 
 #else
 #include "liballoc_1_1.h"
+#include "slab.h"
+#include "os.h"
 #endif
 
-#define SET_BIT(var, bit) var |= (1 << bit)
-#define CLEAR_BIT(var, bit) var &= ~(1 << bit)
-#define IS_BIT_1(var, bit) ((var >> bit) & 1)
-#define IS_BIT_0(var, bit) (!IS_BIT_1(var, bit))
+// the heap grows in steps of this many bytes, which is a multiple of the page size of the OS as well
+#define VM_HEAP_GRANULE (64 * 1024)
 
-void memory_print_bitmap_debug(Memory *mem) {
-    for (unsigned int i = 0; i < mem->bitmap_size / sizeof (unsigned long); i++) {
-        printf("%4d: %016lX\n", i * 8, ((unsigned long*)mem->bitmap)[i]);
+#define WORD_BITS VM_BITMAP_WORD_BITS
+#define WORD_ONES (~(vm_bitmap_word_t) 0)
+
+// index of the lowest set bit of a word that is not 0
+#if defined(__GNUC__) || defined(__clang__)
+#define LOWEST_BIT(word) ((vm_type_t) __builtin_ctzl(word))
+#else
+static vm_type_t LOWEST_BIT(vm_bitmap_word_t word) {
+    vm_type_t bit = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        bit++;
     }
+    return bit;
 }
+#endif
 
-static vm_type_t bitshift = 0;
-
-void memory_set_used(Memory* mem, vm_type_t addr) {
-    vm_type_t i = addr >> bitshift;
-    vm_type_t bit = addr / VM_PAGE_SIZE % 8;
+void memory_print_bitmap_debug(Memory *mem) {
+    for (vm_type_t i = 0; i < mem->bitmap_words; i++) {
+        printf("%4u: %0*lX\n", (unsigned int) (i * WORD_BITS), (int) (WORD_BITS / 4), (unsigned long) mem->bitmap[i]);
+    }
+}
 
-    CLEAR_BIT(mem->bitmap[i], bit);
+/*
+ * Mask of the bits from..to-1 of a word, for 0 <= from < to <= WORD_BITS.
+ */
+static inline vm_bitmap_word_t bit_range(vm_type_t from, vm_type_t to) {
+    vm_bitmap_word_t mask = WORD_ONES << from;
+    return to < WORD_BITS ? mask & ~(WORD_ONES << to) : mask;
 }
 
-void memory_set_unused(Memory* mem, vm_type_t addr) {
-    vm_type_t i = addr >> bitshift;
-    vm_type_t bit = addr / VM_PAGE_SIZE % 8;
+/*
+ * Sets (free) or clears (used) the bits of pages first..first+num_pages-1, a whole word at a time where it can.
+ */
+static void memory_mark(Memory *mem, vm_type_t first, vm_type_t num_pages, int free) {
+    vm_type_t page = first, end = first + num_pages;
+    while (page < end) {
+        vm_type_t word = page / WORD_BITS, bit = page % WORD_BITS;
+        vm_type_t last = end - word * WORD_BITS < WORD_BITS ? end - word * WORD_BITS : WORD_BITS;
+        vm_bitmap_word_t mask = bit_range(bit, last);
+        if (free) {
+            mem->bitmap[word] |= mask;
+        } else {
+            mem->bitmap[word] &= ~mask;
+        }
+        page = word * WORD_BITS + last;
+    }
+}
 
-    SET_BIT(mem->bitmap[i], bit);
+/*
+ * The first page at or after page whose bit equals free, or num_pages of the heap if there is none. Whole words that
+ * do not qualify are skipped at once.
+ */
+static vm_type_t memory_find(Memory *mem, vm_type_t page, int free) {
+    vm_type_t num_pages = mem->bitmap_words * WORD_BITS;
+    while (page < num_pages) {
+        vm_type_t word = page / WORD_BITS;
+        vm_bitmap_word_t bits = (free ? mem->bitmap[word] : ~mem->bitmap[word]) & (WORD_ONES << (page % WORD_BITS));
+        if (bits != 0) {
+            return word * WORD_BITS + LOWEST_BIT(bits);
+        }
+        page = (word + 1) * WORD_BITS;
+    }
+    return num_pages;
 }
 
-void memory_init(Memory *mem, unsigned char *main_memory) {
-    #if defined(VM_NATIVE_MALLOC) && VM_NATIVE_MALLOC
-        mem->main_memory = main_memory;
-        return;
-    #else
+int memory_is_free(Memory* mem, vm_type_t addr) {
+    vm_type_t page = addr / VM_PAGE_SIZE;
+    return (mem->bitmap[page / WORD_BITS] >> (page % WORD_BITS)) & 1;
+}
 
-        assert(VM_MEMORY_LIMIT % VM_PAGE_SIZE == 0); // multiple of page size
-        assert(sizeof(vm_value_t) < VM_PAGE_SIZE); // at least one vm_value_t must fit in a page
+void memory_set_used(Memory* mem, vm_type_t addr) {
+    memory_mark(mem, addr / VM_PAGE_SIZE, 1, 0);
+}
 
-        mem->main_memory = main_memory;
+void memory_set_unused(Memory* mem, vm_type_t addr) {
+    memory_mark(mem, addr / VM_PAGE_SIZE, 1, 1);
+}
 
-        mem->bitmap_size = VM_MEMORY_LIMIT / 8 / VM_PAGE_SIZE;
+#if !defined(VM_NATIVE_MALLOC) || !VM_NATIVE_MALLOC
+static void memory_setup(Memory *mem, unsigned char *main_memory, vm_type_t size, vm_type_t max_size) {
+    assert(size % VM_PAGE_SIZE == 0); // multiple of page size
+    assert(sizeof(vm_value_t) < VM_PAGE_SIZE); // at least one vm_value_t must fit in a page
 
-        unsigned char *bitmap = malloc(mem->bitmap_size);
+    mem->main_memory = main_memory;
+    mem->size = size;
+    mem->max_size = max_size;
 
-        bitshift = (vm_type_t)log2(VM_PAGE_SIZE * 8);
+    // a set bit is a free page
+    mem->bitmap_words = (size / VM_PAGE_SIZE + WORD_BITS - 1) / WORD_BITS;
+    mem->bitmap = calloc(mem->bitmap_words, sizeof(vm_bitmap_word_t));
+    memory_mark(mem, 0, size / VM_PAGE_SIZE, 1);
+    mem->first_free = 0;
 
-        mem->bitmap = bitmap;
-        memset(bitmap, 0xFF, mem->bitmap_size);
+    liballoc_reset(mem);
+    slab_reset(mem);
 
-        /*for (vm_type_t addr = 0; addr < kernel_size + VM_PAGE_SIZE - 1; addr += VM_PAGE_SIZE) {
-            memory_set_used(mem, addr);
-        }*/
+    mem->lock = 0;
+}
+#endif
 
-        liballoc_reset(); // reset the global variables from liballoc
+/*
+ * Sets up a heap of VM_MEMORY_LIMIT bytes in main_memory, which the caller allocates and frees. This heap cannot grow.
+ */
+void memory_init(Memory *mem, unsigned char *main_memory) {
+    mem->reserved = 0;
+    #if defined(VM_NATIVE_MALLOC) && VM_NATIVE_MALLOC
+        mem->main_memory = main_memory;
+        return;
+    #else
+        memory_setup(mem, main_memory, VM_MEMORY_LIMIT, VM_MEMORY_LIMIT);
+    #endif
+}
 
-        mem->lock = 0;
+/*
+ * Sets up a heap of size bytes that grows on demand up to max_size bytes. Both are rounded up to VM_HEAP_GRANULE and
+ * capped at what a vm_pointer_t can address; 0 picks VM_MEMORY_LIMIT and VM_MEMORY_MAX_LIMIT respectively. The whole
+ * range is reserved up front so the heap never moves, but only the part that is in use is committed. memory_destroy()
+ * releases it. Returns 0 if the address space could not be reserved.
+ */
+int memory_create(Memory *mem, size_t size, size_t max_size) {
+    mem->reserved = 1;
+    #if defined(VM_NATIVE_MALLOC) && VM_NATIVE_MALLOC
+        mem->main_memory = 0;
+        return 1;
+    #else
+        if (size == 0) {
+            size = VM_MEMORY_LIMIT;
+        }
+        if (max_size == 0) {
+            max_size = VM_MEMORY_MAX_LIMIT;
+        }
+        size_t limit = (size_t) VM_UNSIGNED_MAX / VM_HEAP_GRANULE * VM_HEAP_GRANULE;
+        size = (size + VM_HEAP_GRANULE - 1) / VM_HEAP_GRANULE * VM_HEAP_GRANULE;
+        max_size = (max_size + VM_HEAP_GRANULE - 1) / VM_HEAP_GRANULE * VM_HEAP_GRANULE;
+        if (max_size > limit) {
+            max_size = limit;
+        }
+        if (size > max_size) {
+            size = max_size;
+        }
+        if (!os_reserves_memory()) {
+            // the whole range would be allocated up front, so the heap keeps the size it starts out with
+            max_size = size;
+        }
 
+        unsigned char *main_memory = os_reserve_memory(max_size);
+        if (main_memory == NULL || !os_commit_memory(main_memory, size)) {
+            if (main_memory != NULL) {
+                os_release_memory(main_memory, max_size);
+            }
+            return 0;
+        }
+        memory_setup(mem, main_memory, (vm_type_t) size, (vm_type_t) max_size);
+        return 1;
     #endif
 }
 
@@ -76,31 +180,83 @@ void memory_destroy(Memory *mem) {
         return;
     #else
         free(mem->bitmap);
+        slab_destroy(mem);
+        if (mem->reserved) {
+            os_release_memory(mem->main_memory, mem->max_size);
+        }
     #endif
 }
 
-int memory_is_free(Memory* mem, vm_type_t addr) {
-    vm_type_t i = addr >> bitshift;
-    vm_type_t bit = addr / VM_PAGE_SIZE % 8;
-    return IS_BIT_1(mem->bitmap[i], bit);
+#if !defined(VM_NATIVE_MALLOC) || !VM_NATIVE_MALLOC
+/*
+ * Commits more of the reserved range so that a run of num_pages fits after the free pages at the end of the heap. The
+ * heap at least doubles each time, so a growing workload commits O(log n) times. Returns 0 if it cannot grow enough.
+ */
+static int memory_grow(Memory *mem, vm_type_t num_pages) {
+    vm_type_t old_pages = mem->size / VM_PAGE_SIZE;
+    vm_type_t tail = old_pages;
+    while (tail > 0 && memory_is_free(mem, (tail - 1) * VM_PAGE_SIZE)) {
+        tail--;
+    }
+
+    size_t needed = ((size_t) tail + num_pages) * VM_PAGE_SIZE;
+    if (needed > mem->max_size) {
+        return 0;
+    }
+    size_t size = (size_t) mem->size * 2 > needed ? (size_t) mem->size * 2 : needed;
+    size = (size + VM_HEAP_GRANULE - 1) / VM_HEAP_GRANULE * VM_HEAP_GRANULE;
+    if (size > mem->max_size) {
+        size = mem->max_size;
+    }
+
+    if (!os_commit_memory(mem->main_memory + mem->size, size - mem->size)) {
+        return 0;
+    }
+
+    vm_type_t new_pages = (vm_type_t) (size / VM_PAGE_SIZE);
+    vm_type_t words = (new_pages + WORD_BITS - 1) / WORD_BITS;
+    mem->bitmap = realloc(mem->bitmap, words * sizeof(vm_bitmap_word_t));
+    memset(mem->bitmap + mem->bitmap_words, 0, (words - mem->bitmap_words) * sizeof(vm_bitmap_word_t));
+    mem->bitmap_words = words;
+    memory_mark(mem, old_pages, new_pages - old_pages, 1);
+    slab_grow(mem, old_pages, new_pages);
+
+    mem->size = (vm_type_t) size;
+    return 1;
+}
+#else
+static int memory_grow(Memory *mem, vm_type_t num_pages) {
+    return 0;
 }
+#endif
 
+/*
+ * Finds the lowest run of num_pages free pages. The search starts at first_free, below which every page is known to
+ * be in use, and goes from one run of free pages to the next with memory_find(), so it costs a few operations per
+ * word of the bitmap rather than per page.
+ */
 vm_type_t memory_alloc(Memory* mem, vm_type_t num_pages) {
-    for (vm_type_t addr = 0; addr < VM_MEMORY_LIMIT; addr += VM_PAGE_SIZE) {
-        int found_chunk = 1;
-        for (vm_type_t i = 0; i < num_pages; i++) {
-            if (!memory_is_free(mem, addr + i * VM_PAGE_SIZE)) {
-                found_chunk = 0;
-                break;
+    do {
+        vm_type_t total = mem->size / VM_PAGE_SIZE;
+        vm_type_t page = memory_find(mem, mem->first_free, 1);
+        // the bitmap may have room for more pages than the heap has, which memory_grow() makes free later on
+        mem->first_free = page < total ? page : total;
+
+        while (page < total) {
+            vm_type_t end = memory_find(mem, page, 0);
+            if (end > total) {
+                end = total;
             }
-        }
-        if (found_chunk) {
-            for (vm_type_t i = 0; i < num_pages; i++) {
-                memory_set_used(mem, addr + i * VM_PAGE_SIZE);
+            if (end - page >= num_pages) {
+                memory_mark(mem, page, num_pages, 0);
+                if (page == mem->first_free) {
+                    mem->first_free = page + num_pages;
+                }
+                return page * VM_PAGE_SIZE;
             }
-            return addr;
+            page = memory_find(mem, end, 1);
         }
-    }
+    } while (memory_grow(mem, num_pages));
 
     vm_error(NULL, "Memory exhausted");
     vm_exit(NULL, EXIT_FAILURE);
@@ -108,8 +264,10 @@ vm_type_t memory_alloc(Memory* mem, vm_type_t num_pages) {
 }
 
 void memory_free(Memory *mem, vm_type_t addr, vm_type_t num_pages) {
-    for (vm_type_t i = 0; i < num_pages; i++) {
-        memory_set_unused(mem, addr + i * VM_PAGE_SIZE);
+    vm_type_t page = addr / VM_PAGE_SIZE;
+    memory_mark(mem, page, num_pages, 1);
+    if (page < mem->first_free) {
+        mem->first_free = page;
     }
 }
 
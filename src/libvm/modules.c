@@ -11,6 +11,12 @@
 
 #ifndef FUNKY_VM_OS_WINDOWS
 #include <unistd.h>
+#include <dirent.h>
+#endif
+
+#if defined(VM_MAPPED_MODULES) && VM_MAPPED_MODULES
+#include <fcntl.h>
+#include <sys/stat.h>
 #endif
 
 #include "funkyvm/modules.h"
@@ -18,6 +24,8 @@
 #include "funkyvm/cpu.h"
 #include "instructions/instructions.h"
 #include "error_handling.h"
+#include "atoms.h"
+#include "os.h"
 
 #define F_OK    0
 
@@ -34,10 +42,93 @@ static char *vm_strlwr(char *s) {
     return s;
 }
 
+/*
+ * Resolving a module name probes the file system once for the name itself and once for every search path, so the
+ * result is cached by name, including when the module was not found. The cache is cleared whenever a search path is
+ * added, so it never overrides a path registered later; modules that appear on disk after they were looked up are not
+ * seen until then.
+ *
+ * module_scan_paths() fills the cache up front by listing the working directory and the search paths, after which a
+ * name without a directory in it needs no probe at all: it is either in the cache or nowhere.
+ */
+
+#define MODULE_CACHE_MIN_SIZE 16
+
+static void module_cache_resize(CPU_State *state, vm_type_t size) {
+    vm_module_cache_entry_t *old_cache = state->module_cache;
+    vm_type_t old_size = state->module_cache_size;
+
+    state->module_cache = calloc(size, sizeof(vm_module_cache_entry_t));
+    state->module_cache_size = size;
+
+    for (vm_type_t i = 0; i < old_size; i++) {
+        if (old_cache[i].name == NULL) continue;
+        vm_type_t slot = old_cache[i].hash & (size - 1);
+        while (state->module_cache[slot].name != NULL) {
+            slot = (slot + 1) & (size - 1);
+        }
+        state->module_cache[slot] = old_cache[i];
+    }
+    free(old_cache);
+}
+
+static vm_module_cache_entry_t *module_cache_find(CPU_State *state, const char *name, vm_type_t hash) {
+    if (state->module_cache_size == 0) {
+        return NULL;
+    }
+
+    vm_type_t mask = state->module_cache_size - 1;
+    for (vm_type_t slot = hash & mask; state->module_cache[slot].name != NULL; slot = (slot + 1) & mask) {
+        if (state->module_cache[slot].hash == hash && strcmp(state->module_cache[slot].name, name) == 0) {
+            return &state->module_cache[slot];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Records where the module is, or NULL if it does not exist. The first result for a name is kept.
+ */
+static void module_cache_add(CPU_State *state, const char *name, vm_type_t hash, const char *filename) {
+    if (module_cache_find(state, name, hash) != NULL) {
+        return;
+    }
+
+    if ((state->num_module_cache_entries + 1) * 2 > state->module_cache_size) {
+        module_cache_resize(state, state->module_cache_size == 0 ? MODULE_CACHE_MIN_SIZE
+                                                                 : state->module_cache_size * 2);
+    }
+
+    vm_type_t mask = state->module_cache_size - 1;
+    vm_type_t slot = hash & mask;
+    while (state->module_cache[slot].name != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    state->module_cache[slot] = (vm_module_cache_entry_t) {
+            .name = strdup(name),
+            .filename = filename == NULL ? NULL : strdup(filename),
+            .hash = hash
+    };
+    state->num_module_cache_entries++;
+}
+
+void module_clear_cache(CPU_State *state) {
+    for (vm_type_t i = 0; i < state->module_cache_size; i++) {
+        free(state->module_cache[i].name);
+        free(state->module_cache[i].filename);
+    }
+    free(state->module_cache);
+    state->module_cache = NULL;
+    state->module_cache_size = 0;
+    state->num_module_cache_entries = 0;
+    state->module_paths_scanned = 0;
+}
+
 int module_register_path(CPU_State *state, const char* path) {
     state->num_module_paths++;
     state->module_paths = realloc(state->module_paths, sizeof(char*) * state->num_module_paths);
     state->module_paths[state->num_module_paths - 1] = strdup(path);
+    module_clear_cache(state);
     return state->num_module_paths;
 }
 
@@ -48,19 +139,24 @@ static const char* path_separator =
         "/";
 #endif
 
-char* module_find_filename(CPU_State *state, const char* name) {
+static int has_funk_extension(const char *name) {
+    size_t length = strlen(name);
+    if (length < 5) {
+        return 0;
+    }
+    char extension[6];
+    strcpy(extension, name + length - 5);
+    return strcmp(vm_strlwr(extension), ".funk") == 0;
+}
+
+static char* module_probe_filename(CPU_State *state, const char* name) {
     char* filename = malloc(strlen(name) + 1 + 5);
     strcpy(filename, name);
-
-    vm_strlwr(filename);
-    char *dot = strrchr(filename, '.');
-    if (dot && !strcmp(dot, ".funk")) {
-        strcpy(filename, name); // restore original casing
-    } else {
-        strcpy(filename, name); // restone original casing
+    if (!has_funk_extension(name)) {
         strcat(filename, ".funk");
     }
 
+    state->module_probes++;
     if (access(filename, F_OK) != -1) {
         // file exists
         return filename;
@@ -71,6 +167,7 @@ char* module_find_filename(CPU_State *state, const char* name) {
         strcpy(path, state->module_paths[i]);
         strcat(path, path_separator);
         strcat(path, filename);
+        state->module_probes++;
         if (access(path, F_OK) != -1) {
             // file exists
             free(filename);
@@ -82,6 +179,98 @@ char* module_find_filename(CPU_State *state, const char* name) {
     return NULL;
 }
 
+/*
+ * Returns the file of the module with the given name, which the caller frees, or NULL if there is none.
+ */
+char* module_find_filename(CPU_State *state, const char* name) {
+    vm_type_t hash = map_hash(name);
+    vm_module_cache_entry_t *entry = module_cache_find(state, name, hash);
+    if (entry != NULL) {
+        state->module_cache_hits++;
+        return entry->filename == NULL ? NULL : strdup(entry->filename);
+    }
+
+    if (state->module_paths_scanned && strchr(name, '/') == NULL && strchr(name, '\\') == NULL) {
+        module_cache_add(state, name, hash, NULL);
+        return NULL;
+    }
+
+    char *filename = module_probe_filename(state, name);
+    module_cache_add(state, name, hash, filename);
+    return filename;
+}
+
+#if !defined(FUNKY_VM_OS_WINDOWS)
+/*
+ * Adds every module in a directory to the cache: file.funk under both "file" and "file.funk", the names that
+ * module_find_filename() would look for it by.
+ */
+static void module_scan_directory(CPU_State *state, const char *path) {
+    state->module_probes++;
+    DIR *dir = opendir(path == NULL ? "." : path);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!has_funk_extension(entry->d_name)) continue;
+
+        char *filename;
+        if (path == NULL) {
+            filename = strdup(entry->d_name);
+        } else {
+            filename = malloc(strlen(path) + strlen(entry->d_name) + 2);
+            strcpy(filename, path);
+            strcat(filename, path_separator);
+            strcat(filename, entry->d_name);
+        }
+
+        module_cache_add(state, entry->d_name, map_hash(entry->d_name), filename);
+        size_t length = strlen(entry->d_name);
+        if (strcmp(entry->d_name + length - 5, ".funk") == 0) {
+            char *name = strdup(entry->d_name);
+            name[length - 5] = '\0';
+            if (!has_funk_extension(name)) {
+                module_cache_add(state, name, map_hash(name), filename);
+            }
+            free(name);
+        }
+        free(filename);
+    }
+    closedir(dir);
+}
+#endif
+
+/*
+ * Lists the working directory and every search path once and caches the modules in them, so resolving a name later
+ * does not touch the file system. Directories that do not exist are skipped. Returns 0 if directories cannot be
+ * listed on this platform, in which case names are resolved by probing as usual.
+ */
+int module_scan_paths(CPU_State *state) {
+#if defined(FUNKY_VM_OS_WINDOWS)
+    return 0;
+#else
+    module_clear_cache(state);
+    module_scan_directory(state, NULL);
+    for (int i = 0; i < state->num_module_paths; i++) {
+        module_scan_directory(state, state->module_paths[i]);
+    }
+    state->module_paths_scanned = 1;
+    return 1;
+#endif
+}
+
+void module_print_cache(CPU_State *state) {
+    vm_type_t num_missing = 0;
+    for (vm_type_t i = 0; i < state->module_cache_size; i++) {
+        if (state->module_cache[i].name != NULL && state->module_cache[i].filename == NULL) num_missing++;
+    }
+    printf("Module resolution: %lu file system probes, %lu cache hits, %u names cached (%u not found)%s\n",
+           state->module_probes, state->module_cache_hits, (unsigned int) state->num_module_cache_entries,
+           (unsigned int) num_missing, state->module_paths_scanned ? ", search paths scanned" : "");
+}
+
 int module_exists(CPU_State *state, const char* name) {
     char *filename = module_find_filename(state, name);
     if (filename != NULL) {
@@ -92,6 +281,97 @@ int module_exists(CPU_State *state, const char* name) {
     }
 }
 
+#define MODULE_HEADER_SIZE (6 + 2 * sizeof(vm_type_t))
+
+/*
+ * Checks the header of a module and fills in what it says about the module. Exits if the module cannot be loaded.
+ */
+static void module_read_header(Module *module, const char* name, funky_bytecode_t bc) {
+    module->name = strdup(name);
+
+    if (bc.length < MODULE_HEADER_SIZE) {
+        printf("%s is not a valid BSMB file\n", name);
+        vm_exit(NULL, EXIT_FAILURE);
+    }
+
+    if (bc.bytes[0] != 'f' || bc.bytes[1] != 'u' || bc.bytes[2] != 'n' || bc.bytes[3] != 'k') {
+        printf("%s is not a valid Funky bytecode file\n", name);
+        vm_exit(NULL, EXIT_FAILURE);
+    }
+
+    if ((bc.bytes[4] & FLAG_LITTLE_ENDIAN) == 0 && !IS_BIG_ENDIAN) {
+        printf("%s is compiled for big endian systems. This system is little endian.\n", name);
+        vm_exit(NULL, EXIT_FAILURE);
+    }
+
+    if (bc.bytes[5] != sizeof(vm_type_t)) {
+        printf("%s is compiled for %d virtual bits. This system is %u virtual bits.\n", name, bc.bytes[5] * 8,
+               (unsigned int) sizeof(vm_type_t) * 8);
+        vm_exit(NULL, EXIT_FAILURE);
+    }
+
+    module->num_exports = *(vm_type_t*)(bc.bytes + 6);
+    module->start_of_code = *(((vm_type_t*)(bc.bytes + 6)) + 1);
+    module->size = (vm_type_t)bc.length - MODULE_HEADER_SIZE;
+    module->mapped_pages = 0;
+}
+
+/*
+ * Appends a ret to the code at module->addr, which has room for it, and decodes it.
+ */
+static void module_setup(Memory *mem, Module *module) {
+    byte_t* native_module_addr = vm_pointer_to_native(mem, module->addr, byte_t*);
+    native_module_addr[module->size] = 0x5C; // ret
+    module->size++;
+
+    module->ref_map = 0;
+
+    module_decode(module, native_module_addr);
+    module_index_exports(mem, module);
+}
+
+#if defined(VM_MAPPED_MODULES) && VM_MAPPED_MODULES && (!defined(VM_NATIVE_MALLOC) || !VM_NATIVE_MALLOC)
+/*
+ * Maps the file of a module into pages of the heap instead of reading it and copying the code. The code is executed
+ * where it is mapped; the pages are shared with the page cache, and so with every other VM that maps the same file,
+ * until the VM writes to them. Only the page with the ret appended to the code is always copied.
+ *
+ * Only heaps made by memory_create() can take a mapping. Returns 0 if the file could not be mapped, in which case it
+ * is read the regular way.
+ */
+static int module_map(Memory *mem, const char *name, const char *filename, Module *module) {
+    if (!mem->reserved) {
+        return 0;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < MODULE_HEADER_SIZE) {
+        close(fd);
+        return 0;
+    }
+
+    size_t length = (size_t) info.st_size;
+    vm_type_t num_pages = (vm_type_t) ((length + 1 + VM_PAGE_SIZE - 1) / VM_PAGE_SIZE); // one byte more for the ret
+    vm_pointer_t addr = memory_alloc(mem, num_pages);
+    int mapped = os_map_file(mem->main_memory + addr, length, fd);
+    close(fd);
+    if (!mapped) {
+        memory_free(mem, addr, num_pages);
+        return 0;
+    }
+
+    module_read_header(module, name, (funky_bytecode_t) { .bytes = mem->main_memory + addr, .length = length });
+    module->addr = addr + MODULE_HEADER_SIZE;
+    module->mapped_pages = num_pages;
+    module_setup(mem, module);
+    return 1;
+}
+#endif
+
 Module module_load_name(CPU_State* state, const char* name) {
     char *filename = module_find_filename(state, name);
 
@@ -101,6 +381,15 @@ Module module_load_name(CPU_State* state, const char* name) {
         return (Module) { .name = strdup(name), .addr = 0, .size = 0, .num_exports = 0, .start_of_code = 0 };
     }
 
+#if defined(VM_MAPPED_MODULES) && VM_MAPPED_MODULES && (!defined(VM_NATIVE_MALLOC) || !VM_NATIVE_MALLOC)
+    Module mapped_module;
+    if (module_map(state->memory, name, filename, &mapped_module)) {
+        free(filename);
+        mapped_module.num_links = 0;
+        return mapped_module;
+    }
+#endif
+
     FILE *fp;
     fp = fopen(filename, "rb");
     if (fp == NULL) {
@@ -152,76 +441,259 @@ Module module_load_name(CPU_State* state, const char* name) {
 
 Module module_load(Memory *mem, const char* name, funky_bytecode_t bc) {
     Module module;
+    module_read_header(&module, name, bc);
 
-    module.name = strdup(name);
+    // grab sufficient memory for the buffer to hold the text
+    vm_pointer_t module_addr = vm_calloc(mem, module.size + 1, sizeof(byte_t));
+    module.addr = module_addr;
 
-    if (bc.length < 6 + 2 * sizeof(vm_type_t)) {
-        printf("%s is not a valid BSMB file\n", name);
+    if (module_addr == 0) {
+        fprintf(stderr, "Memory allocation error\nDo you have enough free memory?\n");
         vm_exit(NULL, EXIT_FAILURE);
     }
 
-    if (bc.bytes[0] != 'f' || bc.bytes[1] != 'u' || bc.bytes[2] != 'n' || bc.bytes[3] != 'k') {
-        printf("%s is not a valid Funky bytecode file\n", name);
-        vm_exit(NULL, EXIT_FAILURE);
+    memcpy(vm_pointer_to_native(mem, module_addr, byte_t*), bc.bytes + MODULE_HEADER_SIZE, module.size);
+
+    module_setup(mem, &module);
+    return module;
+}
+
+static vm_instruction_t *module_add_instruction(Module *module, vm_type_t offset, const vm_instruction_t *instr) {
+    if (module->num_instructions == module->instructions_size) {
+        module->instructions_size *= 2;
+        module->code = realloc(module->code, module->instructions_size * sizeof(vm_instruction_t));
     }
+    module->code_index[offset] = module->num_instructions;
+    module->code[module->num_instructions] = *instr;
+    return &module->code[module->num_instructions++];
+}
 
-    if ((bc.bytes[4] & FLAG_LITTLE_ENDIAN) == 0 && !IS_BIG_ENDIAN) {
-        printf("%s is compiled for big endian systems. This system is little endian.\n", name);
-        vm_exit(NULL, EXIT_FAILURE);
+/*
+ * Decodes the code of a module up front by sweeping linearly from the start of the code. The sweep stops at the first
+ * byte that is not a valid instruction (data, or code the assembler put somewhere unexpected); anything it could not
+ * reach is decoded by module_decode_instruction() the first time it is executed.
+ *
+ * Every instruction gets one record, in the order of the code, and code_index maps the offset of each byte to its
+ * record. The bytes in between instructions and the ones that were not decoded map to code[0], which is never decoded
+ * itself, so running it always ends up in cpu_decode().
+ */
+void module_decode(Module *module, const byte_t *native_module_addr) {
+    // padded, so an instruction that runs over the end of the module still lands on the undecoded record
+    module->code_index = calloc(module->size + VM_MAX_INSTRUCTION_LENGTH, sizeof(vm_type_t));
+    module->instructions_size = 64;
+    module->code = malloc(module->instructions_size * sizeof(vm_instruction_t));
+    module->code[0] = VM_UNDECODED_INSTRUCTION;
+    module->num_instructions = 1;
+
+    vm_type_t offset = module->start_of_code;
+    while (offset < module->size) {
+        vm_instruction_t instr;
+        unsigned char length = decode_instruction(native_module_addr + offset, module->addr, &instr);
+        if (length == 0 || offset + length > module->size) {
+            break;
+        }
+        module_add_instruction(module, offset, &instr);
+        offset += length;
     }
+    module->instructions_size = module->num_instructions;
+    module->code = realloc(module->code, module->instructions_size * sizeof(vm_instruction_t));
 
-    if (bc.bytes[5] != sizeof(vm_type_t)) {
-        printf("%s is compiled for %d virtual bits. This system is %u virtual bits.\n", name, bc.bytes[5] * 8,
-               (unsigned int) sizeof(vm_type_t) * 8);
-        vm_exit(NULL, EXIT_FAILURE);
+#if defined(VM_SUPERINSTRUCTIONS) && VM_SUPERINSTRUCTIONS
+    fuse_instructions(module);
+#else
+    module->fusions = NULL;
+#endif
+
+#if defined(VM_INLINE_CACHES) && VM_INLINE_CACHES
+    assign_map_caches(module, native_module_addr);
+#else
+    module->map_caches = NULL;
+    module->num_map_caches = 0;
+#endif
+}
+
+/*
+ * Decodes the instruction at offset into a record of its own, for an instruction the sweep of module_decode() did not
+ * reach. This may move module->code.
+ * @return the record, or NULL if there is no valid instruction at offset
+ */
+vm_instruction_t *module_decode_instruction(Module *module, const byte_t *native_module_addr, vm_type_t offset) {
+    if (offset >= module->size) {
+        return NULL;
+    }
+    vm_instruction_t instr;
+    unsigned char length = decode_instruction(native_module_addr + offset, module->addr, &instr);
+    if (length == 0 || offset + length > module->size) {
+        return NULL;
     }
+    return module_add_instruction(module, offset, &instr);
+}
 
-    module.num_exports = *(vm_type_t*)(bc.bytes + 6);
-    module.start_of_code = *(((vm_type_t*)(bc.bytes + 6)) + 1);
-    module.size = (vm_type_t)bc.length - (6 + sizeof(vm_type_t) * 2);
+/*
+ * The export table at the start of a module is a list of NUL terminated names, each followed by the offset of what it
+ * exports. This reads it once into module->exports and hashes the names, so link and ld.extern neither parse the table
+ * nor compare every name in it.
+ */
+void module_index_exports(Memory *mem, Module *module) {
+    module->exports = NULL;
+    module->export_index = NULL;
+    module->export_index_size = 0;
+    if (module->num_exports == 0) {
+        return;
+    }
 
-    // grab sufficient memory for the buffer to hold the text
-    //unsigned char *module_addr = k_calloc(mem, numbytes, sizeof(unsigned char));
-    //module.addr = (vm_type_t) (module_addr - mem->main_memory);
-    vm_pointer_t module_addr = vm_calloc(mem, module.size + 1, sizeof(byte_t));
-    byte_t* native_module_addr = vm_pointer_to_native(mem, module_addr, byte_t*);
-    module.addr = module_addr;
+    module->exports = malloc(module->num_exports * sizeof(vm_module_export_t));
+    vm_type_t size = 4;
+    while (size < module->num_exports * 2) {
+        size *= 2;
+    }
+    module->export_index = malloc(size * sizeof(vm_type_t));
+    module->export_index_size = size;
+    for (vm_type_t i = 0; i < size; i++) {
+        module->export_index[i] = VM_UNSIGNED_MAX;
+    }
 
-    if (module_addr == 0) {
-        fprintf(stderr, "Memory allocation error\nDo you have enough free memory?\n");
-        vm_exit(NULL, EXIT_FAILURE);
+    vm_pointer_t addr = module->addr;
+    for (vm_type_t i = 0; i < module->num_exports; i++) {
+        const char *name = vm_pointer_to_native(mem, addr, const char*);
+        vm_type_t length = (vm_type_t) strlen(name);
+        vm_type_t ref;
+        memcpy(&ref, name + length + 1, sizeof(vm_type_t));
+
+        vm_type_t hash = map_hash(name);
+        module->exports[i] = (vm_module_export_t) { .name = addr, .hash = hash, .addr = module->addr + ref };
+        addr += length + 1 + sizeof(vm_type_t);
+
+        vm_type_t slot = hash & (size - 1);
+        while (module->export_index[slot] != VM_UNSIGNED_MAX) {
+            slot = (slot + 1) & (size - 1);
+        }
+        module->export_index[slot] = i;
     }
+}
 
-    memcpy(native_module_addr, bc.bytes + 6 + 2 * sizeof(vm_type_t), module.size);
+/*
+ * Returns the export of the module with the given name, or NULL if it exports no such name. Names are inserted in the
+ * order of the table, so if a name is exported twice the first one is found.
+ */
+vm_module_export_t *module_find_export(Memory *mem, Module *module, const char *name) {
+    if (module->export_index_size == 0) {
+        return NULL;
+    }
+
+    vm_type_t hash = map_hash(name);
+    vm_type_t mask = module->export_index_size - 1;
+    for (vm_type_t slot = hash & mask; module->export_index[slot] != VM_UNSIGNED_MAX; slot = (slot + 1) & mask) {
+        vm_module_export_t *export = &module->exports[module->export_index[slot]];
+        if (export->hash == hash && strcmp(vm_pointer_to_native(mem, export->name, const char*), name) == 0) {
+            return export;
+        }
+    }
+    return NULL;
+}
 
-    native_module_addr[module.size] = 0x5C; // ret
-    module.size++;
+/*
+ * Rebuilds what a module keeps outside of the heap, for a module whose code and strings are in a heap that was
+ * restored from a snapshot (see snapshot.c). Instructions that rewrote themselves (resolved externs and syscalls,
+ * quickened arithmetic, map item caches) start out generic again.
+ */
+void module_restore(CPU_State *state, Module *module, const char *name) {
+    module->name = strdup(name);
+    module_decode(module, vm_pointer_to_native(state->memory, module->addr, const byte_t*));
+    module_index_exports(state->memory, module);
+    atoms_intern_module(state, module);
+}
 
-    module.ref_map = 0;
+/*
+ * Lists how many of each superinstruction fuse_instructions() formed when the module was loaded, not how often they ran.
+ */
+void module_print_fusions(Module *module) {
+    printf("Superinstructions formed at load in module %s:\n", module->name);
+    vm_type_t total = 0;
+    for (int i = 0; module->fusions != NULL && i < VM_NUM_SUPERINSTRUCTIONS; i++) {
+        if (module->fusions[i] > 0) {
+            printf("  %6u  %s\n", (unsigned int) module->fusions[i], superinstruction_names[i]);
+            total += module->fusions[i];
+        }
+    }
+    if (total == 0) {
+        printf("  none\n");
+    }
+}
 
-    return module;
+void module_print_map_caches(CPU_State *state, Module *module) {
+    printf("Map item caches in module %s:\n", module->name);
+    if (module->num_map_caches == 0) {
+        printf("  none\n");
+    }
+    for (vm_type_t i = 0; i < module->num_map_caches; i++) {
+        vm_map_cache_t *cache = &module->map_caches[i];
+        int num_shapes = 0;
+        while (num_shapes < VM_MAP_CACHE_WAYS && cache->entries[num_shapes].shape != VM_MAP_SHAPE_NONE) {
+            num_shapes++;
+        }
+        printf("  0x%08x  %-20.20s  hits %10llu  misses %10llu  shapes %d\n", (unsigned int) cache->offset,
+               vm_pointer_to_native(state->memory, cache->name, const char*),
+               (unsigned long long) cache->hits, (unsigned long long) cache->misses, num_shapes);
+    }
 }
 
 void module_unload(Memory *mem, Module module) {
-    vm_free(mem, module.addr);
+    if (module.mapped_pages != 0) {
+        vm_pointer_t pages = module.addr - MODULE_HEADER_SIZE;
+        os_unmap_file(mem->main_memory + pages, module.mapped_pages * VM_PAGE_SIZE);
+        memory_free(mem, pages, module.mapped_pages);
+    } else {
+        vm_free(mem, module.addr);
+    }
+    free(module.code);
+    free(module.code_index);
+    free(module.exports);
+    free(module.export_index);
+    free(module.fusions);
+    free(module.map_caches);
     free(module.name);
 }
 
 int module_register(CPU_State *state, Module module) {
+    atoms_intern_module(state, &module);
+
     state->num_modules++;
     state->modules = k_realloc(state->memory, state->modules, sizeof(Module) * state->num_modules);
     state->modules[state->num_modules - 1] = module;
     return state->num_modules;
 }
 
+/*
+ * ld.extern instructions rewrite themselves to load the address they resolved (see instr_ld_extern). Those that point
+ * into a module that is going away are turned back into ld.extern, so they resolve again the next time they run.
+ */
+static void module_unresolve_externs(CPU_State *state, Module *released) {
+    for (int i = 0; i < state->num_modules; i++) {
+        Module *module = &state->modules[i];
+        if (module == released || module->code == NULL) continue;
+        for (vm_type_t j = 1; j < module->num_instructions; j++) {
+            vm_instruction_t *instr = &module->code[j];
+            vm_pointer_t addr = instr->operands[2].uint_value;
+            if (instr->opcode == VM_OPCODE_LD_EXTERN_RESOLVED &&
+                addr >= released->addr && addr < released->addr + released->size) {
+                instr->opcode = VM_INSTR_LD_EXTERN;
+                instr->impl = instruction_implementations[VM_INSTR_LD_EXTERN];
+            }
+        }
+    }
+}
+
 int module_release(CPU_State *state, const char* name) {
     for (int i = 0; i < state->num_modules; i++) {
         if (strcmp(state->modules[i].name, name) == 0) {
+            module_unresolve_externs(state, &state->modules[i]);
             for (int j = i + 1; j < state->num_modules; j++) {
                 state->modules[j - 1] = state->modules[j];
             }
             state->num_modules--;
             state->modules = k_realloc(state->memory, state->modules, sizeof(Module) * state->num_modules);
+            cpu_invalidate_code(state);
             return 1;
         }
     }
@@ -240,11 +712,15 @@ Module *module_get(CPU_State *state, const char* name) {
 
 }
 
-Module* get_current_module(CPU_State *state) {
+Module* module_at_address(CPU_State *state, vm_pointer_t addr) {
     for (int i = 0; i < state->num_modules; i++) {
-        if (state->pc >= state->modules[i].addr && state->pc < state->modules[i].addr + state->modules[i].size) {
+        if (addr >= state->modules[i].addr && addr < state->modules[i].addr + state->modules[i].size) {
             return &state->modules[i];
         }
     }
     return NULL;
 }
+
+Module* get_current_module(CPU_State *state) {
+    return module_at_address(state, state->pc);
+}
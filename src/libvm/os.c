@@ -117,4 +117,101 @@ char* get_executable_path(const char* append) {
     strcpy(strrchr(ret, path_separator) + 1, append);
     free(path);
     return ret;
-}
\ No newline at end of file
+}
+
+/*
+ * Address space for a heap that can grow: os_reserve_memory() takes a range of size bytes without backing it, and
+ * os_commit_memory() makes part of it usable. The range never moves, so pointers into it stay valid while it grows.
+ * Where there is no way to reserve without committing, os_reserves_memory() is 0 and the whole range is allocated up
+ * front, so memory_create() does not reserve more than the heap starts out with.
+ */
+#if defined(FUNKY_VM_OS_LINUX) || defined(FUNKY_VM_OS_MACOS)
+#include <sys/mman.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+int os_reserves_memory(void) {
+    return 1;
+}
+
+void* os_reserve_memory(size_t size) {
+    void* addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+int os_commit_memory(void* addr, size_t size) {
+    return mprotect(addr, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void os_release_memory(void* addr, size_t size) {
+    munmap(addr, size);
+}
+
+/*
+ * Maps the first size bytes of a file over a committed part of a reserved range, copy-on-write: the pages are shared
+ * with the page cache until they are written to. addr has to be aligned to the page size of the OS.
+ */
+int os_map_file(void* addr, size_t size, int fd) {
+    if ((uintptr_t) addr % (uintptr_t) sysconf(_SC_PAGESIZE) != 0) {
+        return 0;
+    }
+    return mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+}
+
+/*
+ * Replaces a mapped file by committed, zeroed memory again.
+ */
+void os_unmap_file(void* addr, size_t size) {
+    mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+}
+#elif defined(FUNKY_VM_OS_WINDOWS)
+int os_reserves_memory(void) {
+    return 1;
+}
+
+void* os_reserve_memory(size_t size) {
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+int os_commit_memory(void* addr, size_t size) {
+    return VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+void os_release_memory(void* addr, size_t size) {
+    VirtualFree(addr, 0, MEM_RELEASE);
+}
+
+int os_map_file(void* addr, size_t size, int fd) {
+    return 0;
+}
+
+void os_unmap_file(void* addr, size_t size) {
+}
+#else
+int os_reserves_memory(void) {
+    return 0;
+}
+
+void* os_reserve_memory(size_t size) {
+    return calloc(size, 1);
+}
+
+int os_commit_memory(void* addr, size_t size) {
+    return 1;
+}
+
+void os_release_memory(void* addr, size_t size) {
+    free(addr);
+}
+
+int os_map_file(void* addr, size_t size, int fd) {
+    return 0;
+}
+
+void os_unmap_file(void* addr, size_t size) {
+}
+#endif
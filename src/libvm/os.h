@@ -5,7 +5,16 @@
 #ifndef FUNKY_VM_LIB_OS_H
 #define FUNKY_VM_LIB_OS_H
 
+#include <stddef.h>
+
 char* get_executable_filepath();
 char* get_executable_path(const char* append);
 
+int os_reserves_memory(void);
+void* os_reserve_memory(size_t size);
+int os_commit_memory(void* addr, size_t size);
+void os_release_memory(void* addr, size_t size);
+int os_map_file(void* addr, size_t size, int fd);
+void os_unmap_file(void* addr, size_t size);
+
 #endif //FUNKY_VM_OS_H
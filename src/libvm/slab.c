@@ -0,0 +1,217 @@
+#if !defined(VM_NATIVE_MALLOC) || !VM_NATIVE_MALLOC
+
+#include <stdio.h>
+#include <string.h>
+
+#include "funkyvm/funkyvm.h"
+#include "funkyvm/memory.h"
+#include "liballoc_1_1.h"
+#include "slab.h"
+
+/*
+ * Size-class allocator in front of liballoc. Most of what the VM allocates is small and of a handful of sizes: the
+ * headers of maps, arrays and boxes, short strings, small value buffers. Those are served from slabs, pages that hold
+ * blocks of one size class only, with a free list per page so both malloc and free are O(1). Anything larger than
+ * VM_SLAB_MAX_SIZE goes to liballoc.
+ *
+ * Which allocator a pointer belongs to follows from its page: the page table in vm_slab_t knows which pages are slabs.
+ * A page whose last block is freed goes back to the page allocator, unless it is the only page of its class with free
+ * blocks, so alternating malloc and free of one block does not take and return a page every time.
+ */
+
+static const vm_type_t slab_sizes[VM_SLAB_NUM_CLASSES] = { 16, 32, 48, 64, 96, 128, 192, 256 };
+
+// size class by size in units of 16 bytes, rounded up
+static const unsigned char slab_class_by_size[VM_SLAB_MAX_SIZE / 16 + 1] = {
+        0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+};
+
+#define SLAB_PAGE(addr) ((addr) / VM_PAGE_SIZE)
+#define SLAB_FULL(page, size) ((page)->free == VM_SLAB_NONE && (page)->bump + (size) > VM_PAGE_SIZE)
+
+void slab_reset(Memory *mem) {
+    for (int i = 0; i < VM_SLAB_NUM_CLASSES; i++) {
+        mem->slab.classes[i] = (vm_slab_class_t) { .partial = VM_SLAB_NONE };
+    }
+    mem->slab.pages = calloc(mem->size / VM_PAGE_SIZE, sizeof(vm_slab_page_t));
+    mem->slab.large_allocs = 0;
+    mem->slab.large_frees = 0;
+}
+
+void slab_grow(Memory *mem, vm_type_t old_pages, vm_type_t new_pages) {
+    mem->slab.pages = realloc(mem->slab.pages, new_pages * sizeof(vm_slab_page_t));
+    memset(mem->slab.pages + old_pages, 0, (new_pages - old_pages) * sizeof(vm_slab_page_t));
+}
+
+void slab_destroy(Memory *mem) {
+    free(mem->slab.pages);
+}
+
+static void slab_unlink(Memory *mem, vm_slab_class_t *cls, vm_type_t n) {
+    vm_slab_page_t *page = &mem->slab.pages[n];
+    if (page->prev != VM_SLAB_NONE) {
+        mem->slab.pages[page->prev].next = page->next;
+    } else {
+        cls->partial = page->next;
+    }
+    if (page->next != VM_SLAB_NONE) {
+        mem->slab.pages[page->next].prev = page->prev;
+    }
+    page->prev = page->next = VM_SLAB_NONE;
+}
+
+static void slab_push(Memory *mem, vm_slab_class_t *cls, vm_type_t n) {
+    vm_slab_page_t *page = &mem->slab.pages[n];
+    page->prev = VM_SLAB_NONE;
+    page->next = cls->partial;
+    if (cls->partial != VM_SLAB_NONE) {
+        mem->slab.pages[cls->partial].prev = n;
+    }
+    cls->partial = n;
+}
+
+static vm_pointer_t slab_alloc(Memory *mem, int size_class) {
+    vm_slab_class_t *cls = &mem->slab.classes[size_class];
+    vm_type_t size = slab_sizes[size_class];
+
+    if (cls->partial == VM_SLAB_NONE) {
+        vm_type_t addr = memory_alloc(mem, 1);
+        vm_type_t n = SLAB_PAGE(addr);
+        mem->slab.pages[n] = (vm_slab_page_t) {
+                .size_class = (unsigned char) (size_class + 1),
+                .used = 0,
+                .bump = addr == 0 ? size : 0, // address 0 is the null pointer of the VM, never hand it out
+                .free = VM_SLAB_NONE
+        };
+        slab_push(mem, cls, n);
+        cls->num_pages++;
+    }
+
+    vm_type_t n = cls->partial;
+    vm_slab_page_t *page = &mem->slab.pages[n];
+    vm_pointer_t block;
+    if (page->free != VM_SLAB_NONE) {
+        block = page->free;
+        page->free = *vm_pointer_to_native(mem, block, vm_pointer_t*);
+    } else {
+        block = n * VM_PAGE_SIZE + page->bump;
+        page->bump += size;
+    }
+    page->used++;
+
+    if (SLAB_FULL(page, size)) {
+        slab_unlink(mem, cls, n);
+    }
+
+    cls->allocs++;
+    return block;
+}
+
+static void slab_free(Memory *mem, vm_pointer_t block) {
+    vm_type_t n = SLAB_PAGE(block);
+    vm_slab_page_t *page = &mem->slab.pages[n];
+    vm_slab_class_t *cls = &mem->slab.classes[page->size_class - 1];
+    vm_type_t size = slab_sizes[page->size_class - 1];
+
+    if (SLAB_FULL(page, size)) {
+        slab_push(mem, cls, n);
+    }
+
+    *vm_pointer_to_native(mem, block, vm_pointer_t*) = page->free;
+    page->free = block;
+    page->used--;
+    cls->frees++;
+
+    if (page->used == 0 && (page->prev != VM_SLAB_NONE || page->next != VM_SLAB_NONE)) {
+        slab_unlink(mem, cls, n);
+        page->size_class = 0;
+        cls->num_pages--;
+        memory_free(mem, n * VM_PAGE_SIZE, 1);
+    }
+}
+
+static int slab_class_of(Memory *mem, void *ptr) {
+    vm_pointer_t addr = native_to_vm_pointer(mem, ptr);
+    return mem->slab.pages[SLAB_PAGE(addr)].size_class - 1;
+}
+
+void *k_malloc(Memory *mem, size_t size) {
+    if (size > VM_SLAB_MAX_SIZE) {
+        mem->slab.large_allocs++;
+        return la_malloc(mem, size);
+    }
+    int size_class = slab_class_by_size[(size + 15) / 16];
+    return vm_pointer_to_native(mem, slab_alloc(mem, size_class), void*);
+}
+
+void *k_calloc(Memory *mem, size_t num, size_t size) {
+    void *ptr = k_malloc(mem, num * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, num * size);
+    }
+    return ptr;
+}
+
+void k_free(Memory *mem, void *ptr) {
+    if (ptr == NULL || ptr == mem->main_memory) {
+        return;
+    }
+    if (slab_class_of(mem, ptr) >= 0) {
+        slab_free(mem, native_to_vm_pointer(mem, ptr));
+    } else {
+        mem->slab.large_frees++;
+        la_free(mem, ptr);
+    }
+}
+
+/*
+ * A block stays where it is if the new size falls in the same class. Blocks move between slab and liballoc only when
+ * they outgrow VM_SLAB_MAX_SIZE; a large block that shrinks is left to liballoc.
+ */
+void *k_realloc(Memory *mem, void *ptr, size_t size) {
+    if (ptr == NULL || ptr == mem->main_memory) {
+        return k_malloc(mem, size);
+    }
+    if (size == 0) {
+        k_free(mem, ptr);
+        return NULL;
+    }
+
+    int size_class = slab_class_of(mem, ptr);
+    if (size_class < 0) {
+        return la_realloc(mem, ptr, size);
+    }
+    if (size <= VM_SLAB_MAX_SIZE && slab_class_by_size[(size + 15) / 16] == size_class) {
+        return ptr;
+    }
+
+    void *new_ptr = k_malloc(mem, size);
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, size < slab_sizes[size_class] ? size : slab_sizes[size_class]);
+    }
+    k_free(mem, ptr);
+    return new_ptr;
+}
+
+void memory_print_allocations(Memory *mem) {
+    printf("Allocations:\n");
+    for (int i = 0; i < VM_SLAB_NUM_CLASSES; i++) {
+        vm_slab_class_t *cls = &mem->slab.classes[i];
+        printf("  %4u bytes  allocs %10llu  frees %10llu  live %8llu  pages %4u\n", (unsigned int) slab_sizes[i],
+               cls->allocs, cls->frees, cls->allocs - cls->frees, (unsigned int) cls->num_pages);
+    }
+    printf("  large       allocs %10llu  frees %10llu  live %8llu\n",
+           mem->slab.large_allocs, mem->slab.large_frees, mem->slab.large_allocs - mem->slab.large_frees);
+}
+
+#else
+
+#include <stdio.h>
+
+#include "funkyvm/funkyvm.h"
+
+void memory_print_allocations(Memory *mem) {
+    printf("Allocations: served by the native malloc\n");
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef FUNKY_VM_SLAB_H
+#define FUNKY_VM_SLAB_H
+
+#include "../../include/funkyvm/memory.h"
+
+void slab_reset(Memory *mem);
+void slab_grow(Memory *mem, vm_type_t old_pages, vm_type_t new_pages);
+void slab_destroy(Memory *mem);
+
+#endif //FUNKY_VM_SLAB_H
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "funkyvm/funkyvm.h"
+#include "error_handling.h"
+
+/*
+ * A snapshot is the heap of a VM written to a file as it is, followed by what the VM keeps outside of it: the
+ * registers, the bookkeeping of the page and block allocators, the atom and shape tables, the candidate cycle roots
+ * and the fibers. Restoring one maps the heap back in with a single mmap() where the heap allows it, or reads it with a
+ * single read otherwise, and copies the rest over; what a VM does before it gets to work, creating the boxing
+ * prototypes, loading modules and running their initialization, does not have to be repeated.
+ *
+ * VM pointers are offsets into the heap, so the heap does not care where it is mapped. The exceptions are the links
+ * between liballoc's blocks, which are moved along (see liballoc_relocate()), and everything with a native pointer,
+ * which is not saved but rebuilt: the decoded code of the modules (see module_restore()) and the syscall table, which
+ * belongs to the host. The VM a snapshot is restored into must have the same syscalls registered in the same order,
+ * as scripts may have kept their numbers.
+ *
+ * A snapshot only fits the build of the VM that wrote it.
+ */
+
+#if !defined(VM_NATIVE_MALLOC) || !VM_NATIVE_MALLOC
+
+#include "liballoc_1_1.h"
+#include "slab.h"
+#include "os.h"
+
+#if !defined(FUNKY_VM_OS_WINDOWS)
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#define SNAPSHOT_MAGIC "funksnap"
+#define SNAPSHOT_FORMAT 1
+#define SNAPSHOT_NONE UINT64_MAX
+#define SNAPSHOT_RELEASED UINT32_MAX
+
+// at the very end of the file, after the heap and the rest of the state
+typedef struct snapshot_trailer_t {
+    char magic[8];
+    uint32_t format;
+    uint32_t state_size, memory_size, value_size;
+    uint64_t heap_size;      // bytes of heap at the start of the file
+    uint64_t metadata_size;  // bytes between the heap and the trailer
+    uint64_t base;           // address of the heap when it was saved
+    uint64_t modules;        // offset of the module table in the heap, or SNAPSHOT_NONE
+    uint64_t syscall_table;  // offset of the syscall table in the heap, or SNAPSHOT_NONE
+} snapshot_trailer_t;
+
+static uint64_t heap_offset(Memory *mem, void *ptr) {
+    return ptr == NULL ? SNAPSHOT_NONE : (uint64_t) ((unsigned char *) ptr - mem->main_memory);
+}
+
+static int write_name(FILE *fp, const char *name) {
+    uint32_t length = name == NULL ? SNAPSHOT_RELEASED : (uint32_t) strlen(name);
+    return fwrite(&length, sizeof(length), 1, fp) == 1 &&
+           (name == NULL || fwrite(name, 1, length, fp) == length);
+}
+
+/*
+ * Writes the whole state of the VM to filename. The VM can go on running afterwards; a VM restored from the file
+ * continues where this one was. Returns 0 if the file could not be written.
+ */
+int cpu_save_snapshot(CPU_State *state, const char *filename) {
+    Memory *mem = state->memory;
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    int ok = fwrite(mem->main_memory, 1, mem->size, fp) == mem->size;
+    long start = ftell(fp);
+
+    ok = ok && fwrite(state, sizeof(CPU_State), 1, fp) == 1;
+    ok = ok && fwrite(mem, sizeof(Memory), 1, fp) == 1;
+    ok = ok && fwrite(mem->bitmap, sizeof(vm_bitmap_word_t), mem->bitmap_words, fp) == mem->bitmap_words;
+    ok = ok && fwrite(mem->slab.pages, sizeof(vm_slab_page_t), mem->size / VM_PAGE_SIZE, fp) == mem->size / VM_PAGE_SIZE;
+    ok = ok && fwrite(state->atoms, sizeof(vm_atom_slot_t), state->atoms_size, fp) == state->atoms_size;
+    ok = ok && fwrite(state->map_shapes, sizeof(vm_map_shape_t), state->num_map_shapes, fp) == state->num_map_shapes;
+    ok = ok && fwrite(state->map_shape_index, sizeof(vm_type_t), state->map_shape_index_size, fp) ==
+               state->map_shape_index_size;
+    ok = ok && fwrite(state->cycle_roots, sizeof(vm_cycle_slot_t), state->cycle_roots_size, fp) ==
+               state->cycle_roots_size;
+    ok = ok && fwrite(state->fibers, sizeof(vm_fiber_t), state->num_fibers, fp) == state->num_fibers;
+    for (vm_type_t i = 0; ok && i < state->num_modules; i++) {
+        ok = write_name(fp, state->modules[i].name);
+    }
+    for (vm_type_t i = 0; ok && i < state->num_syscalls; i++) {
+        ok = write_name(fp, state->syscall_table[i].name);
+    }
+
+    snapshot_trailer_t trailer = {
+            .magic = SNAPSHOT_MAGIC,
+            .format = SNAPSHOT_FORMAT,
+            .state_size = sizeof(CPU_State),
+            .memory_size = sizeof(Memory),
+            .value_size = sizeof(vm_value_t),
+            .heap_size = mem->size,
+            .metadata_size = (uint64_t) (ftell(fp) - start),
+            .base = (uint64_t) (uintptr_t) mem->main_memory,
+            .modules = heap_offset(mem, state->modules),
+            .syscall_table = heap_offset(mem, state->syscall_table)
+    };
+    ok = ok && fwrite(&trailer, sizeof(trailer), 1, fp) == 1;
+
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        remove(filename);
+    }
+    return ok;
+}
+
+/*
+ * Walks through the metadata of a snapshot that was read into memory.
+ */
+typedef struct snapshot_reader_t {
+    unsigned char *next;
+    unsigned char *end;
+} snapshot_reader_t;
+
+static void *read_block(snapshot_reader_t *reader, size_t size) {
+    if ((size_t) (reader->end - reader->next) < size) {
+        return NULL;
+    }
+    void *block = reader->next;
+    reader->next += size;
+    return block;
+}
+
+// NULL for a released syscall or past the end, the two are told apart by *valid
+static const char *read_name(snapshot_reader_t *reader, uint32_t *length, int *valid) {
+    uint32_t *stored = read_block(reader, sizeof(uint32_t));
+    *valid = stored != NULL;
+    if (stored == NULL || *stored == SNAPSHOT_RELEASED) {
+        return NULL;
+    }
+    *length = *stored;
+    const char *name = read_block(reader, *length);
+    *valid = name != NULL;
+    return name;
+}
+
+static void *copy_table(const void *table, size_t size, size_t capacity) {
+    if (table == NULL || capacity == 0) {
+        return NULL;
+    }
+    void *copy = calloc(capacity, 1);
+    memcpy(copy, table, size);
+    return copy;
+}
+
+/*
+ * Replaces the heap and the state of a VM by the snapshot in filename. The VM must have been set up by the host as
+ * usual, with its syscalls registered, but must not have loaded any modules. Its heap must have been made by
+ * memory_create() and have room for the snapshot. cpu_run() then continues where the VM that saved the snapshot was.
+ *
+ * Returns 0 if the snapshot cannot be restored into this VM. Unless the heap could not be read, the VM is then left as
+ * it was.
+ */
+int cpu_restore_snapshot(CPU_State *state, const char *filename) {
+    Memory *mem = state->memory;
+    if (state->num_modules != 0) {
+        return 0;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    snapshot_trailer_t trailer;
+    if (fseek(fp, -(long) sizeof(trailer), SEEK_END) != 0 || fread(&trailer, sizeof(trailer), 1, fp) != 1 ||
+        memcmp(trailer.magic, SNAPSHOT_MAGIC, sizeof(trailer.magic)) != 0 || trailer.format != SNAPSHOT_FORMAT ||
+        trailer.state_size != sizeof(CPU_State) || trailer.memory_size != sizeof(Memory) ||
+        trailer.value_size != sizeof(vm_value_t) || trailer.heap_size % VM_PAGE_SIZE != 0 ||
+        trailer.heap_size > (mem->reserved ? mem->max_size : mem->size)) {
+        fclose(fp);
+        return 0;
+    }
+
+    unsigned char *metadata = malloc((size_t) trailer.metadata_size);
+    if (fseek(fp, (long) trailer.heap_size, SEEK_SET) != 0 ||
+        fread(metadata, 1, (size_t) trailer.metadata_size, fp) != trailer.metadata_size) {
+        free(metadata);
+        fclose(fp);
+        return 0;
+    }
+
+    snapshot_reader_t reader = { .next = metadata, .end = metadata + trailer.metadata_size };
+    CPU_State *saved = read_block(&reader, sizeof(CPU_State));
+    Memory *saved_mem = read_block(&reader, sizeof(Memory));
+    vm_type_t num_pages = (vm_type_t) (trailer.heap_size / VM_PAGE_SIZE);
+    vm_bitmap_word_t *bitmap = NULL;
+    vm_slab_page_t *slab_pages = NULL;
+    vm_atom_slot_t *atoms = NULL;
+    vm_map_shape_t *map_shapes = NULL;
+    vm_type_t *map_shape_index = NULL;
+    vm_cycle_slot_t *cycle_roots = NULL;
+    vm_fiber_t *fibers = NULL;
+    int valid = saved != NULL && saved_mem != NULL && saved_mem->size == trailer.heap_size;
+    if (valid) {
+        bitmap = read_block(&reader, saved_mem->bitmap_words * sizeof(vm_bitmap_word_t));
+        slab_pages = read_block(&reader, num_pages * sizeof(vm_slab_page_t));
+        atoms = read_block(&reader, saved->atoms_size * sizeof(vm_atom_slot_t));
+        map_shapes = read_block(&reader, saved->num_map_shapes * sizeof(vm_map_shape_t));
+        map_shape_index = read_block(&reader, saved->map_shape_index_size * sizeof(vm_type_t));
+        cycle_roots = read_block(&reader, saved->cycle_roots_size * sizeof(vm_cycle_slot_t));
+        fibers = read_block(&reader, saved->num_fibers * sizeof(vm_fiber_t));
+        valid = (bitmap != NULL || saved_mem->bitmap_words == 0) && slab_pages != NULL &&
+                (atoms != NULL || saved->atoms_size == 0) && (map_shapes != NULL || saved->num_map_shapes == 0) &&
+                (map_shape_index != NULL || saved->map_shape_index_size == 0) &&
+                (cycle_roots != NULL || saved->cycle_roots_size == 0) && (fibers != NULL || saved->num_fibers == 0) &&
+                (trailer.modules != SNAPSHOT_NONE || saved->num_modules == 0) &&
+                saved->num_syscalls <= state->num_syscalls;
+    }
+
+    // the module names follow, then the syscalls the snapshot expects
+    unsigned char *module_names = reader.next;
+    for (vm_type_t i = 0; valid && i < saved->num_modules; i++) {
+        uint32_t length;
+        const char *name = read_name(&reader, &length, &valid);
+        valid = valid && name != NULL;
+    }
+    for (vm_type_t i = 0; valid && i < saved->num_syscalls; i++) {
+        uint32_t length;
+        const char *name = read_name(&reader, &length, &valid);
+        const char *registered = state->syscall_table[i].name;
+        if (valid && name != NULL && (registered == NULL || strlen(registered) != length ||
+                                      memcmp(registered, name, length) != 0)) {
+            vm_error(state, "Snapshot %s expects syscall %u to be '%.*s'", filename, (unsigned int) i, (int) length, name);
+            valid = 0;
+        }
+    }
+
+    if (!valid) {
+        free(metadata);
+        fclose(fp);
+        return 0;
+    }
+
+    // the syscall table is in the heap, keep it aside while the heap is replaced
+    size_t syscalls_size = state->syscall_table_size * sizeof(vm_syscall_table_t);
+    vm_syscall_table_t *syscalls = copy_table(state->syscall_table, state->num_syscalls * sizeof(vm_syscall_table_t),
+                                              syscalls_size);
+
+    int mapped = 0;
+    if (mem->reserved) {
+        os_commit_memory(mem->main_memory, (size_t) trailer.heap_size);
+        if (mem->size > trailer.heap_size) {
+            // fresh pages for what the heap grows into again
+            os_unmap_file(mem->main_memory + trailer.heap_size, mem->size - (size_t) trailer.heap_size);
+        }
+#if defined(VM_MAPPED_MODULES) && VM_MAPPED_MODULES
+        mapped = os_map_file(mem->main_memory, (size_t) trailer.heap_size, fileno(fp));
+#endif
+    }
+    if (!mapped && (fseek(fp, 0, SEEK_SET) != 0 ||
+                    fread(mem->main_memory, 1, (size_t) trailer.heap_size, fp) != trailer.heap_size)) {
+        vm_error(state, "Could not read the heap from snapshot %s", filename);
+        vm_exit(state, EXIT_FAILURE);
+        free(syscalls);
+        free(metadata);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+
+    // the allocators
+    free(mem->bitmap);
+    slab_destroy(mem);
+    mem->size = (vm_type_t) trailer.heap_size;
+    mem->bitmap_words = saved_mem->bitmap_words;
+    mem->bitmap = copy_table(bitmap, saved_mem->bitmap_words * sizeof(vm_bitmap_word_t),
+                             saved_mem->bitmap_words * sizeof(vm_bitmap_word_t));
+    mem->first_free = saved_mem->first_free;
+    mem->allocator = saved_mem->allocator;
+    liballoc_relocate(mem, (ptrdiff_t) ((uintptr_t) mem->main_memory - (uintptr_t) trailer.base));
+    mem->slab.pages = copy_table(slab_pages, num_pages * sizeof(vm_slab_page_t), num_pages * sizeof(vm_slab_page_t));
+    memcpy(mem->slab.classes, saved_mem->slab.classes, sizeof(mem->slab.classes));
+    mem->slab.large_allocs = saved_mem->slab.large_allocs;
+    mem->slab.large_frees = saved_mem->slab.large_frees;
+    mem->lock = 0;
+
+    // the registers
+    state->pc = saved->pc;
+    state->sp = saved->sp;
+    state->mp = saved->mp;
+    state->ap = saved->ap;
+    state->rr = saved->rr;
+    state->r0 = saved->r0;
+    state->r1 = saved->r1;
+    state->r2 = saved->r2;
+    state->r3 = saved->r3;
+    state->r4 = saved->r4;
+    state->r5 = saved->r5;
+    state->r6 = saved->r6;
+    state->r7 = saved->r7;
+    state->stack_base = saved->stack_base;
+    state->stack_size = saved->stack_size;
+    state->max_stack_size = saved->max_stack_size;
+    state->stack_limit = saved->stack_limit;
+    state->retired_stacks = saved->retired_stacks;
+    state->running = 1;
+    state->in_error_state = 0;
+    state->boxing = saved->boxing;
+
+    // the tables that point into the heap
+    free(state->atoms);
+    state->atoms = copy_table(atoms, saved->atoms_size * sizeof(vm_atom_slot_t),
+                              saved->atoms_size * sizeof(vm_atom_slot_t));
+    state->num_atoms = saved->num_atoms;
+    state->atoms_size = saved->atoms_size;
+
+    free(state->map_shapes);
+    free(state->map_shape_index);
+    // room for as many shapes as map_shape_transition() expects before it grows the tables
+    state->map_shapes = copy_table(map_shapes, saved->num_map_shapes * sizeof(vm_map_shape_t),
+                                   saved->map_shape_index_size / 2 * sizeof(vm_map_shape_t));
+    state->num_map_shapes = saved->num_map_shapes;
+    state->map_shape_index = copy_table(map_shape_index, saved->map_shape_index_size * sizeof(vm_type_t),
+                                        saved->map_shape_index_size * sizeof(vm_type_t));
+    state->map_shape_index_size = saved->map_shape_index_size;
+
+    free(state->cycle_roots);
+    state->cycle_roots = copy_table(cycle_roots, saved->cycle_roots_size * sizeof(vm_cycle_slot_t),
+                                    saved->cycle_roots_size * sizeof(vm_cycle_slot_t));
+    state->num_cycle_roots = saved->num_cycle_roots;
+    state->cycle_roots_size = saved->cycle_roots_size;
+
+    free(state->fibers);
+    state->fibers = copy_table(fibers, saved->num_fibers * sizeof(vm_fiber_t), saved->num_fibers * sizeof(vm_fiber_t));
+    state->num_fibers = saved->num_fibers;
+    state->fibers_size = saved->num_fibers;
+    state->current_fiber = saved->current_fiber;
+
+    state->released_maps = saved->released_maps;
+    state->released_arrays = saved->released_arrays;
+    state->releasing = 0;
+    state->safepoint_pending = 1;
+
+    // the syscall table of the host goes into the new heap, in place of the one of the VM that saved the snapshot
+    if (trailer.syscall_table != SNAPSHOT_NONE) {
+        k_free(mem, mem->main_memory + trailer.syscall_table);
+    }
+    state->syscall_table = NULL;
+    if (syscalls != NULL) {
+        state->syscall_table = k_malloc(mem, syscalls_size);
+        memcpy(state->syscall_table, syscalls, syscalls_size);
+        free(syscalls);
+    }
+
+    // the modules, their code is in the heap; the old table was in the heap that was just replaced
+    state->modules = trailer.modules == SNAPSHOT_NONE ? NULL : (Module *) (mem->main_memory + trailer.modules);
+    state->num_modules = saved->num_modules;
+    reader.next = module_names;
+    for (vm_type_t i = 0; i < state->num_modules; i++) {
+        uint32_t length = 0;
+        const char *name = read_name(&reader, &length, &valid);
+        char *copy = malloc(length + 1);
+        memcpy(copy, name, length);
+        copy[length] = '\0';
+        module_restore(state, &state->modules[i], copy);
+        free(copy);
+    }
+
+    state->code = NULL;
+    state->code_index = NULL;
+    state->map_caches = NULL;
+    state->instr = NULL;
+    state->operands = NULL;
+    cpu_invalidate_code(state);
+
+    free(metadata);
+    return 1;
+}
+
+#else
+
+int cpu_save_snapshot(CPU_State *state, const char *filename) {
+    return 0;
+}
+
+int cpu_restore_snapshot(CPU_State *state, const char *filename) {
+    return 0;
+}
+
+#endif
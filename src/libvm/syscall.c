@@ -2,112 +2,260 @@
 #include "funkyvm/funkyvm.h"
 #include "instructions/instructions.h"
 
+/*
+ * Syscalls are numbered in the order they are registered; syscall and the rewritten syscall.byname call them by that
+ * number. Looking them up by name goes through a hash index, open addressing on map_hash() of the name.
+ */
+
+#define SYSCALL_INDEX_MIN_SIZE 32
+
+static void syscall_index_insert(CPU_State* state, vm_type_t i) {
+    vm_type_t mask = state->syscall_index_size - 1;
+    vm_type_t slot = state->syscall_table[i].hash & mask;
+    while (state->syscall_index[slot] != VM_UNSIGNED_MAX) {
+        slot = (slot + 1) & mask;
+    }
+    state->syscall_index[slot] = i;
+}
+
+static void syscall_index_rebuild(CPU_State* state, vm_type_t size) {
+    free(state->syscall_index);
+    state->syscall_index = malloc(size * sizeof(vm_type_t));
+    state->syscall_index_size = size;
+    for (vm_type_t slot = 0; slot < size; slot++) {
+        state->syscall_index[slot] = VM_UNSIGNED_MAX;
+    }
+    for (vm_type_t i = 0; i < state->num_syscalls; i++) {
+        if (state->syscall_table[i].name != NULL) {
+            syscall_index_insert(state, i);
+        }
+    }
+}
+
+static vm_syscall_table_t *syscall_add(CPU_State* state, const char* name) {
+    if (state->num_syscalls == state->syscall_table_size) {
+        state->syscall_table_size = state->syscall_table_size == 0 ? 16 : state->syscall_table_size * 2;
+        state->syscall_table = k_realloc(state->memory, state->syscall_table,
+                                         sizeof(vm_syscall_table_t) * state->syscall_table_size);
+    }
+
+    vm_type_t i = state->num_syscalls++;
+    state->syscall_table[i] = (vm_syscall_table_t) { .name = name, .hash = map_hash(name) };
+
+    if (state->num_syscalls * 2 > state->syscall_index_size) {
+        syscall_index_rebuild(state, state->syscall_index_size == 0 ? SYSCALL_INDEX_MIN_SIZE
+                                                                    : state->syscall_index_size * 2);
+    } else {
+        syscall_index_insert(state, i);
+    }
+    return &state->syscall_table[i];
+}
+
 int register_syscall(CPU_State* state, const char* name, vm_syscall_t fn) {
-    state->num_syscalls++;
-    state->syscall_table = k_realloc(state->memory, state->syscall_table, sizeof(vm_syscall_table_t) * state->num_syscalls);
-    state->syscall_table[state->num_syscalls - 1].name = name;
-    state->syscall_table[state->num_syscalls - 1].fn = fn;
+    syscall_add(state, name)->fn = fn;
+    return state->num_syscalls;
+}
+
+/*
+ * Registers a syscall that takes num_args arguments of the given types and returns a result of result_type. Returns
+ * the number of syscalls, or 0 if the declaration is not valid.
+ */
+int register_syscall_typed(CPU_State* state, const char* name, vm_syscall_typed_t fn, vm_syscall_type_t result_type,
+                           int num_args, const vm_syscall_type_t *arg_types) {
+    if (num_args < 0 || num_args > VM_SYSCALL_MAX_ARGS || result_type == VM_SYSCALL_STRING) {
+        return 0;
+    }
+    unsigned char types[VM_SYSCALL_MAX_ARGS] = { 0 };
+    for (int i = 0; i < num_args; i++) {
+        if (arg_types[i] == VM_SYSCALL_EMPTY) {
+            return 0;
+        }
+        types[i] = (unsigned char) arg_types[i];
+    }
+
+    vm_syscall_table_t *entry = syscall_add(state, name);
+    entry->typed_fn = fn;
+    entry->result_type = (unsigned char) result_type;
+    entry->num_args = (unsigned char) num_args;
+    memcpy(entry->arg_types, types, sizeof(types));
     return state->num_syscalls;
 }
 
+/*
+ * Returns the number of the syscall with the given name, or -1 if there is none. If a name is registered twice, the
+ * first one is found.
+ */
+int find_syscall(CPU_State* state, const char* name) {
+    if (state->syscall_index_size == 0) {
+        return -1;
+    }
+
+    vm_type_t hash = map_hash(name);
+    vm_type_t mask = state->syscall_index_size - 1;
+    for (vm_type_t slot = hash & mask; state->syscall_index[slot] != VM_UNSIGNED_MAX; slot = (slot + 1) & mask) {
+        vm_syscall_table_t *entry = &state->syscall_table[state->syscall_index[slot]];
+        if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return (int) state->syscall_index[slot];
+        }
+    }
+    return -1;
+}
+
+static void syscall_released(CPU_State* state) {
+    vm_error(state, "Syscall was released");
+    vm_exit(state, EXIT_FAILURE);
+}
+
+/*
+ * The number of a released syscall is not reused, instructions that were rewritten to call it by number (see
+ * syscall.byname) fail instead of calling another syscall.
+ */
 int release_syscall(CPU_State* state, const char* name) {
-    for (int i = 0; i < state->num_syscalls; i++) {
-        if (strcmp(state->syscall_table[i].name, name) == 0) {
-            for (int j = i + 1; j < state->num_modules; j++) {
-                state->modules[j - 1] = state->modules[j];
-            }
-            state->num_modules--;
-            state->modules = k_realloc(state->memory, state->modules, sizeof(Module) * state->num_modules);
-            return 1;
+    int i = find_syscall(state, name);
+    if (i < 0) {
+        return 0;
+    }
+
+    state->syscall_table[i] = (vm_syscall_table_t) { .name = NULL, .fn = syscall_released };
+    syscall_index_rebuild(state, state->syscall_index_size);
+    return 1;
+}
+
+void destroy_syscalls(CPU_State* state) {
+    k_free(state->memory, state->syscall_table);
+    free(state->syscall_index);
+    state->syscall_table = NULL;
+    state->syscall_index = NULL;
+    state->num_syscalls = state->syscall_table_size = state->syscall_index_size = 0;
+}
+
+static const char *syscall_type_names[] = { "empty", "integer", "unsigned integer", "float", "string", "value" };
+
+/*
+ * Unboxes the arguments of a typed syscall from the stack, calls it and stores the result in rr.
+ */
+static void syscall_call_typed(CPU_State* state, vm_syscall_table_t *entry) {
+    vm_syscall_value_t args[VM_SYSCALL_MAX_ARGS];
+    USE_STACK();
+    if ((state->sp + sizeof(vm_type_signed_t) - state->stack_base) / sizeof(vm_value_t) < entry->num_args) {
+        vm_error(state, "Not enough values on the stack for syscall '%s'", entry->name);
+        vm_exit(state, EXIT_FAILURE);
+        return;
+    }
+    vm_value_t *first = stack + 1 - entry->num_args;
+
+    for (int i = 0; i < entry->num_args; i++) {
+        vm_value_t *arg = first + i;
+        switch (entry->arg_types[i]) {
+            case VM_SYSCALL_INT:
+            case VM_SYSCALL_UINT:
+                if (arg->type != VM_TYPE_INT && arg->type != VM_TYPE_UINT) goto mismatch;
+                args[i].uint_value = arg->uint_value;
+                break;
+            case VM_SYSCALL_FLOAT:
+                if (arg->type != VM_TYPE_FLOAT) goto mismatch;
+                args[i].float_value = arg->float_value;
+                break;
+            case VM_SYSCALL_STRING:
+                if (arg->type != VM_TYPE_STRING) goto mismatch;
+                args[i].string.chars = cstr_pointer_from_vm_value(state, arg);
+                args[i].string.length = str_length(state, arg->pointer_value);
+                break;
+            default:
+                args[i].value = *arg;
+                break;
         }
+        continue;
+
+    mismatch:
+        vm_error(state, "Syscall '%s' expects a %s as argument %d", entry->name,
+                 syscall_type_names[entry->arg_types[i]], i + 1);
+        vm_exit(state, EXIT_FAILURE);
+        return;
     }
 
-    return 0;
+    vm_syscall_value_t result = entry->typed_fn(state, args);
+    switch (entry->result_type) {
+        case VM_SYSCALL_INT:
+            state->rr = (vm_value_t) { .type = VM_TYPE_INT, .int_value = result.int_value };
+            break;
+        case VM_SYSCALL_UINT:
+            state->rr = (vm_value_t) { .type = VM_TYPE_UINT, .uint_value = result.uint_value };
+            break;
+        case VM_SYSCALL_FLOAT:
+            state->rr = (vm_value_t) { .type = VM_TYPE_FLOAT, .float_value = result.float_value };
+            break;
+        case VM_SYSCALL_VALUE:
+            state->rr = result.value;
+            break;
+        default:
+            break;
+    }
+}
+
+static inline void syscall_call(CPU_State* state, vm_type_t i) {
+    vm_syscall_table_t *entry = &state->syscall_table[i];
+    if (entry->typed_fn != NULL) {
+        syscall_call_typed(state, entry);
+    } else {
+        entry->fn(state);
+    }
 }
 
 INSTR(syscall) {
-    state->syscall_table[GET_OPERAND()].fn(state);
+    syscall_call(state, GET_OPERAND());
 }
 
 INSTR(syscall_pop) {
     AJS_STACK(-1);
     USE_STACK();
-    state->syscall_table[(stack + 1)->int_value].fn(state);
+    syscall_call(state, (vm_type_t) (stack + 1)->int_value);
 }
 
 INSTR(syscall_getindex) {
-    char *name = (char*)state->memory->main_memory + get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
+    char *name = (char*)state->memory->main_memory + GET_OPERAND() + sizeof(vm_type_t);
 
     AJS_STACK(+1);
     USE_STACK();
 
-    for (int i = 0; i < state->num_syscalls; i++) {
-        if (strcmp(state->syscall_table[i].name, name) == 0) {
-            *stack = (vm_value_t) {
-                    .type = VM_TYPE_INT,
-                    .int_value = i
-            };
-            return;
-        }
-    }
-
     *stack = (vm_value_t) {
             .type = VM_TYPE_INT,
-            .int_value = -1
+            .int_value = find_syscall(state, name)
     };
 }
 
 INSTR(syscall_getindex_pop) {
     USE_STACK();
 
-    char *name = cstr_pointer_from_vm_value(state, stack);
-
-    for (int i = 0; i < state->num_syscalls; i++) {
-        if (strcmp(state->syscall_table[i].name, name) == 0) {
-            release(state, stack);
-            *stack = (vm_value_t) {
-                    .type = VM_TYPE_INT,
-                    .int_value = i
-            };
-            return;
-        }
+    int i = find_syscall(state, cstr_pointer_from_vm_value(state, stack));
+    if (i >= 0) {
+        release(state, stack);
     }
 
     *stack = (vm_value_t) {
             .type = VM_TYPE_INT,
-            .int_value = -1
+            .int_value = i
     };
 }
+
 #define VM_SYSCALL_REWRITE_BYNAME  1
 #define VM_INSTR_SYSCALL           0x0E
 
 INSTR(syscall_byname) {
-    char *name = (char*)state->memory->main_memory + get_current_module(state)->addr + GET_OPERAND() + sizeof(vm_type_t);
-
-    #if !VM_SYSCALL_REWRITE_BYNAME
-        for (int i = 0; i < state->num_syscalls; i++) {
-            if (strcmp(state->syscall_table[i].name, name) == 0) {
-                state->syscall_table[i].fn(state);
-                return;
-            }
-        }
-    #else
-        for (vm_type_t i = 0; i < state->num_syscalls; i++) {
-            if (strcmp(state->syscall_table[i].name, name) == 0) {
-                // rewrite this machine instruction to call the index next time, instead of doing this string lookup
-                // version which is much slower.
-                unsigned char* instr = (state->memory->main_memory + state->pc - sizeof(vm_type_t) - 1);
-                vm_type_t* index = (vm_type_t*)(state->memory->main_memory + state->pc - sizeof(vm_type_t));
-                *instr = VM_INSTR_SYSCALL;
-                *index = i;
-
-                state->syscall_table[i].fn(state);
-                return;
-            }
-        }
-    #endif
-
+    char *name = (char*)state->memory->main_memory + GET_OPERAND() + sizeof(vm_type_t);
 
+    int i = find_syscall(state, name);
+    if (i >= 0) {
+    #if VM_SYSCALL_REWRITE_BYNAME
+        // rewrite the decoded instruction to call the index next time, instead of doing this string lookup
+        // version which is much slower. The bytecode itself is left untouched.
+        state->instr->opcode = VM_INSTR_SYSCALL;
+        state->instr->impl = instruction_implementations[VM_INSTR_SYSCALL];
+        state->instr->operands[0].uint_value = (vm_type_t) i;
+    #endif
+        syscall_call(state, (vm_type_t) i);
+        return;
+    }
 
     vm_error(state, "Invalid syscall '%s'", name);
     vm_exit(state, EXIT_FAILURE);
@@ -7,6 +7,7 @@
 
 #include "funkyvm/funkyvm.h"
 
+double get_wall_time();
 double get_cpu_time();
 double performance_test_run(CPU_State *state, int iterations);
 
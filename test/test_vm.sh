@@ -7,7 +7,38 @@ run_test_expect() {
     echo -e "st.reg %r0\nlocals.cleanup\nld.reg %r0\ntrap 2\npop\n" >> .tmp_test.fasm
     printf "%-50s" "$1"
     ${DIR}/funky-as .tmp_test.fasm -o .tmp_test.funk
-    output=$(${DIR}/funky-vm .tmp_test)
+    output=$(${DIR}/funky-vm $VM_OPTIONS .tmp_test 2>&1)
+	output="${output//$'\r\n'/$'\n'}"
+    # VM_FILTER is a sed expression for output that depends on the layout the assembler chose, like code offsets
+    if [ -n "$VM_FILTER" ]; then
+        output=$(sed -E "$VM_FILTER" <<< "$output")
+    fi
+    if [ "$2" == "$output" ]; then
+        echo -e "[  \033[32mOK\033[0m  ] ${output//$'\n'/\\\\n}"
+    else
+        echo -e "[ \033[31mFAIL\033[0m ] ${output//$'\n'/\\\\n}"
+    fi
+
+    rm .tmp_test.fasm .tmp_test.funk $TEST_MODULES
+    TEST_MODULES=""
+}
+
+# assembles .tmp_<name>.funk from stdin for the next test to link to, which removes it again
+add_module() {
+    cat /dev/stdin > .tmp_$1.fasm
+    ${DIR}/funky-as .tmp_$1.fasm -o .tmp_$1.funk
+    rm .tmp_$1.fasm
+    TEST_MODULES="$TEST_MODULES .tmp_$1.funk"
+}
+
+# runs the test, which saves a snapshot to .tmp_test.snap, then restores it; the output of both runs is compared
+run_test_snapshot() {
+    echo -e "locals.res 0\n\n" > .tmp_test.fasm
+    cat /dev/stdin >> .tmp_test.fasm
+    echo -e "st.reg %r0\nlocals.cleanup\nld.reg %r0\ntrap 2\npop\n" >> .tmp_test.fasm
+    printf "%-50s" "$1"
+    ${DIR}/funky-as .tmp_test.fasm -o .tmp_test.funk
+    output=$(${DIR}/funky-vm $VM_OPTIONS .tmp_test 2>&1; ${DIR}/funky-vm $VM_OPTIONS --restore .tmp_test.snap 2>&1)
 	output="${output//$'\r\n'/$'\n'}"
     if [ "$2" == "$output" ]; then
         echo -e "[  \033[32mOK\033[0m  ] ${output//$'\n'/\\\\n}"
@@ -15,7 +46,7 @@ run_test_expect() {
         echo -e "[ \033[31mFAIL\033[0m ] ${output//$'\n'/\\\\n}"
     fi
 
-    rm .tmp_test.fasm .tmp_test.funk
+    rm -f .tmp_test.fasm .tmp_test.funk .tmp_test.snap
 }
 
 ITERATIONS=10000000
@@ -23,15 +54,18 @@ run_test_performance() {
     cat /dev/stdin >> .tmp_test.fasm
     printf "%-50s" "$1"
     ${DIR}/funky-as .tmp_test.fasm -o .tmp_test.funk
-    output=$(${DIR}/funky-vm --performance-test $ITERATIONS .tmp_test)
+    output=$(${DIR}/funky-vm $VM_OPTIONS --performance-test $ITERATIONS .tmp_test)
 	  output="${output//$'\r\n'/$'\n'}"
     echo -e "${output//$'\n'/\\\\n}"
-    rm .tmp_test.fasm .tmp_test.funk
+    rm .tmp_test.fasm .tmp_test.funk $TEST_MODULES
+    TEST_MODULES=""
 }
 
 RUN_TEST=run_test_expect
+RUN_SNAPSHOT_TEST=run_test_snapshot
 if [[ -n "$1" && $1 = "--performance" ]]; then
   RUN_TEST=run_test_performance
+  RUN_SNAPSHOT_TEST=:
 fi
 
 $RUN_TEST "simple ldc 1" 4 << EOF
@@ -720,3 +754,1481 @@ st.reg %r0
 locals.cleanup
 ld.reg %r0
 EOF
+
+# the inlined handlers only take ints (and floats of the same type), the other combinations go to the implementations
+$RUN_TEST "Dispatch (mixed types in inlined instructions)" "xx14.000000" << EOF
+locals.res 2
+ld.int 7
+ld.float 0.5
+add
+ld.uint 2
+mul
+ld.int 3
+sub
+st.local 0
+ld.int 2
+ld.float 2.5
+lt
+ld.uint 3
+ld.int 3
+eq
+add
+ld.str "x"
+dup
+add
+swp
+ld.local 0
+add
+add
+st.local 1
+ld.int 0
+ld.float 0.0
+lt
+brtrue wrong
+ld.local 1
+ld.str "-"
+pop
+jmp done
+wrong:
+ld.str "wrong"
+done:
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+add_module lib << EOF
+.export count
+count:
+args.accept 1
+locals.res 1
+ld.int 0
+st.local 0
+loop:
+ld.local 0
+ld.arg 0
+lt
+brfalse out
+ld.local 0
+ld.int 1
+add
+st.local 0
+jmp loop
+out:
+ld.local 0
+ld.int 10
+mul
+st.reg %rr
+locals.cleanup
+args.cleanup
+ret
+EOF
+# the branches in the module are relocated to where it was loaded
+$RUN_TEST "Modules (branches in a linked module)" 110 << EOF
+link ".tmp_lib"
+ld.mapitem "count"
+st.reg %r1
+ld.int 4
+ld.reg %r1
+call.pop 1
+ld.reg %rr
+ld.int 7
+ld.reg %r1
+call.pop 1
+ld.reg %rr
+add
+EOF
+
+# the fused sequences only handle ints, a string or a float in the local has to take the regular path
+VM_OPTIONS="--list-fusions" $RUN_TEST "Superinstructions (other types than int)" \
+    $'ab12\nSuperinstructions formed at load in module .tmp_test:\n       3  ld.local, ld.int, add, st.local\n       1  ld.local, ld.int, lt, brfalse\n       1  ld.local, ld.int, lt, brtrue' << EOF
+locals.res 2
+ld.int 0
+st.local 0
+loop:
+ld.local 0
+ld.int 1
+add
+st.local 0
+ld.local 0
+ld.int 10
+lt
+brtrue loop
+
+ld.str "ab"
+st.local 1
+ld.local 1
+ld.int 1
+add
+st.local 1
+
+ld.float 0.5
+st.local 0
+ld.local 0
+ld.int 1
+lt
+brfalse skip
+ld.local 1
+ld.int 2
+add
+st.local 1
+skip:
+ld.local 1
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+# the add and lt sites quicken for the types they see first, and have to give that up when other types come along
+$RUN_TEST "Quickening (types change at a site)" "5 3.750000 a1 9 101" << EOF
+ld.int 2
+ld.int 3
+call f, 2
+ld.reg %rr
+conv.str
+syscall.byname "print"
+pop
+ld.float 1.5
+ld.float 2.25
+call f, 2
+ld.str " "
+syscall.byname "print"
+pop
+ld.reg %rr
+conv.str
+syscall.byname "print"
+pop
+ld.str "a"
+ld.int 1
+call f, 2
+ld.str " "
+syscall.byname "print"
+pop
+ld.reg %rr
+conv.str
+syscall.byname "print"
+pop
+ld.int 4
+ld.int 5
+call f, 2
+ld.str " "
+syscall.byname "print"
+pop
+ld.reg %rr
+conv.str
+syscall.byname "print"
+pop
+ld.str " "
+syscall.byname "print"
+pop
+
+ld.int 1
+ld.int 2
+call lt, 2
+ld.reg %rr
+ld.float 2.5
+ld.float 1.5
+call lt, 2
+ld.reg %rr
+ld.float 0.5
+ld.float 1.5
+call lt, 2
+ld.reg %rr
+ld.int 10
+mul
+add
+ld.int 10
+mul
+add
+jmp end
+
+f:
+args.accept 2
+ld.arg 0
+ld.arg 1
+add
+st.reg %rr
+args.cleanup
+ret
+
+lt:
+args.accept 2
+ld.arg 0
+ld.arg 1
+lt
+st.reg %rr
+args.cleanup
+ret
+
+end:
+EOF
+
+# the cache of the ld.mapitem in get sees x at a different slot in each map, and a map without x
+$RUN_TEST "Maps (inline cache, shapes change)" "1271" << EOF
+locals.res 2
+ld.map
+st.local 0
+ld.int 1
+ld.local 0
+st.mapitem "x"
+ld.map
+st.local 1
+ld.int 5
+ld.local 1
+st.mapitem "y"
+ld.int 2
+ld.local 1
+st.mapitem "x"
+
+ld.local 0
+call get, 1
+ld.reg %rr
+conv.str
+syscall.byname "print"
+pop
+ld.local 1
+call get, 1
+ld.reg %rr
+conv.str
+syscall.byname "print"
+pop
+
+ld.local 0
+del.mapitem "x"
+ld.int 3
+ld.local 0
+st.mapitem "z"
+ld.int 7
+ld.local 0
+st.mapitem "x"
+ld.local 0
+call get, 1
+ld.reg %rr
+conv.str
+syscall.byname "print"
+pop
+
+ld.local 1
+map.renamekey "x", "w"
+ld.local 1
+call get, 1
+ld.reg %rr
+is.empty
+st.reg %r0
+pop
+ld.reg %r0
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+jmp end
+
+get:
+args.accept 1
+ld.arg 0
+ld.mapitem "x"
+st.reg %rr
+args.cleanup
+ret
+
+end:
+EOF
+
+VM_OPTIONS="--list-map-caches" VM_FILTER="s/0x[0-9a-f]{8}/offset/" $RUN_TEST "Maps (inline cache, list)" \
+    $'10\nMap item caches in module .tmp_test:\n  offset  x                     hits          0  misses          1  shapes 1\n  offset  x                     hits          9  misses          1  shapes 1' << EOF
+locals.res 3
+ld.map
+st.local 0
+ld.int 1
+ld.local 0
+st.mapitem "x"
+ld.int 0
+st.local 1
+ld.int 0
+st.local 2
+loop:
+ld.local 0
+ld.mapitem "x"
+ld.local 2
+add
+st.local 2
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 10
+lt
+brtrue loop
+ld.local 2
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+$RUN_TEST "Maps (rename key, indexed)" 35 << EOF
+locals.res 2
+ld.map
+st.local 0
+ld.int 0
+st.local 1
+fill:
+ld.local 1
+ld.local 0
+ld.local 1
+st.arrelem
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 20
+lt
+brtrue fill
+
+ld.local 0
+map.renamekey "3", "x"
+ld.local 0
+map.renamekey "5", "3"
+
+ld.local 0
+ld.mapitem "x"
+ld.int 10
+mul
+ld.local 0
+ld.mapitem "3"
+add
+ld.local 0
+has.mapitem "5"
+add
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+$RUN_TEST "Maps (string constants as keys)" 43 << EOF
+locals.res 1
+ld.map
+st.local 0
+ld.int 42
+ld.local 0
+st.mapitem "name"
+ld.int 1
+ld.local 0
+ld.str "other"
+st.arrelem
+
+ld.local 0
+ld.str "name"
+ld.arrelem
+ld.local 0
+ld.mapitem "other"
+add
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+$RUN_TEST "Strings (constants can not be modified)" \
+    $'Error: Error: string is a constant or a map key and can not be modified\n  at (null):-1:-1' << EOF
+ld.int 120
+ld.str "abc"
+ld.int 0
+st.arrelem
+ld.int 0
+EOF
+
+# the string is used as a key before and after a character changes, so its hash has to be forgotten; storing a NUL
+# cuts the string short, which strlen and eq have to see
+$RUN_TEST "Strings (modified after hashing, NUL stored)" "6x" << EOF
+locals.res 2
+ld.str "ab"
+ld.str "c"
+add
+st.local 0
+ld.map
+st.local 1
+ld.int 1
+ld.local 1
+st.mapitem "abc"
+ld.int 2
+ld.local 1
+st.mapitem "xbc"
+ld.local 1
+ld.local 0
+ld.arrelem
+ld.int 120
+ld.local 0
+ld.int 0
+st.arrelem
+ld.local 1
+ld.local 0
+ld.arrelem
+add
+ld.local 0
+ld.str "xbc"
+eq
+add
+ld.local 0
+ld.str "abc"
+eq
+add
+ld.int 0
+ld.local 0
+ld.int 1
+st.arrelem
+ld.local 0
+strlen
+add
+ld.local 0
+ld.str "x"
+eq
+add
+ld.local 0
+ld.str "xbc"
+eq
+add
+conv.str
+ld.local 0
+add
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+$RUN_TEST "Arrays (reserve, then grow past it)" 1020 << EOF
+locals.res 2
+ld.arr 0
+ld.int 2
+arr.reserve
+st.local 0
+ld.int 0
+st.local 1
+fill:
+ld.local 1
+ld.local 0
+ld.local 1
+st.arrelem
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 10
+lt
+brtrue fill
+
+ld.local 0
+arr.len
+ld.int 100
+mul
+ld.local 0
+ld.int 1
+ld.arrelem
+add
+ld.local 0
+ld.int 9
+ld.arrelem
+add
+ld.local 0
+ld.int 20
+arr.reserve
+arr.len
+add
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+# every job gets a VM with a heap of its own, the workers fill them at the same time
+VM_OPTIONS="--workers=4 --repeat 16" VM_FILTER="/^worker/d; s/ in +[0-9.]+s, +[0-9.]+ jobs\/sec//" \
+    $RUN_TEST "Workers (VMs side by side)" "$(printf 'total:         16 jobs (0 failed) on 4 workers'; printf '\n44850%.0s' {1..16})" << EOF
+locals.res 3
+ld.map
+st.local 0
+ld.int 0
+st.local 1
+fill:
+ld.local 1
+ld.local 0
+ld.str "k"
+ld.local 1
+add
+st.arrelem
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 300
+lt
+brtrue fill
+ld.int 0
+st.local 1
+ld.int 0
+st.local 2
+sum:
+ld.local 0
+ld.str "k"
+ld.local 1
+add
+ld.arrelem
+ld.local 2
+add
+st.local 2
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 300
+lt
+brtrue sum
+ld.local 2
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+# kernels take turns in the queues; which worker runs (or steals) a job differs from run to run
+VM_OPTIONS="--workers=3 --repeat 4 .tmp_missing" VM_FILTER="/^worker/d; s/ in +[0-9.]+s, +[0-9.]+ jobs\/sec//" \
+    $RUN_TEST "Workers (failing jobs)" "$(printf 'Error: Module not found: .tmp_missing\n%.0s' {1..4}; printf 'total:          8 jobs (4 failed) on 3 workers'; printf '\n44850%.0s' {1..4})" << EOF
+locals.res 3
+ld.map
+st.local 0
+ld.int 0
+st.local 1
+fill:
+ld.local 1
+ld.local 0
+ld.str "k"
+ld.local 1
+add
+st.arrelem
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 300
+lt
+brtrue fill
+ld.int 0
+st.local 1
+ld.int 0
+st.local 2
+sum:
+ld.local 0
+ld.str "k"
+ld.local 1
+add
+ld.arrelem
+ld.local 2
+add
+st.local 2
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 300
+lt
+brtrue sum
+ld.local 2
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+VM_OPTIONS="--list-allocations" $RUN_TEST "Allocations (size classes)" \
+    $'44850\nAllocations:\n    16 bytes  allocs        309  frees        302  live        7  pages    1\n    32 bytes  allocs        600  frees        600  live        0  pages    1\n    48 bytes  allocs       1200  frees       1200  live        0  pages    1\n    64 bytes  allocs          0  frees          0  live        0  pages    0\n    96 bytes  allocs          1  frees          1  live        0  pages    1\n   128 bytes  allocs          1  frees          0  live        1  pages    1\n   192 bytes  allocs          0  frees          0  live        0  pages    0\n   256 bytes  allocs          0  frees          0  live        0  pages    0\n  large       allocs          6  frees          4  live        2' << EOF
+locals.res 3
+ld.map
+st.local 0
+ld.int 0
+st.local 1
+fill:
+ld.local 1
+ld.local 0
+ld.str "k"
+ld.local 1
+add
+st.arrelem
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 300
+lt
+brtrue fill
+ld.int 0
+st.local 1
+ld.int 0
+st.local 2
+sum:
+ld.local 0
+ld.str "k"
+ld.local 1
+add
+ld.arrelem
+ld.local 2
+add
+st.local 2
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 300
+lt
+brtrue sum
+ld.local 2
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+# the heap has no room for a fourth array, so it has to go where the second one was, across a word of the page bitmap
+VM_OPTIONS="--heap-size 1M --max-heap-size 1M" $RUN_TEST "Heap (reuse a run of pages)" 1 << EOF
+locals.res 4
+ld.arr 0
+ld.int 40000
+arr.reserve
+st.local 0
+ld.arr 0
+ld.int 40000
+arr.reserve
+st.local 1
+ld.arr 0
+ld.int 40000
+arr.reserve
+st.local 2
+ld.empty
+st.local 1
+ld.arr 0
+ld.int 40000
+arr.reserve
+st.local 3
+ld.int 1
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+VM_OPTIONS="--heap-size 64k --max-heap-size 2M" $RUN_TEST "Heap (grow past the initial size)" 40000 << EOF
+locals.res 2
+ld.arr 0
+st.local 0
+ld.int 0
+st.local 1
+fill:
+ld.local 1
+ld.local 0
+ld.local 1
+st.arrelem
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 40000
+lt
+brtrue fill
+ld.local 0
+arr.len
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+VM_OPTIONS="--heap-size 64k --max-heap-size 256k" $RUN_TEST "Heap (grow past the maximum size)" \
+    $'Error: Memory exhausted\n  at <unknown>:0:0' << EOF
+locals.res 2
+ld.arr 0
+st.local 0
+ld.int 0
+st.local 1
+fill:
+ld.local 1
+ld.local 0
+ld.local 1
+st.arrelem
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 40000
+lt
+brtrue fill
+ld.local 0
+arr.len
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+VM_OPTIONS="--max-stack-size 64k" $RUN_TEST "Stack (grow, stale reference in the heap)" \
+    $'Error: Can\'t dereference a stack slot the stack has grown out of\n  at (null):-1:-1' << EOF
+locals.res 2
+ld.int 42
+st.local 0
+ld.arr 0
+st.local 1
+ld.lref 0
+ld.local 1
+ld.int 0
+st.arrelem
+
+ld.int 2000
+call f, 1
+ld.map
+pop
+ld.reg %rr
+ld.local 1
+ld.int 0
+ld.arrelem
+deref
+is.empty
+st.reg %r1
+pop
+ld.reg %r1
+add
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+jmp end
+
+f:
+args.accept 1
+ld.arg 0
+brfalse base
+ld.arg 0
+ld.int 1
+sub
+call f, 1
+ld.reg %rr
+ld.int 1
+add
+st.reg %rr
+jmp out
+base:
+ld.int 0
+st.reg %rr
+out:
+args.cleanup
+ret
+
+end:
+EOF
+
+VM_OPTIONS="--stack-size 1k --max-stack-size 64k" $RUN_TEST "Stack (grow, deep recursion)" 1500 << EOF
+ld.int 1500
+call f, 1
+ld.reg %rr
+jmp end
+
+f:
+args.accept 1
+ld.arg 0
+brfalse base
+ld.arg 0
+ld.int 1
+sub
+call f, 1
+ld.reg %rr
+ld.int 1
+add
+st.reg %rr
+jmp out
+base:
+ld.int 0
+st.reg %rr
+out:
+args.cleanup
+ret
+
+end:
+EOF
+
+VM_OPTIONS="--max-stack-size 8k" $RUN_TEST "Stack (overflow)" $'Error: Stack overflow: more than 1024 values\n  at (null):-1:-1' << EOF
+ld.int 1500
+call f, 1
+ld.reg %rr
+jmp end
+
+f:
+args.accept 1
+ld.arg 0
+brfalse base
+ld.arg 0
+ld.int 1
+sub
+call f, 1
+ld.reg %rr
+ld.int 1
+add
+st.reg %rr
+jmp out
+base:
+ld.int 0
+st.reg %rr
+out:
+args.cleanup
+ret
+
+end:
+EOF
+
+# without the collector, the dropped cycles fill the heap before the loop ends
+VM_OPTIONS="--heap-size 256k --max-heap-size 256k --cycle-threshold 10 --list-cycles" \
+$RUN_TEST "Cycles (maps and arrays, collected)" \
+    $'10000\nCycle collections: 3333 (threshold 10), 33330 candidate roots, freed 19998 maps and 9999 arrays' << EOF
+locals.res 3
+ld.int 0
+st.local 2
+loop:
+ld.map
+st.local 0
+ld.map
+st.local 1
+ld.local 1
+ld.local 0
+st.mapitem "child"
+ld.local 0
+ld.local 1
+st.mapitem "parent"
+ld.arr 0
+st.local 1
+ld.local 1
+ld.local 1
+ld.int 0
+st.arrelem
+ld.local 2
+ld.int 1
+add
+st.local 2
+ld.local 2
+ld.int 10000
+lt
+brtrue loop
+
+ld.local 2
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+# each chain is freed one array per safe point while the next one is built, the heap does not fit two of them
+VM_OPTIONS="--release-slice 1 --heap-size 8M --max-heap-size 8M" $RUN_TEST "Release (in slices)" 200000 << EOF
+locals.res 3
+ld.int 0
+st.local 2
+again:
+ld.int 0
+st.local 0
+ld.int 0
+st.local 1
+build:
+ld.local 0
+ld.arr 1
+st.local 0
+ld.local 1
+ld.int 1
+add
+st.local 1
+ld.local 1
+ld.int 50000
+lt
+brtrue build
+ld.empty
+st.local 0
+ld.local 2
+ld.int 1
+add
+st.local 2
+ld.local 2
+ld.int 4
+lt
+brtrue again
+ld.local 1
+ld.local 2
+mul
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+add_module lib << EOF
+.export name
+name:
+ld.str "lib"
+st.reg %rr
+ret
+EOF
+add_module other << EOF
+.export nothing
+nothing:
+ld.int 1
+ld.int 2
+ld.int 3
+ld.int 4
+ld.int 5
+ld.int 6
+ld.int 7
+ld.int 8
+ld.int 9
+ld.int 10
+ld.int 11
+ld.int 12
+ld.int 13
+ld.int 14
+ld.int 15
+ld.int 16
+ret
+EOF
+# the string constant has to outlive the module it came from, which is unmapped
+$RUN_TEST "Modules (string constant of an unlinked module)" "lib!3" << EOF
+locals.res 1
+link ".tmp_lib"
+ld.mapitem "name"
+call.pop 0
+ld.reg %rr
+st.local 0
+unlink ".tmp_lib"
+link ".tmp_other"
+pop
+ld.local 0
+ld.str "!"
+add
+ld.local 0
+strlen
+add
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+add_module lib << EOF
+.export count
+count:
+args.accept 1
+locals.res 1
+ld.int 0
+st.local 0
+loop:
+ld.local 0
+ld.arg 0
+lt
+brfalse out
+ld.local 0
+ld.int 1
+add
+st.local 0
+jmp loop
+out:
+ld.local 0
+ld.int 10
+mul
+st.reg %rr
+locals.cleanup
+args.cleanup
+ret
+EOF
+# the number of probes depends on the search paths of the platform
+VM_OPTIONS="--list-module-cache" VM_FILTER="s/[0-9]+ file system probes/probes/" $RUN_TEST "Modules (resolution cache)" \
+    $'1\nModule resolution: probes, 1 cache hits, 3 names cached (1 not found)' << EOF
+ld.str ".tmp_missing"
+mod.exists
+ld.str ".tmp_missing"
+mod.exists
+add
+ld.str ".tmp_lib"
+mod.exists
+add
+EOF
+
+add_module lib << EOF
+.export count
+count:
+args.accept 1
+locals.res 1
+ld.int 0
+st.local 0
+loop:
+ld.local 0
+ld.arg 0
+lt
+brfalse out
+ld.local 0
+ld.int 1
+add
+st.local 0
+jmp loop
+out:
+ld.local 0
+ld.int 10
+mul
+st.reg %rr
+locals.cleanup
+args.cleanup
+ret
+EOF
+VM_OPTIONS="--scan-library-paths --list-module-cache" \
+    VM_FILTER="s/[0-9]+ file system probes/probes/; s/[0-9]+ names cached/names cached/" \
+    $RUN_TEST "Modules (resolution cache, search paths scanned)" \
+    $'1\nModule resolution: probes, 3 cache hits, names cached (1 not found), search paths scanned' << EOF
+ld.str ".tmp_missing"
+mod.exists
+ld.str ".tmp_missing"
+mod.exists
+add
+ld.str ".tmp_lib"
+mod.exists
+add
+EOF
+
+add_module lib << EOF
+.export count
+count:
+args.accept 1
+locals.res 1
+ld.int 0
+st.local 0
+loop:
+ld.local 0
+ld.arg 0
+lt
+brfalse out
+ld.local 0
+ld.int 1
+add
+st.local 0
+jmp loop
+out:
+ld.local 0
+ld.int 10
+mul
+st.reg %rr
+locals.cleanup
+args.cleanup
+ret
+EOF
+add_module other << EOF
+.export nothing
+nothing:
+ld.int 1
+ld.int 2
+ld.int 3
+ld.int 4
+ld.int 5
+ld.int 6
+ld.int 7
+ld.int 8
+ld.int 9
+ld.int 10
+ld.int 11
+ld.int 12
+ld.int 13
+ld.int 14
+ld.int 15
+ld.int 16
+ret
+EOF
+# the ld.extern in use resolves to the module's first address, which is gone once the module is linked again
+$RUN_TEST "Modules (ld.extern, module linked again)" 60 << EOF
+link ".tmp_lib"
+pop
+ld.int 1
+call use, 1
+ld.reg %rr
+ld.int 2
+call use, 1
+ld.reg %rr
+add
+unlink ".tmp_lib"
+link ".tmp_other"
+pop
+link ".tmp_lib"
+pop
+ld.int 3
+call use, 1
+ld.reg %rr
+add
+jmp end
+
+use:
+args.accept 1
+ld.arg 0
+ld.extern ".tmp_lib", "count"
+call.pop 1
+args.cleanup
+ret
+
+end:
+EOF
+
+$RUN_TEST "Syscalls (typed, by name)" "hi 42" << EOF
+ld.str "hi "
+syscall.byname "print"
+pop
+ld.int 42
+EOF
+
+$RUN_TEST "Syscalls (typed, by index)" "ok1" << EOF
+ld.str "ok"
+syscall.getindex "print"
+syscall.pop
+pop
+ld.int 1
+EOF
+
+$RUN_TEST "Syscalls (index lookup)" -2 << EOF
+syscall.getindex "yield"
+syscall.getindex "nope"
+mul
+EOF
+
+$RUN_TEST "Syscalls (print any value)" "5 -3 1.500000 (map) 0" << EOF
+ld.uint 5
+syscall.byname "print"
+ld.str " "
+syscall.byname "print"
+ld.int -3
+syscall.byname "print"
+ld.str " "
+syscall.byname "print"
+ld.float 1.5
+syscall.byname "print"
+ld.str " "
+syscall.byname "print"
+ld.map
+syscall.byname "print"
+ld.str " "
+syscall.byname "print"
+ld.empty
+syscall.byname "print"
+ld.int 0
+EOF
+
+$RUN_TEST "Syscalls (typed, wrong argument type)" \
+    $'Error: Syscall \'snapshot\' expects a string as argument 1\n  at (null):-1:-1' << EOF
+ld.int 5
+syscall.byname "snapshot"
+EOF
+
+$RUN_TEST "Syscalls (typed, empty stack)" \
+    $'Error: Not enough values on the stack for syscall \'print\'\n  at (null):-1:-1' << EOF
+pop
+syscall.byname "print"
+EOF
+
+# the restored VM sees 1 in %rr after the syscall; the map and string made before the snapshot must survive allocations
+# made after it
+$RUN_SNAPSHOT_TEST "Snapshot (save and restore)" $'41 abc\n42 abc' << EOF
+locals.res 2
+ld.map
+st.local 0
+ld.int 41
+ld.local 0
+st.mapitem "x"
+ld.str " ab"
+ld.str "c"
+add
+st.local 1
+
+ld.str ".tmp_test.snap"
+syscall.byname "snapshot"
+pop
+ld.reg %rr
+ld.map
+pop
+ld.arr 0
+pop
+ld.local 0
+ld.mapitem "x"
+add
+ld.local 1
+add
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+# --slice runs the CPU in slices of N backward branches and calls (ret counts as a backward branch); the loop below
+# takes 1000 calls, 1000 returns and 999 branches back, so 30 slices of 100
+SLICE_TEST_LOOP=$(cat << EOF
+locals.res 2
+ld.int 0
+st.local 0
+ld.int 0
+st.local 1
+loop:
+ld.local 0
+call sq, 1
+ld.local 1
+ld.reg %rr
+add
+st.local 1
+ld.local 0
+ld.int 1
+add
+st.local 0
+ld.local 0
+ld.int 1000
+lt
+brtrue loop
+ld.local 1
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+jmp end
+
+sq:
+args.accept 1
+ld.arg 0
+ld.arg 0
+mul
+st.reg %rr
+args.cleanup
+ret
+
+end:
+EOF
+)
+
+$RUN_TEST "Slices (plain run)" 332833500 <<< "$SLICE_TEST_LOOP"
+VM_OPTIONS="--slice 100" $RUN_TEST "Slices (resumed, calls and branches)" $'30 slices\n332833500' <<< "$SLICE_TEST_LOOP"
+VM_OPTIONS="--slice 1" $RUN_TEST "Slices (resumed, budget of 1)" $'3000 slices\n332833500' <<< "$SLICE_TEST_LOOP"
+
+# 999 branches back and a forward jump, which does not count
+VM_OPTIONS="--slice 100" $RUN_TEST "Slices (resumed, branches)" $'10 slices\n1000' << EOF
+locals.res 1
+ld.int 0
+st.local 0
+loop:
+ld.local 0
+ld.int 1
+add
+st.local 0
+ld.local 0
+ld.int 1000
+lt
+brtrue loop
+jmp done
+done:
+ld.local 0
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+EOF
+
+# both fibers print, yield and print again; the program takes its turn in between and then waits for them
+$RUN_TEST "Fibers (spawn, yield and join)" "mabmabab" << EOF
+locals.res 2
+ld.str "a"
+ld.ref worker
+fiber.spawn 1
+st.local 0
+ld.str "b"
+ld.ref worker
+fiber.spawn 1
+st.local 1
+ld.str "m"
+syscall.byname "print"
+pop
+fiber.yield
+ld.str "m"
+syscall.byname "print"
+pop
+ld.local 0
+fiber.join
+ld.local 1
+fiber.join
+add
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+jmp end
+
+worker:
+args.accept 1
+ld.arg 0
+syscall.byname "print"
+pop
+fiber.yield
+ld.arg 0
+syscall.byname "print"
+pop
+ld.arg 0
+st.reg %rr
+args.cleanup
+ret
+
+end:
+EOF
+
+$RUN_TEST "Fibers (join a fiber that is done)" 42 << EOF
+ld.int 41
+ld.ref inc
+fiber.spawn 1
+fiber.yield
+fiber.join
+jmp end
+
+inc:
+args.accept 1
+ld.arg 0
+ld.int 1
+add
+st.reg %rr
+args.cleanup
+ret
+
+end:
+EOF
+
+$RUN_TEST "Fibers (join itself)" $'Error: Fiber 0 cannot join itself\n  at (null):-1:-1' << EOF
+ld.ref done
+fiber.spawn 0
+pop
+ld.uint 0
+fiber.join
+jmp end
+
+done:
+ret
+
+end:
+EOF
+
+$RUN_TEST "Fibers (deadlock)" $'Error: Deadlock: every fiber is waiting for another one\n  at (null):-1:-1' << EOF
+ld.uint 0
+ld.ref joiner
+fiber.spawn 1
+fiber.join
+jmp end
+
+joiner:
+args.accept 1
+ld.arg 0
+fiber.join
+args.cleanup
+ret
+
+end:
+EOF
+
+$RUN_TEST "Fibers (stack reference as argument)" \
+    $'Error: Cannot pass a reference to the stack to a new fiber\n  at (null):-1:-1' << EOF
+locals.res 1
+ld.lref 0
+ld.ref done
+fiber.spawn 1
+jmp end
+
+done:
+args.accept 1
+args.cleanup
+ret
+
+end:
+EOF
+
+# neither fiber yields, they take turns every 3 branches back
+VM_OPTIONS="--fiber-quantum 3" $RUN_TEST "Fibers (preempted)" "aaabbbaaabbbaaabbb2" << EOF
+locals.res 2
+ld.str "a"
+ld.ref printer
+fiber.spawn 1
+st.local 0
+ld.str "b"
+ld.ref printer
+fiber.spawn 1
+st.local 1
+ld.local 0
+fiber.join
+ld.local 1
+fiber.join
+add
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+jmp end
+
+printer:
+args.accept 1
+locals.res 1
+ld.int 0
+st.local 0
+loop:
+ld.arg 0
+syscall.byname "print"
+pop
+ld.local 0
+ld.int 1
+add
+st.local 0
+ld.local 0
+ld.int 9
+lt
+brtrue loop
+ld.int 1
+st.reg %rr
+locals.cleanup
+args.cleanup
+ret
+
+end:
+EOF
+
+VM_OPTIONS="--heap-size 2M --max-heap-size 2M" $RUN_TEST "Fibers (many whose stacks grow)" 200000 << EOF
+locals.res 2
+ld.int 0
+st.local 0
+ld.int 0
+st.local 1
+loop:
+ld.int 100
+ld.ref depth
+fiber.spawn 1
+fiber.join
+ld.local 1
+add
+st.local 1
+ld.local 0
+ld.int 1
+add
+st.local 0
+ld.local 0
+ld.int 2000
+lt
+brtrue loop
+ld.local 1
+st.reg %r0
+locals.cleanup
+ld.reg %r0
+jmp end
+
+depth:
+args.accept 1
+ld.arg 0
+brfalse base
+ld.arg 0
+ld.int 1
+sub
+call depth, 1
+ld.reg %rr
+ld.int 1
+add
+st.reg %rr
+jmp out
+base:
+ld.int 0
+st.reg %rr
+out:
+args.cleanup
+ret
+
+end:
+EOF